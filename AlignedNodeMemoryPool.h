@@ -0,0 +1,317 @@
+/**
+ * memory -- C++ Memory utilities
+ *
+ * @file
+ * @brief Definition of class template AlignedNodeMemoryPool.
+ *
+ * @Copyright (C) 2026  Carlo Wood.
+ *
+ * pub   dsa3072/C155A4EEE4E527A2 2018-08-16 Carlo Wood (CarloWood on Libera) <carlo@alinoe.com>
+ * fingerprint: 8020 B266 6305 EE2F D53E  6827 C155 A4EE E4E5 27A2
+ *
+ * This file is part of memory.
+ *
+ * memory is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * memory is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with memory.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+#include "PoolStats.h"
+#include "Hardening.h"
+#include "utils/macros.h"
+#include "utils/is_power_of_two.h"
+#include <array>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <mutex>
+#include <ostream>
+#include "debug.h"
+
+namespace memory {
+template<size_t BlockSize> class AlignedNodeMemoryPool;
+} // namespace memory
+
+template<size_t BlockSize>
+void* operator new(std::size_t size, memory::AlignedNodeMemoryPool<BlockSize>& pool);
+
+namespace memory {
+
+// class AlignedNodeMemoryPool
+//
+// Like NodeMemoryPool, but without a header in front of every chunk.
+//
+// NodeMemoryPool stores a pointer to the header of the block (Begin) in front of every
+// chunk (Allocated::free), so that free() and static_free() can find the block of a chunk.
+// For small objects that is a considerable overhead (33% for 24 byte objects).
+//
+// This pool allocates its blocks with an alignment that is equal to their size (BlockSize,
+// a power of two), so that the header of the block of a chunk is found by simply masking
+// the pointer with ~(BlockSize - 1). Chunks are therefore exactly `size_` bytes, which
+// also improves the cache density. The number of chunks per block follows from BlockSize.
+//
+//  begin = ptr & ~(BlockSize - 1)
+//  v
+//  | Begin | chunk | chunk | chunk | ...                                     |
+//  ^                                                                         ^
+//  aligned to BlockSize                                       begin + BlockSize
+//
+// The interface is the same as that of NodeMemoryPool (including static_free, and therefore
+// support for operator delete), except that the constructor does not take nchunks:
+//
+//   memory::AlignedNodeMemoryPool<> pool(sizeof(Foo));       // Blocks of 64 kB (the default BlockSize).
+//
+//   memory::Allocator<Foo, memory::AlignedNodeMemoryPool<>> allocator(pool);
+//
+//   class Foo {
+//    public:
+//     void operator delete(void* ptr) { memory::AlignedNodeMemoryPool<>::static_free(ptr); }
+//   };
+//   Foo* foo = new(pool) Foo;
+//
+// Contrary to NodeMemoryPool, double frees are not detected when MEMORY_HARDENED is defined
+// (there is no header to store a flag in).
+//
+template<size_t BlockSize = 0x10000>
+class AlignedNodeMemoryPool
+{
+  static_assert(utils::is_power_of_two(BlockSize), "BlockSize must be a power of two.");
+
+ private:
+  static constexpr int number_of_bins = 8;      // The number of fill levels that blocks with free chunks are sorted in.
+
+  struct FreeChunk
+  {
+    FreeChunk* next;            // The next free chunk of the same block, or nullptr.
+  };
+
+  struct Begin
+  {
+    AlignedNodeMemoryPool* pool;        // The pool that this block belongs to.
+    FreeChunk* free_list;               // The chunks of this block that were freed.
+    char* unused;                       // The first chunk that was never allocated, or nullptr if all chunks were allocated at least once.
+    ssize_t free;                       // The number of free chunks of this block (on free_list, or at or after unused).
+    Begin* prev;                        // The previous block in the same bin (or full_blocks_), or nullptr if this is the first one.
+    Begin* next;                        // The next block in the same bin (or full_blocks_), or nullptr if this is the last one.
+  };
+
+  // The offset of the first chunk in a block.
+  static constexpr size_t header_size = (sizeof(Begin) + alignof(std::max_align_t) - 1) & ~(alignof(std::max_align_t) - 1);
+
+  mutable std::mutex pool_mutex_;       // Protects the pool against concurrent accesses.
+
+  size_t size_;                         // The (fixed) size of a single chunk in bytes.
+  size_t nchunks_;                      // The number of chunks per block (known once size_ is known).
+  std::array<Begin*, number_of_bins> bins_;     // bins_[i] is the first block of a list of blocks with bin_index(free) == i.
+  uint32_t non_empty_bins_;             // Bit i is set iff bins_[i] != nullptr.
+  Begin* full_blocks_;                  // The first block of a list of blocks without free chunks.
+  size_t number_of_blocks_;             // The total number of allocated blocks.
+  size_t total_free_;                   // The current total number of free chunks in the memory pool.
+  PoolStats stats_;                     // Allocation statistics. Contention is measured on pool_mutex_.
+
+  template<size_t B>
+  friend void* ::operator new(std::size_t size, AlignedNodeMemoryPool<B>& pool);
+
+  // Return the block that ptr belongs to.
+  static Begin* begin_of(void* ptr) { return reinterpret_cast<Begin*>(reinterpret_cast<uintptr_t>(ptr) & ~(BlockSize - 1)); }
+
+  // Return the bin that a block with `free` (> 0) free chunks belongs to; the fuller a block, the lower the index.
+  int bin_index(ssize_t free) const { return (free - 1) * number_of_bins / nchunks_; }
+
+  void link_block(Begin* block, ssize_t free);
+  void unlink_block(Begin* block, ssize_t free);
+  void* alloc(size_t size);
+
+ public:
+  AlignedNodeMemoryPool(size_t chunk_size = 0) :
+    size_(0), nchunks_(0), bins_{}, non_empty_bins_(0), full_blocks_(nullptr), number_of_blocks_(0), total_free_(0)
+  {
+    if (chunk_size > 0)
+      set_size(chunk_size);
+  }
+
+  ~AlignedNodeMemoryPool();
+
+  template<class Tp>
+  Tp* malloc() { return static_cast<Tp*>(alloc(sizeof(Tp))); }
+
+  void free(void* ptr);
+  static void static_free(void* ptr) { owner(ptr)->free(ptr); }
+
+  // Return the pool that ptr was allocated from.
+  static AlignedNodeMemoryPool* owner(void* ptr) { return begin_of(ptr)->pool; }
+
+  // Accessor. Use stats().snapshot() for cheap statistics that, unlike operator<<, do not lock the pool.
+  PoolStats const& stats() const { return stats_; }
+
+  friend std::ostream& operator<<(std::ostream& os, AlignedNodeMemoryPool const& pool)
+  {
+    std::unique_lock<std::mutex> lock(pool.pool_mutex_);
+    size_t const num_chunks = pool.nchunks_ * pool.number_of_blocks_;
+    os << "AlignedNodeMemoryPool stats: node size: " << pool.size_ << "; allocated size: " << (BlockSize * pool.number_of_blocks_) <<
+        "; total/used/free: " << num_chunks << '/' << (num_chunks - pool.total_free_) << '/' << pool.total_free_ <<
+        "; " << pool.stats_.snapshot();
+    return os;
+  }
+
+ private:
+  void set_size(size_t size)
+  {
+    // Round up to a multiple of the alignment of a pointer (FreeChunk).
+    size_ = (size + alignof(FreeChunk) - 1) & ~(alignof(FreeChunk) - 1);
+    nchunks_ = (BlockSize - header_size) / size_;
+    // BlockSize must be large enough for at least two chunks.
+    ASSERT(nchunks_ >= 2);
+  }
+};
+
+template<size_t BlockSize>
+void AlignedNodeMemoryPool<BlockSize>::link_block(Begin* block, ssize_t free)
+{
+  Begin*& head = free == 0 ? full_blocks_ : bins_[bin_index(free)];
+  block->prev = nullptr;
+  block->next = head;
+  if (head)
+    head->prev = block;
+  head = block;
+  if (free > 0)
+    non_empty_bins_ |= uint32_t{1} << bin_index(free);
+}
+
+template<size_t BlockSize>
+void AlignedNodeMemoryPool<BlockSize>::unlink_block(Begin* block, ssize_t free)
+{
+  Begin*& head = free == 0 ? full_blocks_ : bins_[bin_index(free)];
+  if (block->prev)
+    block->prev->next = block->next;
+  else
+    head = block->next;
+  if (block->next)
+    block->next->prev = block->prev;
+  if (free > 0 && !head)
+    non_empty_bins_ &= ~(uint32_t{1} << bin_index(free));
+}
+
+template<size_t BlockSize>
+void* AlignedNodeMemoryPool<BlockSize>::alloc(size_t size)
+{
+  std::unique_lock<std::mutex> lock = stats_.lock(pool_mutex_);
+  if (AI_UNLIKELY(non_empty_bins_ == 0))
+  {
+    // If size_ wasn't initialized yet, set it to the size of the first allocation.
+    if (AI_UNLIKELY(!size_))
+      set_size(size);
+    Dout(dc::notice, "AlignedNodeMemoryPool::alloc: allocating " << BlockSize << " bytes of memory [" << (void*)this << "].");
+    Begin* begin = static_cast<Begin*>(std::aligned_alloc(BlockSize, BlockSize));
+    if (AI_UNLIKELY(!begin))
+      return nullptr;
+    begin->pool = this;
+    begin->free_list = nullptr;
+    begin->unused = reinterpret_cast<char*>(begin) + header_size;
+    begin->free = nchunks_;
+    hardening::poison(begin->unused, nchunks_ * size_);
+    link_block(begin, nchunks_);
+    ++number_of_blocks_;
+    total_free_ += nchunks_;
+    stats_.add(PoolStats::refills);
+    stats_.add_resident(BlockSize);
+  }
+  stats_.add(PoolStats::allocations);
+  // size must fit. If you use multiple sizes, allocate the largest size first.
+  ASSERT(size <= size_);
+  // Take a chunk from one of the fullest blocks that still have free chunks.
+  Begin* begin = bins_[std::countr_zero(non_empty_bins_)];
+  void* ptr;
+  if (begin->free_list)
+  {
+    ptr = begin->free_list;
+    begin->free_list = begin->free_list->next;
+  }
+  else
+  {
+    ptr = begin->unused;
+    begin->unused += size_;
+    if (begin->unused == reinterpret_cast<char*>(begin) + header_size + nchunks_ * size_)
+      begin->unused = nullptr;
+  }
+  ssize_t const free = begin->free--;
+  if (free == 1 || bin_index(free - 1) != bin_index(free))
+  {
+    // Move the block to the list that corresponds with its new number of free chunks.
+    unlink_block(begin, free);
+    link_block(begin, free - 1);
+  }
+  --total_free_;
+  hardening::unpoison(ptr, size_);
+  return ptr;
+}
+
+template<size_t BlockSize>
+void AlignedNodeMemoryPool<BlockSize>::free(void* ptr)
+{
+  Begin* const begin = begin_of(ptr);
+  // ptr must be allocated from this pool.
+  ASSERT(begin->pool == this);
+  std::unique_lock<std::mutex> lock = stats_.lock(pool_mutex_);
+  stats_.add(PoolStats::deallocations);
+  FreeChunk* const chunk = static_cast<FreeChunk*>(ptr);
+  chunk->next = begin->free_list;
+  begin->free_list = chunk;
+  hardening::poison_free_block(ptr, size_, sizeof(FreeChunk));
+  ssize_t const free = ++begin->free;
+  ++total_free_;
+  ASSERT(free <= (ssize_t)nchunks_);
+  if (AI_UNLIKELY(free == (ssize_t)nchunks_) && total_free_ >= 2 * nchunks_)
+  {
+    // The last chunk of this block was freed; delete it.
+    unlink_block(begin, free - 1);
+    total_free_ -= nchunks_;
+    --number_of_blocks_;
+    stats_.add_resident(-static_cast<int64_t>(BlockSize));
+    hardening::unpoison(begin, BlockSize);
+    std::free(begin);
+    return;
+  }
+  if (free == 1 || bin_index(free) != bin_index(free - 1))
+  {
+    // Move the block to the list that corresponds with its new number of free chunks.
+    unlink_block(begin, free - 1);
+    link_block(begin, free);
+  }
+}
+
+template<size_t BlockSize>
+AlignedNodeMemoryPool<BlockSize>::~AlignedNodeMemoryPool()
+{
+  // Free all blocks; chunks that are still allocated become dangling.
+  auto free_list = [](Begin* begin){
+    while (begin)
+    {
+      Begin* next = begin->next;
+      hardening::unpoison(begin, BlockSize);
+      std::free(begin);
+      begin = next;
+    }
+  };
+  for (Begin* first : bins_)
+    free_list(first);
+  free_list(full_blocks_);
+}
+
+} // namespace memory
+
+template<size_t BlockSize>
+inline void* operator new(std::size_t size, memory::AlignedNodeMemoryPool<BlockSize>& pool) { return pool.alloc(size); }
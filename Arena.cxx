@@ -0,0 +1,96 @@
+/**
+ * memory -- C++ Memory utilities
+ *
+ * @file
+ * @brief Definition of class Arena.
+ *
+ * @Copyright (C) 2026  Carlo Wood.
+ *
+ * pub   dsa3072/C155A4EEE4E527A2 2018-08-16 Carlo Wood (CarloWood on Libera) <carlo@alinoe.com>
+ * fingerprint: 8020 B266 6305 EE2F D53E  6827 C155 A4EE E4E5 27A2
+ *
+ * This file is part of memory.
+ *
+ * memory is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * memory is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with memory.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "sys.h"
+#include "Arena.h"
+#include <cstdlib>
+#include "debug.h"
+
+namespace memory {
+
+void* Arena::allocate_slow(size_t bytes, size_t alignment)
+{
+  size_t const block_size = mpp_.block_size();
+  // The size of the Page header, rounded up to the alignment.
+  size_t const header_size = (sizeof(Page) + alignment - 1) & ~(alignment - 1);
+  if (AI_UNLIKELY(alignment > MemoryPagePoolBase::memory_page_size() || header_size > block_size || bytes > block_size - header_size))
+  {
+    // Allocate a large block; that is a LargeBlock header followed by (aligned) `bytes` bytes.
+    alignment = std::max(alignment, alignof(LargeBlock));
+    size_t const offset = (sizeof(LargeBlock) + alignment - 1) & ~(alignment - 1);
+    // The size passed to std::aligned_alloc must be a multiple of the alignment.
+    size_t const size = (offset + bytes + alignment - 1) & ~(alignment - 1);
+    if (AI_UNLIKELY(size < bytes))
+      return nullptr;
+    LargeBlock* large_block = static_cast<LargeBlock*>(std::aligned_alloc(alignment, size));
+    if (AI_UNLIKELY(!large_block))
+      return nullptr;
+    large_block->prev_ = large_;
+    large_ = large_block;
+    return reinterpret_cast<char*>(large_block) + offset;
+  }
+  // Start a new page. The remainder of the current page is wasted.
+  Page* page = static_cast<Page*>(mpp_.allocate());
+  if (AI_UNLIKELY(!page))
+    return nullptr;
+  page->prev_ = page_;
+  page_ = page;
+  ++pages_;
+  uintptr_t const begin = reinterpret_cast<uintptr_t>(page);
+  end_ = begin + block_size;
+  // Blocks of a MemoryPagePoolBase are aligned to the memory page size, so header_size takes care of the alignment.
+  current_ = begin + header_size + bytes;
+  return reinterpret_cast<void*>(begin + header_size);
+}
+
+void Arena::rewind(Mark const& mark)
+{
+  // Free all large blocks that were allocated after the mark.
+  while (large_ != mark.large_)
+  {
+    // mark must be a (valid) mark of this arena.
+    ASSERT(large_);
+    LargeBlock* prev = large_->prev_;
+    std::free(large_);
+    large_ = prev;
+  }
+  // Return all pages that were allocated after the mark to the pool.
+  while (page_ != mark.page_)
+  {
+    // mark must be a (valid) mark of this arena.
+    ASSERT(page_);
+    Page* prev = page_->prev_;
+    mpp_.deallocate(page_);
+    page_ = prev;
+    --pages_;
+  }
+  current_ = mark.current_;
+  end_ = page_ ? reinterpret_cast<uintptr_t>(page_) + mpp_.block_size() : 0;
+}
+
+} // namespace memory
@@ -0,0 +1,156 @@
+/**
+ * memory -- C++ Memory utilities
+ *
+ * @file
+ * @brief Declaration of class Arena.
+ *
+ * @Copyright (C) 2026  Carlo Wood.
+ *
+ * pub   dsa3072/C155A4EEE4E527A2 2018-08-16 Carlo Wood (CarloWood on Libera) <carlo@alinoe.com>
+ * fingerprint: 8020 B266 6305 EE2F D53E  6827 C155 A4EE E4E5 27A2
+ *
+ * This file is part of memory.
+ *
+ * memory is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * memory is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with memory.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+#include "MemoryPagePool.h"
+#include "utils/macros.h"
+#include <cstddef>
+#include <cstdint>
+#include "debug.h"
+
+namespace memory {
+
+// class Arena
+//
+// A bump-pointer (monotonic) allocator for short-lived objects of arbitrary size
+// that are all released together.
+//
+// Memory is taken from a MemoryPagePoolBase one block (a "page" of the arena) at a time,
+// and handed out by simply incrementing a pointer; deallocating individual objects
+// is not possible. Instead, all memory that was allocated after a call to mark()
+// can be released with rewind(), and all memory at once with reset(). Both return
+// the pages to the pool in O(number of pages) (the destructors of the objects are not
+// called, of course).
+//
+//  page_ -->.-------------.   .-->.-------------.
+//           | prev_ ------+--'    | prev_ ------+--> nullptr
+//           |             |       |/////////////|
+//           |/////////////|       |/////////////|    ////// = allocated.
+//           |/////////////|       |/////////////|
+//           `-------------'       `-------------'
+//                ^       ^
+//            current_   end_
+//
+// Requests that do not fit in a page (or with an alignment larger than the memory
+// page size) are allocated with std::aligned_alloc and kept on a separate list,
+// so that they are freed by rewind() and reset() too.
+//
+// An Arena is not thread-safe; typically every request handler (or thread) uses its own.
+//
+// Usage:
+//
+//   memory::MemoryPagePool mpp(0x8000);
+//   memory::Arena arena(mpp);
+//
+//   memory::Arena::Mark mark = arena.mark();
+//   Foo* foo = new (arena.allocate(sizeof(Foo), alignof(Foo))) Foo;
+//   ...
+//   arena.rewind(mark);        // Release everything that was allocated after mark() (foo).
+//
+// See also PmrArenaResource, to use an Arena with std::pmr containers.
+//
+class Arena
+{
+ private:
+  struct Page
+  {
+    Page* prev_;                        // The previously allocated page, or nullptr.
+  };
+
+  struct LargeBlock
+  {
+    LargeBlock* prev_;                  // The previously allocated large block, or nullptr.
+  };
+
+ public:
+  // The state of an Arena, as returned by mark(). A Mark becomes invalid when rewinding the arena to an earlier mark.
+  class Mark
+  {
+    friend class Arena;
+    Page* page_ = nullptr;
+    uintptr_t current_ = 0;
+    LargeBlock* large_ = nullptr;
+  };
+
+ private:
+  MemoryPagePoolBase& mpp_;
+  Page* page_;                          // The current page, or nullptr if no page was allocated yet.
+  uintptr_t current_;                   // The first free byte in the current page.
+  uintptr_t end_;                       // The end of the current page.
+  LargeBlock* large_;                   // The last allocated large block, or nullptr.
+  size_t pages_;                        // The number of pages in use.
+
+  // Allocate a new page, or a large block, and allocate `bytes` from it.
+  void* allocate_slow(size_t bytes, size_t alignment);
+
+ public:
+  Arena(MemoryPagePoolBase& mpp) : mpp_(mpp), page_(nullptr), current_(0), end_(0), large_(nullptr), pages_(0) { }
+  ~Arena() { reset(); }
+
+  Arena(Arena const&) = delete;
+  Arena& operator=(Arena const&) = delete;
+
+  // Return `bytes` bytes of memory aligned to `alignment` (a power of two).
+  // Returns nullptr if out of memory.
+  void* allocate(size_t bytes, size_t alignment = alignof(std::max_align_t))
+  {
+    // alignment must be a power of two.
+    ASSERT(alignment > 0 && (alignment & (alignment - 1)) == 0);
+    uintptr_t const ptr = (current_ + alignment - 1) & ~(alignment - 1);
+    // Note that ptr < end_ is false when there is no current page (end_ is then zero).
+    if (AI_LIKELY(ptr < end_ && bytes <= end_ - ptr))
+    {
+      current_ = ptr + bytes;
+      return reinterpret_cast<void*>(ptr);
+    }
+    return allocate_slow(bytes, alignment);
+  }
+
+  // Return the current state of the arena, to be passed to rewind().
+  Mark mark() const
+  {
+    Mark mark;
+    mark.page_ = page_;
+    mark.current_ = current_;
+    mark.large_ = large_;
+    return mark;
+  }
+
+  // Release all memory that was allocated after `mark` was obtained.
+  void rewind(Mark const& mark);
+
+  // Release all memory.
+  void reset() { rewind(Mark{}); }
+
+  // Accessors.
+  size_t pages() const { return pages_; }
+  MemoryPagePoolBase& mpp() const { return mpp_; }
+};
+
+} // namespace memory
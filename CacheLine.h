@@ -0,0 +1,66 @@
+/**
+ * memory -- C++ Memory utilities
+ *
+ * @file
+ * @brief Definition of cache_line_size and hot_alignment.
+ *
+ * @Copyright (C) 2026  Carlo Wood.
+ *
+ * pub   dsa3072/C155A4EEE4E527A2 2018-08-16 Carlo Wood (CarloWood on Libera) <carlo@alinoe.com>
+ * fingerprint: 8020 B266 6305 EE2F D53E  6827 C155 A4EE E4E5 27A2
+ *
+ * This file is part of memory.
+ *
+ * memory is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * memory is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with memory.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+#include <cstddef>
+
+#ifndef MEMORY_CACHE_LINE_SIZE
+#define MEMORY_CACHE_LINE_SIZE 64
+#endif
+
+namespace memory {
+
+// The size of a cache line, in bytes.
+//
+// This is a fixed constant (configurable with -DMEMORY_CACHE_LINE_SIZE=128 for, for example, POWER or Apple M1)
+// rather than std::hardware_destructive_interference_size, because the layout of the classes
+// that use it must not depend on the -mtune flags that a translation unit happens to be compiled with.
+static constexpr size_t cache_line_size = MEMORY_CACHE_LINE_SIZE;
+
+// The alignment to use for a hot (frequently written) member of type T of pool metadata.
+//
+// If configured with -DMEMORY_CACHE_LINE_ALIGNED=ON, hot members are put in their own cache line
+// (which also pads the object that contains them to a multiple of cache_line_size), so that they
+// do not share a cache line with other hot members or with neighbouring objects in an array
+// (for example, the NodeMemoryResource objects of DequeMemoryResource).
+// Otherwise this is just the natural alignment of T, which adds no padding.
+//
+// Usage:
+//
+//   alignas(hot_alignment<std::atomic<int>>) std::atomic<int> counter_;
+//
+#ifdef MEMORY_CACHE_LINE_ALIGNED
+template<typename T>
+static constexpr size_t hot_alignment = alignof(T) > cache_line_size ? alignof(T) : cache_line_size;
+#else
+template<typename T>
+static constexpr size_t hot_alignment = alignof(T);
+#endif
+
+} // namespace memory
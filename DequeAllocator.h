@@ -11,7 +11,7 @@ namespace memory {
 // allocations of it's elements, and DequeMemoryResource
 // for the exponentially growing sizes of the internal
 // table that a std::deque allocates; which in turn uses
-// 12 NodeMemoryResource's for the smaller sizes, and
+// a NodeMemoryResource per size for the smaller sizes, and
 // malloc above that.
 //
 // Usage:
@@ -44,6 +44,13 @@ namespace memory {
 //   std::deque<Foo, decltype(allocator)> d2([...,] allocator);
 //   ...
 //
+// By default the tables are allocated from DequeMemoryResource::s_instance.
+// To use a different DequeMemoryResource (for example, one per executor),
+// pass it as second argument:
+//
+//   memory::DequeMemoryResource dmr(mpp);
+//   memory::DequeAllocator<Foo> allocator(nmr, dmr);
+//
 // The same nmr can be used for multiple DequeAllocator's if the
 // size of their type is equal, or if you add an element to the
 // deque with the largest element first, or when you pass the
@@ -62,36 +69,45 @@ class DequeAllocator
 {
  private:
   NodeMemoryResource* node_memory_resource_;
+  DequeMemoryResource* deque_memory_resource_;
 
  public:
   using value_type = T;
 
-  // node_memory_resource_ is not used when T = ElementType*.
-  using is_always_equal = std::conditional_t<std::is_same_v<T, ElementType>, std::false_type, std::true_type>;
+  // node_memory_resource_ is not used when T = ElementType*, but deque_memory_resource_ is.
+  using is_always_equal = std::false_type;
 
-  DequeAllocator(NodeMemoryResource& node_memory_resource) : node_memory_resource_(&node_memory_resource) { }
+  DequeAllocator(NodeMemoryResource& node_memory_resource, DequeMemoryResource& deque_memory_resource = DequeMemoryResource::s_instance) :
+    node_memory_resource_(&node_memory_resource), deque_memory_resource_(&deque_memory_resource) { }
 
   using propagate_on_container_copy_assignment = std::true_type;
-  DequeAllocator(DequeAllocator const& allocator) noexcept : node_memory_resource_(allocator.node_memory_resource_) { }
+  DequeAllocator(DequeAllocator const& allocator) noexcept :
+    node_memory_resource_(allocator.node_memory_resource_), deque_memory_resource_(allocator.deque_memory_resource_) { }
 
   using propagate_on_container_move_assignment = std::true_type;
   DequeAllocator& operator=(DequeAllocator const& allocator) noexcept
   {
     node_memory_resource_ = allocator.node_memory_resource_;
+    deque_memory_resource_ = allocator.deque_memory_resource_;
     return *this;
   }
 
   using propagate_on_container_swap = std::true_type;
-  void swap(DequeAllocator& other) { std::swap(node_memory_resource_, other.node_memory_resource_); }
+  void swap(DequeAllocator& other)
+  {
+    std::swap(node_memory_resource_, other.node_memory_resource_);
+    std::swap(deque_memory_resource_, other.deque_memory_resource_);
+  }
 
   // Used by the constructor below.
   NodeMemoryResource* nmr_ptr() const { return node_memory_resource_; }
+  DequeMemoryResource* dmr_ptr() const { return deque_memory_resource_; }
 
-  // node_memory_resource_ is copied, but not expected to be used!
+  // node_memory_resource_ is copied, but not expected to be used by the table allocator!
   // The only reason it is copied is because the standard requires that if the original type is constructed
   // from this result, it has to compare equal.
   template<typename U>
-  DequeAllocator(DequeAllocator<U, ElementType> const& other) : node_memory_resource_(other.nmr_ptr()) { }
+  DequeAllocator(DequeAllocator<U, ElementType> const& other) : node_memory_resource_(other.nmr_ptr()), deque_memory_resource_(other.dmr_ptr()) { }
 
   [[nodiscard]] T* allocate(std::size_t number_of_objects);
   void deallocate(T* p, std::size_t n) noexcept;
@@ -99,9 +115,9 @@ class DequeAllocator
   friend bool operator==(DequeAllocator<T, ElementType> const& a1, DequeAllocator<T, ElementType> const& a2) noexcept
   {
     if constexpr (std::is_same_v<T, ElementType>)
-      return a1.node_memory_resource_ == a2.node_memory_resource_;
+      return a1.node_memory_resource_ == a2.node_memory_resource_ && a1.deque_memory_resource_ == a2.deque_memory_resource_;
     else
-      return true;
+      return a1.deque_memory_resource_ == a2.deque_memory_resource_;
   }
 
   friend bool operator!=(DequeAllocator<T, ElementType> const& a1, DequeAllocator<T, ElementType> const& a2) noexcept
@@ -109,7 +125,7 @@ class DequeAllocator
     return !(a1 == a2);
   }
 
-  DequeAllocator select_on_container_copy_construction() { return {*node_memory_resource_}; }
+  DequeAllocator select_on_container_copy_construction() { return {*node_memory_resource_, *deque_memory_resource_}; }
 };
 
 template<typename T, typename ElementType>
@@ -119,7 +135,7 @@ T* DequeAllocator<T, ElementType>::allocate(std::size_t number_of_objects)
   if constexpr (std::is_same_v<T, ElementType>)
     ptr = static_cast<T*>(node_memory_resource_->allocate(number_of_objects * sizeof(T)));
   else
-    ptr = static_cast<T*>(DequeMemoryResource::s_instance.allocate(number_of_objects * sizeof(T)));
+    ptr = static_cast<T*>(deque_memory_resource_->allocate(number_of_objects * sizeof(T)));
   return ptr;
 }
 
@@ -129,7 +145,7 @@ void DequeAllocator<T, ElementType>::deallocate(T* p, std::size_t number_of_obje
   if constexpr (std::is_same_v<T, ElementType>)
     node_memory_resource_->deallocate(p);
   else
-    DequeMemoryResource::s_instance.deallocate(p, number_of_objects * sizeof(T));
+    deque_memory_resource_->deallocate(p, number_of_objects * sizeof(T));
 }
 
 } // namespace memory
@@ -39,14 +39,12 @@ DequeMemoryResource DequeMemoryResource::s_instance;
 namespace {
 
 // Map node_memory_resources_ array index to the block size that it must store.
-constexpr std::array<std::size_t, DequeMemoryResource::nmra_size> const i2s = { 8, 12, 18, 26, 38, 54, 78, 111, 158, 224, 318, 451 };
+constexpr std::array<std::size_t, DequeMemoryResource::nmra_size> const i2s = {
+  8, 12, 18, 26, 38, 54, 78, 111, 158, 224, 318, 451, 638, 903, 1278, 1808, 2558, 3618, 5118, 7239 };
 
 // Convert an index to its size.
 constexpr std::size_t index_to_size(int n) { return sizeof(void*) * i2s[n]; }
 
-// The largest size for which we still use a NodeMemoryResource.
-constexpr std::size_t upper_size = index_to_size(i2s.size() - 1);
-
 } // namespace
 
 void* DequeMemoryResource::allocate(std::size_t number_of_bytes)
@@ -54,19 +52,19 @@ void* DequeMemoryResource::allocate(std::size_t number_of_bytes)
   DoutEntering(dc::notice, "DequeMemoryResource::allocate(" << number_of_bytes << ") ; " << (number_of_bytes / sizeof(void*)));
 
   // Make small values of index the fast path.
-  if (AI_UNLIKELY(number_of_bytes > upper_size))
+  if (AI_UNLIKELY(number_of_bytes > upper_size_))
     return malloc(number_of_bytes);
 
   int const index = size_to_index(number_of_bytes);
 
-  Dout(dc::notice, "DequeMemoryResource::allocate(" << number_of_bytes << ") is using index " << index << " / " << (nmra_size - 1));
+  Dout(dc::notice, "DequeMemoryResource::allocate(" << number_of_bytes << ") is using index " << index << " / " << (number_of_pools_ - 1));
   return node_memory_resources_[index].allocate(number_of_bytes);
 }
 
 void DequeMemoryResource::deallocate(void* p, std::size_t number_of_bytes)
 {
   // Marked "unlikely" because the smallest sizes should be the fast path.
-  if (AI_UNLIKELY(number_of_bytes > upper_size))
+  if (AI_UNLIKELY(number_of_bytes > upper_size_))
   {
     free(p);
     return;
@@ -76,10 +74,18 @@ void DequeMemoryResource::deallocate(void* p, std::size_t number_of_bytes)
   return;
 }
 
-void DequeMemoryResource::init(MemoryPagePool* mpp_ptr)
+void DequeMemoryResource::init(MemoryPagePoolBase* mpp_ptr, unsigned int magazine_size)
 {
-  for (int index = 0; index < node_memory_resources_.size(); ++index)
-    node_memory_resources_[index].init(mpp_ptr, index_to_size(index));
+  // Only use the sizes that fit at least minimum_blocks_per_chunk times in a block of the memory pool.
+  number_of_pools_ = 0;
+  while (number_of_pools_ < nmra_size && index_to_size(number_of_pools_) * minimum_blocks_per_chunk <= mpp_ptr->block_size())
+    ++number_of_pools_;
+  // The block size of the memory pool must be at least minimum_blocks_per_chunk times the minimal deque map size.
+  ASSERT(number_of_pools_ > 0);
+  upper_size_ = index_to_size(number_of_pools_ - 1);
+  Dout(dc::notice, "DequeMemoryResource: using a NodeMemoryResource for up to " << (upper_size_ / sizeof(void*)) << " pointers [" << this << "].");
+  for (int index = 0; index < number_of_pools_; ++index)
+    node_memory_resources_[index].init(mpp_ptr, index_to_size(index), magazine_size);
 }
 
 } // namespace memory
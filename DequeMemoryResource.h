@@ -34,8 +34,26 @@
 namespace memory {
 
 // A memory resource for the internal tables of std::deque.
-// Only used by DequeAllocator, but the user must create a
-// DequeMemoryResource::Initialization object at the top of main.
+// Only used by DequeAllocator (and PmrDequeResource).
+//
+// By default DequeAllocator uses the global DequeMemoryResource::s_instance, in which case the user
+// must create a DequeMemoryResource::Initialization object at the top of main.
+//
+// Because every deque growth of every thread then goes through the same free lists, it is
+// also possible to create more instances, for example one per executor (thread pool),
+// and pass those to the DequeAllocator's of the deques that are used by that executor:
+//
+//   memory::DequeMemoryResource dmr(mpp);                       // Must be destructed after the deques that use it.
+//   memory::DequeAllocator<Foo> allocator(nmr, dmr);
+//
+// Alternatively (or additionally) pass a non-zero magazine_size, to give every
+// thread its own magazines (see MagazineCache) in front of each free list:
+//
+//   memory::DequeMemoryResource::Initialization dmri(mpp, 8);   // Use magazines of 8 tables per thread and size.
+//
+// Note that a thread_local instance is not supported, because a deque (and therefore the
+// deallocation of its table) can outlive the thread that created it.
+//
 class DequeMemoryResource
 {
  public:
@@ -96,8 +114,20 @@ class DequeMemoryResource
   //    9       224
   //   10       318
   //   11       451
+  //   12       638
+  //   13       903
+  //   14       1278
+  //   15       1808
+  //   16       2558
+  //   17       3618
+  //   18       5118
+  //   19       7239
   //
-  static constexpr int nmra_size = 12;  // NodeMemoryResource Array size.
+  // Only the sizes that fit at least minimum_blocks_per_chunk times in a block of the
+  // MemoryPagePool are actually used; larger sizes are allocated with malloc.
+  //
+  static constexpr int nmra_size = 20;  // NodeMemoryResource Array size.
+  static constexpr size_t minimum_blocks_per_chunk = 4;
   //
   // We need a function to convert those sizes to their index such that intermediate
   // sizes fall in the bucket with a size that is larger, of course: the ceil of
@@ -135,23 +165,26 @@ class DequeMemoryResource
     // Should be the minimal map size, see std::deque<>::_S_initial_map_size.
     // If this asserts (in the future?) than theoretically we should set s to 8 * sizeof(void*).
     ASSERT(s >= 8 * sizeof(void*));
-    // Do not call this function for sizes larger than 451 nodes.
-    ASSERT(s <= 451 * sizeof(void*));
-    unsigned int nodes = s / sizeof(void*);     // 8 <= nodes <= 451.
-    unsigned int t = 16 * (nodes + 2) / 10;     // 16 <= t <= 724, 256 <= t^2 <= 524176.
-    return utils::ceil_log2(t * t) - 8;         // 0 <= result <= 11.
+    // Do not call this function for sizes larger than 7239 nodes.
+    ASSERT(s <= 7239 * sizeof(void*));
+    unsigned int nodes = s / sizeof(void*);     // 8 <= nodes <= 7239.
+    unsigned int t = 16 * (nodes + 2) / 10;     // 16 <= t <= 11585, 256 <= t^2 <= 134212225.
+    return utils::ceil_log2(t * t) - 8;         // 0 <= result <= 19.
   }
 
-  // Used by the constructor of node_memory_resources_.
+  // Used by the constructor of s_instance.
   DequeMemoryResource() = default;
 
   // The actual initialization of node_memory_resources_ must be done after reaching main()
   // (after initialization of a MemoryPagePool).
-  void init(MemoryPagePool* mpp_ptr);
+  void init(MemoryPagePoolBase* mpp_ptr, unsigned int magazine_size);
 
  public:
   static DequeMemoryResource s_instance;
 
+  // Create an initialized DequeMemoryResource that uses mpp as upstream.
+  DequeMemoryResource(MemoryPagePoolBase& mpp, unsigned int magazine_size = 0) { init(&mpp, magazine_size); }
+
   // DequeMemoryResource must be initialized after creating the (a) MemoryPagePool, and
   // before using the first std::deque that uses memory::DequeAllocator.
   //
@@ -162,20 +195,26 @@ class DequeMemoryResource
   //
   struct Initialization
   {
-    Initialization(MemoryPagePool& mpp_ptr)
+    Initialization(MemoryPagePoolBase& mpp_ptr, unsigned int magazine_size = 0)
     {
-      s_instance.init(&mpp_ptr);
+      s_instance.init(&mpp_ptr, magazine_size);
     }
   };
 
   void* allocate(std::size_t number_of_bytes);
   void deallocate(void* p, std::size_t number_of_bytes);
 
+  // Return the largest size (in bytes) that is served from a NodeMemoryResource; larger sizes use malloc.
+  std::size_t upper_size() const { return upper_size_; }
+
  private:
-  // Use a NodeMemoryResource for the nmra_size smallest sizes.
-  // The default memory pool allocates 32 kB blocks, so that means the largest value (451 * sizeof(void*) = 3608 bytes) needs a new call to malloc
-  // every 9 allocations of 3608 bytes. Larger values (the next being 5104) are allocated directly with malloc.
-  using node_memory_resources_container_t = std::array<NodeMemoryResource, nmra_size>;  // Note that the size of NodeMemoryResource is 64 bytes.
+  // Use a NodeMemoryResource for the number_of_pools_ smallest sizes.
+  // The default memory pool allocates 32 kB blocks, so that means that the largest value
+  // (903 * sizeof(void*) = 7224 bytes) needs a new block from the memory pool every 4 allocations.
+  // Larger values (the next being 10224 bytes) are then allocated directly with malloc.
+  int number_of_pools_ = nmra_size;     // The number of elements of node_memory_resources_ that are in use.
+  std::size_t upper_size_ = 7239 * sizeof(void*);       // The block size of node_memory_resources_[number_of_pools_ - 1].
+  using node_memory_resources_container_t = std::array<NodeMemoryResource, nmra_size>;  // Configure with MEMORY_CACHE_LINE_ALIGNED to keep the hot members of neighbouring elements out of each others cache line (see CacheLine.h).
   node_memory_resources_container_t node_memory_resources_ = {};
 };
 
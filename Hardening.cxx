@@ -0,0 +1,43 @@
+/**
+ * memory -- C++ Memory utilities
+ *
+ * @file
+ * @brief Hardening support.
+ *
+ * @Copyright (C) 2026  Carlo Wood.
+ *
+ * pub   dsa3072/C155A4EEE4E527A2 2018-08-16 Carlo Wood (CarloWood on Libera) <carlo@alinoe.com>
+ * fingerprint: 8020 B266 6305 EE2F D53E  6827 C155 A4EE E4E5 27A2
+ *
+ * This file is part of memory.
+ *
+ * memory is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * memory is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with memory.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "sys.h"
+#include "Hardening.h"
+#include <cstdlib>
+#include "debug.h"
+
+namespace memory::hardening {
+
+void corruption_detected(char const* what, void const* ptr)
+{
+  DoutFatal(dc::core, "memory: " << what << " (" << ptr << ").");
+  // Not reached.
+  std::abort();
+}
+
+} // namespace memory::hardening
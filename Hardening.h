@@ -0,0 +1,123 @@
+/**
+ * memory -- C++ Memory utilities
+ *
+ * @file
+ * @brief Hardening support (MEMORY_HARDENED and AddressSanitizer annotations).
+ *
+ * @Copyright (C) 2026  Carlo Wood.
+ *
+ * pub   dsa3072/C155A4EEE4E527A2 2018-08-16 Carlo Wood (CarloWood on Libera) <carlo@alinoe.com>
+ * fingerprint: 8020 B266 6305 EE2F D53E  6827 C155 A4EE E4E5 27A2
+ *
+ * This file is part of memory.
+ *
+ * memory is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * memory is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with memory.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+#include "utils/macros.h"
+#include <cstddef>
+#include <cstdint>
+#include "debug.h"
+
+#if defined(__SANITIZE_ADDRESS__)
+#define MEMORY_ASAN 1
+#elif defined(__has_feature)
+#if __has_feature(address_sanitizer)
+#define MEMORY_ASAN 1
+#endif
+#endif
+
+#ifdef MEMORY_ASAN
+#include <sanitizer/asan_interface.h>
+#endif
+
+// Hardening of the pools against heap corruption bugs in the code that uses them.
+//
+// The pools store their free lists inside the free blocks, which makes use-after-free
+// and double-free bugs in user code hard to find: the user corrupts the free list
+// rather than causing a crash, and AddressSanitizer can not see inside the blocks.
+// Therefore:
+//
+// - When compiled with AddressSanitizer (-fsanitize=address), free blocks are poisoned
+//   (except for the words that are used by the free list itself), so that any access by
+//   the user to a block that is not allocated is reported. This is independent of
+//   MEMORY_HARDENED.
+//
+// The following is only done when configured with -DMEMORY_HARDENED=ON (which defines MEMORY_HARDENED).
+// It is cheap enough to be left enabled in canary deployments.
+//
+// - The next_ pointers of the free lists of SimpleSegregatedStorage (and MagazineCache) are
+//   stored mangled with the address that they are stored at ("safe-linking", see
+//   PtrTag::FreeNode::next()), so that a use-after-free write or a leaked pointer does
+//   not result in a usable free list pointer. A next pointer that doesn't decode to a
+//   properly aligned address is detected when the node is allocated.
+//
+// - NodeMemoryPool and NodeMemoryResource detect double frees.
+//
+// Every detected corruption is fatal (see corruption_detected()).
+//
+// Guard pages between MemoryPagePool chunks are configured separately, with -DMEMORY_GUARD_PAGES=ON.
+//
+namespace memory::hardening {
+
+#ifdef MEMORY_HARDENED
+static constexpr bool enabled = true;
+#else
+static constexpr bool enabled = false;
+#endif
+
+#ifdef MEMORY_GUARD_PAGES
+static constexpr bool guard_pages = true;
+#else
+static constexpr bool guard_pages = false;
+#endif
+
+// Mark size bytes at ptr as not addressable (only has effect when compiled with AddressSanitizer).
+inline void poison([[maybe_unused]] void const* ptr, [[maybe_unused]] size_t size)
+{
+#ifdef MEMORY_ASAN
+  ASAN_POISON_MEMORY_REGION(ptr, size);
+#endif
+}
+
+// Mark size bytes at ptr as addressable again (only has effect when compiled with AddressSanitizer).
+inline void unpoison([[maybe_unused]] void const* ptr, [[maybe_unused]] size_t size)
+{
+#ifdef MEMORY_ASAN
+  ASAN_UNPOISON_MEMORY_REGION(ptr, size);
+#endif
+}
+
+// Poison a free block of size bytes, except its first `keep` bytes (that are used by the free list).
+inline void poison_free_block(void* block, size_t size, size_t keep)
+{
+  if (size > keep)
+    poison(static_cast<char*>(block) + keep, size - keep);
+}
+
+// Print `what` and ptr, and terminate the application.
+[[noreturn, gnu::cold, gnu::noinline]] void corruption_detected(char const* what, void const* ptr);
+
+// Mangle (or unmangle) a free list pointer `ptr` that is stored at address `slot`.
+// Both the high bits (from the address of the slot) and the low bits (from the position
+// within the page) change, which makes the stored value useless as a pointer.
+[[gnu::always_inline]] inline std::uintptr_t mangle(void const* slot, std::uintptr_t ptr)
+{
+  return ptr ^ (reinterpret_cast<std::uintptr_t>(slot) >> 12);
+}
+
+} // namespace memory::hardening
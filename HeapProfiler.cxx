@@ -0,0 +1,325 @@
+/**
+ * memory -- C++ Memory utilities
+ *
+ * @file
+ * @brief Implementation of the allocation sampling heap profiler.
+ *
+ * @Copyright (C) 2026  Carlo Wood.
+ *
+ * pub   dsa3072/C155A4EEE4E527A2 2018-08-16 Carlo Wood (CarloWood on Libera) <carlo@alinoe.com>
+ * fingerprint: 8020 B266 6305 EE2F D53E  6827 C155 A4EE E4E5 27A2
+ *
+ * This file is part of memory.
+ *
+ * memory is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * memory is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with memory.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "sys.h"
+#include "HeapProfiler.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <mutex>
+#include <ostream>
+#include <random>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include <csignal>
+#include <execinfo.h>
+#include <unistd.h>
+#include "debug.h"
+
+namespace memory::heap_profiler {
+
+namespace detail {
+
+thread_local constinit int64_t t_bytes_until_sample = 0;
+std::array<std::atomic<uint32_t>, size_t{1} << filter_bits> s_filter;
+
+} // namespace detail
+
+namespace {
+
+struct Stack
+{
+  std::array<void*, max_depth> frames;
+  int depth;
+
+  friend bool operator==(Stack const& lhs, Stack const& rhs)
+  {
+    return lhs.depth == rhs.depth && std::equal(lhs.frames.begin(), lhs.frames.begin() + lhs.depth, rhs.frames.begin());
+  }
+};
+
+struct StackHash
+{
+  size_t operator()(Stack const& stack) const
+  {
+    size_t hash = stack.depth;
+    for (int i = 0; i < stack.depth; ++i)
+      hash = (hash ^ reinterpret_cast<uintptr_t>(stack.frames[i])) * 0x100000001b3;
+    return hash;
+  }
+};
+
+// The sampled allocations of one call site.
+struct Bucket
+{
+  size_t live_count = 0;        // The number of samples that are not freed yet.
+  size_t live_bytes = 0;        // The total size of those samples.
+  size_t alloc_count = 0;       // The total number of samples.
+  size_t alloc_bytes = 0;       // The total size of all samples.
+};
+
+// The identity of a live sample.
+struct Address
+{
+  void const* pool;             // The pool that the sample was allocated from.
+  void* ptr;                    // The address of the allocation.
+
+  friend bool operator==(Address const& lhs, Address const& rhs) { return lhs.pool == rhs.pool && lhs.ptr == rhs.ptr; }
+};
+
+struct AddressHash
+{
+  size_t operator()(Address const& address) const
+  {
+    return std::hash<void*>{}(address.ptr) ^ (std::hash<void const*>{}(address.pool) * 0x100000001b3);
+  }
+};
+
+struct LiveSample
+{
+  Bucket* bucket;               // The bucket that this sample was added to.
+  size_t size;                  // The size of the allocation.
+};
+
+struct Profile
+{
+  std::mutex mutex;                                     // Protects the members below.
+  std::unordered_map<Stack, Bucket, StackHash> buckets; // All call sites that were sampled.
+  std::unordered_map<Address, LiveSample, AddressHash> live;    // The samples that are not freed yet.
+};
+
+// The profile is never destroyed, because pools can still be used during static destruction.
+Profile& profile()
+{
+  static Profile* profile = new Profile;
+  return *profile;
+}
+
+std::atomic<size_t> s_sample_period{0};
+thread_local bool t_initialized = false;        // Set once t_bytes_until_sample was randomized.
+thread_local bool t_in_sample = false;          // Set while sampling, to avoid recursion.
+
+// Return a random distance to the next sample, exponentially distributed with mean period.
+int64_t next_sample_distance(size_t period)
+{
+  static thread_local std::minstd_rand engine(std::hash<std::thread::id>{}(std::this_thread::get_id()));
+  std::exponential_distribution<double> distribution(1.0 / period);
+  return std::max<int64_t>(1, static_cast<int64_t>(distribution(engine)));
+}
+
+} // namespace
+
+namespace detail {
+
+void sample(void const* pool, void* ptr, size_t size)
+{
+  size_t const period = s_sample_period.load(std::memory_order_relaxed);
+  if (period == 0)
+  {
+    t_bytes_until_sample = disabled_recheck_bytes;
+    return;
+  }
+  bool const initialized = t_initialized;
+  t_bytes_until_sample = next_sample_distance(period);
+  // Do not sample the first allocation of a thread (or the first after sampling was turned on):
+  // it merely started the countdown.
+  t_initialized = true;
+  if (!initialized || t_in_sample)
+    return;
+  t_in_sample = true;
+  Stack stack;
+  // Skip the frame of this function.
+  int depth = backtrace(stack.frames.data(), max_depth);
+  stack.depth = depth - 1;
+  std::copy(stack.frames.begin() + 1, stack.frames.begin() + depth, stack.frames.begin());
+  {
+    Profile& p = profile();
+    std::lock_guard<std::mutex> lock(p.mutex);
+    Bucket& bucket = p.buckets[stack];
+    ++bucket.alloc_count;
+    bucket.alloc_bytes += size;
+    ++bucket.live_count;
+    bucket.live_bytes += size;
+    auto [live_sample, inserted] = p.live.try_emplace(Address{pool, ptr}, LiveSample{&bucket, size});
+    if (inserted)
+      s_filter[filter_index(ptr)].fetch_add(1, std::memory_order_relaxed);
+    else
+    {
+      // The block at ptr was released by the pool without being freed (for example, a pool was destroyed while
+      // it still had allocated blocks) and is now reused. Forget the old sample.
+      --live_sample->second.bucket->live_count;
+      live_sample->second.bucket->live_bytes -= live_sample->second.size;
+      live_sample->second = LiveSample{&bucket, size};
+    }
+  }
+  t_in_sample = false;
+}
+
+void forget(void const* pool, void* ptr)
+{
+  Profile& p = profile();
+  std::lock_guard<std::mutex> lock(p.mutex);
+  auto live_sample = p.live.find(Address{pool, ptr});
+  // Another address with the same filter index (or the same address in another pool) could be a live sample.
+  if (live_sample == p.live.end())
+    return;
+  --live_sample->second.bucket->live_count;
+  live_sample->second.bucket->live_bytes -= live_sample->second.size;
+  p.live.erase(live_sample);
+  s_filter[filter_index(ptr)].fetch_sub(1, std::memory_order_relaxed);
+}
+
+} // namespace detail
+
+void set_sample_period(size_t bytes)
+{
+  Dout(dc::notice(!enabled && bytes > 0), "heap_profiler::set_sample_period: configure with -DMEMORY_HEAP_PROFILER=ON to enable the heap profiler.");
+  s_sample_period.store(bytes, std::memory_order_relaxed);
+}
+
+size_t sample_period()
+{
+  return s_sample_period.load(std::memory_order_relaxed);
+}
+
+void write_profile(std::ostream& os)
+{
+  // Copy the profile, so that the mutex isn't locked while writing.
+  std::vector<std::pair<Stack, Bucket>> buckets;
+  {
+    Profile& p = profile();
+    std::lock_guard<std::mutex> lock(p.mutex);
+    buckets.assign(p.buckets.begin(), p.buckets.end());
+  }
+  Bucket total;
+  for (auto const& bucket : buckets)
+  {
+    total.live_count += bucket.second.live_count;
+    total.live_bytes += bucket.second.live_bytes;
+    total.alloc_count += bucket.second.alloc_count;
+    total.alloc_bytes += bucket.second.alloc_bytes;
+  }
+  auto write_counts = [&os](Bucket const& bucket){
+    os << std::setw(6) << bucket.live_count << ": " << std::setw(8) << bucket.live_bytes << " [" <<
+        std::setw(6) << bucket.alloc_count << ": " << std::setw(8) << bucket.alloc_bytes << "] @";
+  };
+  // pprof uses the sample period in the header to estimate the real numbers from the samples.
+  os << "heap profile: ";
+  write_counts(total);
+  os << " heap_v2/" << sample_period() << '\n';
+  for (auto const& bucket : buckets)
+  {
+    write_counts(bucket.second);
+    for (int i = 0; i < bucket.first.depth; ++i)
+      os << ' ' << bucket.first.frames[i];
+    os << '\n';
+  }
+  // The memory map, for the symbolization of the addresses.
+  os << "\nMAPPED_LIBRARIES:\n";
+  std::ifstream maps("/proc/self/maps");
+  os << maps.rdbuf();
+}
+
+bool dump(std::string const& filename)
+{
+  Dout(dc::notice, "heap_profiler::dump: writing heap profile to \"" << filename << "\".");
+  std::ofstream ofs(filename);
+  if (!ofs)
+    return false;
+  write_profile(ofs);
+  return static_cast<bool>(ofs);
+}
+
+namespace {
+
+// The signal handler only writes a byte to a pipe; the profile is written by a background thread.
+class SignalDumper
+{
+ private:
+  int pipe_fds_[2];
+  std::string prefix_;
+  std::jthread thread_;
+
+  void run()
+  {
+    char command;
+    int n = 0;
+    while (::read(pipe_fds_[0], &command, 1) == 1 && command == 's')
+    {
+      char suffix[32];
+      std::snprintf(suffix, sizeof(suffix), ".%d.%04d.heap", static_cast<int>(::getpid()), n++);
+      if (!dump(prefix_ + suffix))
+        Dout(dc::warning, "heap_profiler: failed to write \"" << prefix_ << suffix << "\".");
+    }
+  }
+
+  static void handler(int UNUSED_ARG(signum))
+  {
+    char const command = 's';
+    [[maybe_unused]] ssize_t n = ::write(s_write_fd, &command, 1);
+  }
+
+ public:
+  static inline int s_write_fd = -1;
+
+  SignalDumper(int signum, std::string prefix) : prefix_(std::move(prefix))
+  {
+    if (::pipe(pipe_fds_) == -1)
+      DoutFatal(dc::core|error_cf, "heap_profiler::dump_on_signal: pipe");
+    s_write_fd = pipe_fds_[1];
+    thread_ = std::jthread([this](){ run(); });
+    struct sigaction action = {};
+    action.sa_handler = &SignalDumper::handler;
+    sigemptyset(&action.sa_mask);
+    action.sa_flags = SA_RESTART;
+    sigaction(signum, &action, nullptr);
+  }
+
+  ~SignalDumper()
+  {
+    // Stop the thread (it is joined by the destructor of thread_).
+    char const command = 'q';
+    [[maybe_unused]] ssize_t n = ::write(pipe_fds_[1], &command, 1);
+  }
+};
+
+} // namespace
+
+void dump_on_signal(int signum, std::string prefix)
+{
+  DoutEntering(dc::notice, "heap_profiler::dump_on_signal(" << signum << ", \"" << prefix << "\")");
+  // dump_on_signal may only be called once.
+  ASSERT(SignalDumper::s_write_fd == -1);
+  static SignalDumper s_signal_dumper(signum, std::move(prefix));
+}
+
+} // namespace memory::heap_profiler
@@ -0,0 +1,166 @@
+/**
+ * memory -- C++ Memory utilities
+ *
+ * @file
+ * @brief Declaration of the allocation sampling heap profiler.
+ *
+ * @Copyright (C) 2026  Carlo Wood.
+ *
+ * pub   dsa3072/C155A4EEE4E527A2 2018-08-16 Carlo Wood (CarloWood on Libera) <carlo@alinoe.com>
+ * fingerprint: 8020 B266 6305 EE2F D53E  6827 C155 A4EE E4E5 27A2
+ *
+ * This file is part of memory.
+ *
+ * memory is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * memory is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with memory.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+#include "utils/macros.h"
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <iosfwd>
+#include <limits>
+#include <string>
+#include <utility>
+#include "debug.h"
+
+// An allocation sampling heap profiler for the pools.
+//
+// When configured with -DMEMORY_HEAP_PROFILER=ON (which defines MEMORY_HEAP_PROFILER),
+// NodeMemoryResource and MemoryPagePool report every allocation and deallocation to the
+// profiler. Just like the heap profiler of tcmalloc, on average one allocation per
+// sample_period() allocated bytes is sampled (the distance between samples is randomized,
+// so that periodic allocation patterns can't alias with the sample period): the stack
+// trace and size of a sampled allocation are recorded until it is freed.
+//
+// The cost of an allocation that isn't sampled is a single subtraction of a thread_local
+// counter; that of a deallocation a single relaxed load from a small counting filter of
+// the addresses of the live samples.
+//
+// The profile can be written (on demand, or upon receiving a signal) in the legacy heap
+// profile text format of gperftools, which is understood by pprof:
+//
+//   memory::heap_profiler::set_sample_period(512 * 1024);       // Sample every 512 kB on average.
+//   memory::heap_profiler::dump_on_signal(SIGUSR1, "myapp");    // Write myapp.<pid>.<n>.heap upon SIGUSR1.
+//   ...
+//   memory::heap_profiler::dump("myapp.heap");                  // Or write a profile on demand.
+//
+//   $ pprof --inuse_space myapp myapp.12345.0001.heap
+//
+// Sampling is off (the sample period is zero) by default, even when MEMORY_HEAP_PROFILER is defined.
+// A thread that is allocating while sampling is off notices that it was turned on within
+// disabled_recheck_bytes bytes of allocation.
+//
+namespace memory::heap_profiler {
+
+#ifdef MEMORY_HEAP_PROFILER
+static constexpr bool enabled = true;
+#else
+static constexpr bool enabled = false;
+#endif
+
+static constexpr int max_depth = 64;                    // The maximum number of recorded stack frames.
+static constexpr int64_t disabled_recheck_bytes = 0x100000;     // See above.
+
+namespace detail {
+
+// The number of bytes that may still be allocated by this thread before the next sample is taken.
+extern thread_local constinit int64_t t_bytes_until_sample;
+
+// A counting filter of the addresses of the live samples: a non-zero value means that a
+// pointer with that filter_index might be a live sample.
+static constexpr int filter_bits = 14;
+extern std::array<std::atomic<uint32_t>, size_t{1} << filter_bits> s_filter;
+
+[[gnu::always_inline]] inline size_t filter_index(void const* ptr)
+{
+  return (reinterpret_cast<uintptr_t>(ptr) * 0x9e3779b97f4a7c15) >> (64 - filter_bits);
+}
+
+[[gnu::cold, gnu::noinline]] void sample(void const* pool, void* ptr, size_t size);
+[[gnu::cold, gnu::noinline]] void forget(void const* pool, void* ptr);
+
+} // namespace detail
+
+// Called by the pool `pool` for every allocation of size bytes at ptr.
+// The pool is part of the identity of a sample, because a NodeMemoryResource block can have
+// the same address as the MemoryPagePool block that it was carved from.
+[[gnu::always_inline]] inline void allocated([[maybe_unused]] void const* pool, [[maybe_unused]] void* ptr, [[maybe_unused]] size_t size)
+{
+  if constexpr (enabled)
+  {
+    if (AI_UNLIKELY((detail::t_bytes_until_sample -= static_cast<int64_t>(size)) < 0))
+      detail::sample(pool, ptr, size);
+  }
+}
+
+// Called by the pool `pool` for every deallocation, before ptr is returned to a free list.
+[[gnu::always_inline]] inline void freed([[maybe_unused]] void const* pool, [[maybe_unused]] void* ptr)
+{
+  if constexpr (enabled)
+  {
+    if (AI_UNLIKELY(detail::s_filter[detail::filter_index(ptr)].load(std::memory_order_relaxed) != 0))
+      detail::forget(pool, ptr);
+  }
+}
+
+// Allocations that a pool makes, during the lifetime of an object of this type, on behalf of
+// a downstream pool that also reports to the profiler (the chunks that a NodeMemoryResource
+// takes from its MemoryPagePool) are neither sampled nor counted towards the next sample:
+// the downstream pool samples the allocations that it carves out of that memory, and
+// sampling the chunk as well would count the same bytes twice.
+class DownstreamScope
+{
+ public:
+  DownstreamScope()
+  {
+    if constexpr (enabled)
+      saved_bytes_until_sample_ = std::exchange(detail::t_bytes_until_sample, std::numeric_limits<int64_t>::max());
+  }
+
+  ~DownstreamScope()
+  {
+    if constexpr (enabled)
+      detail::t_bytes_until_sample = saved_bytes_until_sample_;
+  }
+
+  DownstreamScope(DownstreamScope const&) = delete;
+  DownstreamScope& operator=(DownstreamScope const&) = delete;
+
+ private:
+  [[maybe_unused]] int64_t saved_bytes_until_sample_;
+};
+
+// Set the average number of allocated bytes between two samples. Zero turns sampling off.
+void set_sample_period(size_t bytes);
+
+// Return the current sample period, in bytes.
+size_t sample_period();
+
+// Write the current profile to os, in the legacy heap profile format (see above).
+void write_profile(std::ostream& os);
+
+// Write the current profile to the file filename. Returns false if the file could not be written.
+bool dump(std::string const& filename);
+
+// Write a profile to "<prefix>.<pid>.<n>.heap" every time that the signal signum is received.
+// The profile is written by a background thread, not by the signal handler.
+// This can only be called once.
+void dump_on_signal(int signum, std::string prefix);
+
+} // namespace memory::heap_profiler
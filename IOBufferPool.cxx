@@ -0,0 +1,142 @@
+/**
+ * memory -- C++ Memory utilities
+ *
+ * @file
+ * @brief Implementation of class IOBufferPool.
+ *
+ * @Copyright (C) 2026  Carlo Wood.
+ *
+ * pub   dsa3072/C155A4EEE4E527A2 2018-08-16 Carlo Wood (CarloWood on Libera) <carlo@alinoe.com>
+ * fingerprint: 8020 B266 6305 EE2F D53E  6827 C155 A4EE E4E5 27A2
+ *
+ * This file is part of memory.
+ *
+ * memory is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * memory is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with memory.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "sys.h"
+#include "IOBufferPool.h"
+#include "utils/AIAlert.h"
+#include "utils/at_scope_end.h"
+#include <algorithm>
+#include <mutex>
+#include <sys/syscall.h>
+#include <unistd.h>
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#endif
+#include "debug.h"
+
+#ifndef SYS_io_uring_register
+#define SYS_io_uring_register 427
+#endif
+
+namespace memory {
+
+namespace {
+
+#if !__has_include(<linux/io_uring.h>)
+constexpr unsigned int IORING_REGISTER_BUFFERS = 0;
+constexpr unsigned int IORING_UNREGISTER_BUFFERS = 1;
+#endif
+
+// The kernel does not accept registered buffers larger than 1 GiB.
+constexpr size_t max_registered_buffer_size = size_t{1} << 30;
+
+// liburing is not required: io_uring_register has no glibc wrapper, use the system call directly.
+int io_uring_register(int ring_fd, unsigned int opcode, void const* arg, unsigned int nr_args)
+{
+  return ::syscall(SYS_io_uring_register, ring_fd, opcode, arg, nr_args);
+}
+
+} // namespace
+
+IOBufferPool::~IOBufferPool()
+{
+  DoutEntering(dc::notice, "IOBufferPool::~IOBufferPool() [" << this << "]");
+  std::unique_lock<std::shared_mutex> lock(registration_mutex_);
+  if (ring_fd_ != -1)
+  {
+    io_uring_register(ring_fd_, IORING_UNREGISTER_BUFFERS, nullptr, 0);
+    mpp_.unpin_regions();
+  }
+}
+
+void IOBufferPool::register_buffers(int ring_fd)
+{
+  DoutEntering(dc::notice, "IOBufferPool::register_buffers(" << ring_fd << ") [" << this << "]");
+  std::unique_lock<std::shared_mutex> lock(registration_mutex_);
+  // Stop the upstream pool from decommitting chunks before obtaining the regions: a decommitted chunk would no longer
+  // be backed by the pages that the kernel pinned. The pin of a previous registration is kept.
+  bool const was_registered = ring_fd_ != -1;
+  if (!was_registered)
+    mpp_.pin_regions();
+  auto&& unpin = at_scope_end([this]{ if (ring_fd_ == -1) mpp_.unpin_regions(); });
+
+  std::vector<MemoryPagePoolBase::Region> regions = mpp_.regions();
+  std::sort(regions.begin(), regions.end(), [](auto const& r1, auto const& r2){ return r1.begin < r2.begin; });
+  // Split regions that are too large, at a multiple of the buffer size so that every buffer is part of a single registered buffer.
+  size_t const max_size = max_registered_buffer_size / buffer_size() * buffer_size();
+  std::vector<MemoryPagePoolBase::Region> registered;
+  for (MemoryPagePoolBase::Region const& region : regions)
+    for (size_t offset = 0; offset < region.size; offset += max_size)
+      registered.push_back({static_cast<char*>(region.begin) + offset, std::min(max_size, region.size - offset)});
+  std::vector<iovec> iovecs;
+  iovecs.reserve(registered.size());
+  for (MemoryPagePoolBase::Region const& region : registered)
+    iovecs.push_back({region.begin, region.size});
+
+  if (was_registered)
+  {
+    io_uring_register(ring_fd_, IORING_UNREGISTER_BUFFERS, nullptr, 0);
+    ring_fd_ = -1;
+    registered_.clear();
+  }
+  if (iovecs.empty())
+    return;
+  if (io_uring_register(ring_fd, IORING_REGISTER_BUFFERS, iovecs.data(), iovecs.size()) == -1)
+    THROW_LALERTE("io_uring_register([FD], IORING_REGISTER_BUFFERS, [NR] buffers)", AIArgs("[FD]", ring_fd)("[NR]", iovecs.size()));
+  Dout(dc::notice, "Registered " << iovecs.size() << " buffers.");
+  ring_fd_ = ring_fd;
+  registered_ = std::move(registered);
+}
+
+void IOBufferPool::unregister_buffers()
+{
+  std::unique_lock<std::shared_mutex> lock(registration_mutex_);
+  if (ring_fd_ == -1)
+    return;
+  int const ring_fd = std::exchange(ring_fd_, -1);
+  registered_.clear();
+  mpp_.unpin_regions();
+  if (io_uring_register(ring_fd, IORING_UNREGISTER_BUFFERS, nullptr, 0) == -1)
+    THROW_LALERTE("io_uring_register([FD], IORING_UNREGISTER_BUFFERS)", AIArgs("[FD]", ring_fd));
+}
+
+int IOBufferPool::buf_index(void const* ptr) const
+{
+  std::shared_lock<std::shared_mutex> lock(registration_mutex_);
+  // Find the last region that starts at or before ptr.
+  auto region = std::upper_bound(registered_.begin(), registered_.end(), ptr,
+      [](void const* ptr, MemoryPagePoolBase::Region const& region){ return ptr < region.begin; });
+  if (region == registered_.begin())
+    return -1;
+  --region;
+  if (static_cast<char const*>(ptr) >= static_cast<char const*>(region->begin) + region->size)
+    return -1;
+  return region - registered_.begin();
+}
+
+} // namespace memory
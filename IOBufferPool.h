@@ -0,0 +1,303 @@
+/**
+ * memory -- C++ Memory utilities
+ *
+ * @file
+ * @brief Declaration of class IOBufferPool.
+ *
+ * @Copyright (C) 2026  Carlo Wood.
+ *
+ * pub   dsa3072/C155A4EEE4E527A2 2018-08-16 Carlo Wood (CarloWood on Libera) <carlo@alinoe.com>
+ * fingerprint: 8020 B266 6305 EE2F D53E  6827 C155 A4EE E4E5 27A2
+ *
+ * This file is part of memory.
+ *
+ * memory is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * memory is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with memory.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+#include "MemoryPagePool.h"
+#include "NodeMemoryResource.h"
+#include <array>
+#include <atomic>
+#include <limits>
+#include <shared_mutex>
+#include <span>
+#include <utility>
+#include <vector>
+#include <sys/uio.h>
+#include "debug.h"
+
+namespace memory {
+
+class IOBufferPool;
+
+// class IOBuffer
+//
+// A reference counted handle to a page aligned I/O buffer of an IOBufferPool.
+// Copying an IOBuffer shares the buffer; the buffer is returned to the pool when the last handle is destroyed.
+//
+//   <---------------------- capacity() ---------------------->
+//   | data that was read, or will be written |   free space   |
+//   ^                                        ^
+//   data()                                   data() + size()
+//   <---------------- iov() ---------------->< free_iov() --->
+//
+class IOBuffer
+{
+ private:
+  // The out of line control block of a buffer (allocated from IOBufferPool::control_blocks_).
+  struct Control
+  {
+    std::atomic<uint32_t> refs;         // The number of IOBuffer objects that point to this control block.
+    uint32_t size;                      // The number of bytes of data in the buffer.
+    char* data;                         // The buffer (a block of IOBufferPool::mpp_).
+    IOBufferPool* pool;                 // The pool that the buffer was allocated from.
+  };
+
+  Control* control_;
+
+  friend class IOBufferPool;
+  explicit IOBuffer(Control* control) : control_(control) { }
+
+  void release();
+
+ public:
+  // Create an empty handle.
+  IOBuffer() : control_(nullptr) { }
+
+  IOBuffer(IOBuffer const& buffer) : control_(buffer.control_)
+  {
+    if (control_)
+      control_->refs.fetch_add(1, std::memory_order_relaxed);
+  }
+
+  IOBuffer(IOBuffer&& buffer) : control_(std::exchange(buffer.control_, nullptr)) { }
+
+  IOBuffer& operator=(IOBuffer buffer)
+  {
+    std::swap(control_, buffer.control_);
+    return *this;
+  }
+
+  ~IOBuffer()
+  {
+    if (control_)
+      release();
+  }
+
+  // Return true if this handle refers to a buffer.
+  explicit operator bool() const { return control_ != nullptr; }
+
+  // Accessors.
+  char* data() const { return control_->data; }
+  size_t size() const { return control_->size; }
+  size_t capacity() const;
+  uint32_t use_count() const { return control_ ? control_->refs.load(std::memory_order_relaxed) : 0; }
+
+  // Set the number of bytes of data in the buffer.
+  void resize(size_t size)
+  {
+    // size may not exceed the capacity of the buffer.
+    ASSERT(size <= capacity());
+    control_->size = size;
+  }
+
+  // The data in the buffer, for write(2), writev(2) or IORING_OP_WRITE(_FIXED).
+  iovec iov() const { return {control_->data, control_->size}; }
+
+  // The free space after the data, for read(2), readv(2) or IORING_OP_READ(_FIXED).
+  iovec free_iov() const { return {control_->data + control_->size, capacity() - control_->size}; }
+
+  // Return the index of the registered buffer that contains this buffer, for IORING_OP_READ_FIXED
+  // and IORING_OP_WRITE_FIXED, or -1 if the buffer is not part of a registered region.
+  int buf_index() const;
+};
+
+// class IOVector
+//
+// A scatter/gather view of up to N IOBuffer's, for readv(2), writev(2), sendmsg(2) and IORING_OP_READV/WRITEV.
+//
+//   memory::IOVector<4> vec;
+//   for (int i = 0; i < 4; ++i)
+//     vec.push_back(pool.allocate());
+//   ssize_t len = ::readv(fd, vec.free_iovecs().data(), vec.free_iovecs().size());
+//   if (len > 0)
+//     vec.commit(len);                // Increase the size of the buffers by a total of len bytes.
+//
+template<int N = 8>
+class IOVector
+{
+ private:
+  std::array<IOBuffer, N> buffers_;
+  std::array<iovec, N> iovecs_;         // Scratch space for data_iovecs() and free_iovecs().
+  int count_ = 0;                       // The number of elements of buffers_ that are in use.
+
+ public:
+  // Append buffer. Returns false if this IOVector is already full.
+  bool push_back(IOBuffer buffer)
+  {
+    if (AI_UNLIKELY(count_ == N))
+      return false;
+    buffers_[count_++] = std::move(buffer);
+    return true;
+  }
+
+  // Drop all buffers.
+  void clear()
+  {
+    for (int i = 0; i < count_; ++i)
+      buffers_[i] = IOBuffer{};
+    count_ = 0;
+  }
+
+  // Accessors.
+  int size() const { return count_; }
+  IOBuffer const& operator[](int i) const { return buffers_[i]; }
+
+  // The data of all buffers (see IOBuffer::iov). The returned span is invalidated by the next call to data_iovecs or free_iovecs.
+  std::span<iovec const> data_iovecs()
+  {
+    for (int i = 0; i < count_; ++i)
+      iovecs_[i] = buffers_[i].iov();
+    return {iovecs_.data(), static_cast<size_t>(count_)};
+  }
+
+  // The free space of all buffers (see IOBuffer::free_iov). The returned span is invalidated by the next call to data_iovecs or free_iovecs.
+  std::span<iovec const> free_iovecs()
+  {
+    for (int i = 0; i < count_; ++i)
+      iovecs_[i] = buffers_[i].free_iov();
+    return {iovecs_.data(), static_cast<size_t>(count_)};
+  }
+
+  // Add bytes (that were read into the iovecs returned by free_iovecs) to the data of the buffers.
+  void commit(size_t bytes)
+  {
+    for (int i = 0; i < count_ && bytes > 0; ++i)
+    {
+      IOBuffer& buffer = buffers_[i];
+      size_t const len = std::min(bytes, buffer.capacity() - buffer.size());
+      buffer.resize(buffer.size() + len);
+      bytes -= len;
+    }
+    // More bytes were committed than there was free space.
+    ASSERT(bytes == 0);
+  }
+};
+
+// class IOBufferPool
+//
+// A pool of page aligned, reference counted I/O buffers of mpp.block_size() bytes, that are
+// allocated from a MemoryPagePool, MemoryMappedPool or NumaMemoryPagePool. Data can be read
+// directly into a buffer and written directly from it, avoiding an allocation and a copy
+// per packet.
+//
+// The memory of the pool can be registered with an io_uring instance (IORING_REGISTER_BUFFERS),
+// after which IOBuffer::buf_index() returns the index to use with IORING_OP_READ_FIXED and
+// IORING_OP_WRITE_FIXED. Only the regions that the upstream pool had allocated at the moment
+// of registration are registered (see MemoryPagePoolBase::regions()); call reserve() (or
+// MemoryMappedPool::grow) on the upstream pool first, and register_buffers() again after
+// it grew, to have all buffers registered.
+//
+// io_uring pins the pages of registered buffers, so while buffers are registered the upstream
+// pool does not return memory to the operating system (see MemoryPagePoolBase::pin_regions):
+// MemoryPagePool::trim() and decay() do nothing. Chunks that were already decommitted at the
+// moment of registration are not registered; buf_index() returns -1 for buffers that are
+// allocated from them after they were reused.
+//
+//   memory::MemoryPagePool mpp(0x10000);          // Buffers of 64 kB.
+//   mpp.reserve(1024);
+//   memory::IOBufferPool pool(mpp);
+//   pool.register_buffers(ring_fd);
+//   memory::IOBuffer buffer = pool.allocate();
+//   // Prepare an IORING_OP_READ_FIXED with addr = buffer.free_iov().iov_base, len = buffer.free_iov().iov_len
+//   // and buf_index = buffer.buf_index(), and upon completion: buffer.resize(buffer.size() + cqe->res).
+//
+// The (small) control blocks with the reference counts are allocated from mpp as well, but
+// out of line, so that the whole buffer is available for I/O.
+//
+class IOBufferPool
+{
+ private:
+  MemoryPagePoolBase& mpp_;
+  NodeMemoryResource control_blocks_;   // The IOBuffer::Control objects.
+  mutable std::shared_mutex registration_mutex_;        // Protects the members below.
+  int ring_fd_;                                         // The io_uring that the regions are registered with, or -1.
+  std::vector<MemoryPagePoolBase::Region> registered_;  // The registered regions, sorted by address (the index is the buf_index).
+
+  friend class IOBuffer;
+  void release(IOBuffer::Control* control)
+  {
+    mpp_.deallocate(control->data);
+    control_blocks_.deallocate(control);
+  }
+
+ public:
+  IOBufferPool(MemoryPagePoolBase& mpp) : mpp_(mpp), control_blocks_(mpp, sizeof(IOBuffer::Control)), ring_fd_(-1)
+  {
+    // The size of the data in a buffer is stored in 32 bits (IOBuffer::Control::size).
+    ASSERT(mpp.block_size() <= std::numeric_limits<uint32_t>::max());
+  }
+
+  // All buffers must have been released.
+  ~IOBufferPool();
+
+  // Allocate a new buffer. Returns an empty IOBuffer when out of memory.
+  IOBuffer allocate()
+  {
+    char* data = static_cast<char*>(mpp_.allocate());
+    if (AI_UNLIKELY(!data))
+      return {};
+    IOBuffer::Control* control = static_cast<IOBuffer::Control*>(control_blocks_.allocate(sizeof(IOBuffer::Control)));
+    if (AI_UNLIKELY(!control))
+    {
+      mpp_.deallocate(data);
+      return {};
+    }
+    return IOBuffer{new (control) IOBuffer::Control{{1}, 0, data, this}};
+  }
+
+  // Accessor.
+  size_t buffer_size() const { return mpp_.block_size(); }
+
+  // Register the current regions of the upstream pool with the io_uring ring_fd. Replaces a previous registration.
+  // The regions of the upstream pool are pinned until unregister_buffers() is called (or this pool is destroyed).
+  void register_buffers(int ring_fd);
+
+  // Unregister the buffers (if any).
+  void unregister_buffers();
+
+  // Return the index of the registered buffer that contains ptr, or -1.
+  int buf_index(void const* ptr) const;
+};
+
+inline size_t IOBuffer::capacity() const
+{
+  return control_->pool->buffer_size();
+}
+
+inline int IOBuffer::buf_index() const
+{
+  return control_->pool->buf_index(control_->data);
+}
+
+inline void IOBuffer::release()
+{
+  if (control_->refs.fetch_sub(1, std::memory_order_acq_rel) == 1)
+    control_->pool->release(control_);
+}
+
+} // namespace memory
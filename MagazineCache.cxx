@@ -0,0 +1,84 @@
+/**
+ * memory -- C++ Memory utilities
+ *
+ * @file
+ * @brief Definition of class MagazineCache.
+ *
+ * @Copyright (C) 2026  Carlo Wood.
+ *
+ * pub   dsa3072/C155A4EEE4E527A2 2018-08-16 Carlo Wood (CarloWood on Libera) <carlo@alinoe.com>
+ * fingerprint: 8020 B266 6305 EE2F D53E  6827 C155 A4EE E4E5 27A2
+ *
+ * This file is part of memory.
+ *
+ * memory is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * memory is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with memory.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "sys.h"
+#include "MagazineCache.h"
+#include "PreemptionPoint.h"
+#include "debug.h"
+
+namespace memory {
+
+MagazineCache::MagazineCache(unsigned int magazine_size, ThreadIndex::index_type max_threads) :
+  magazine_size_(magazine_size), max_threads_(max_threads), slots_(new ThreadSlot[max_threads]()),
+  depot_head_tag_(PtrTag::end_of_list)
+{
+  DoutEntering(dc::notice, "MagazineCache::MagazineCache(" << magazine_size << ", " << max_threads << ") [" << this << "]");
+  // A magazine must be able to hold at least one node.
+  ASSERT(magazine_size > 0);
+}
+
+bool MagazineCache::pop_depot(Magazine& magazine)
+{
+  // The magazine that is replaced must be empty.
+  ASSERT(magazine.count_ == 0);
+  // Use std::memory_order_acquire to synchronize with the std::memory_order_release in push_depot,
+  // so that the value of next_magazine_ read below is the value written in push_depot.
+  PtrTag head_tag(depot_head_tag_.load(std::memory_order_acquire));
+  while (!head_tag.is_end_of_list())
+  {
+    MagazineNode* front_magazine = static_cast<MagazineNode*>(head_tag.ptr());
+    PtrTag const new_head_tag(front_magazine->next_magazine(), head_tag.tag() + 1);
+    preemption_point();
+    if (AI_LIKELY(depot_head_tag_.compare_exchange_weak(head_tag.encoded_, new_head_tag.encoded_, std::memory_order_acquire)))
+    {
+      magazine.head_ = front_magazine;
+      magazine.count_ = magazine_size_;
+      return true;
+    }
+  }
+  return false;
+}
+
+void MagazineCache::push_depot(Magazine& magazine)
+{
+  // Only full magazines are stored in the depot.
+  ASSERT(magazine.count_ == magazine_size_);
+  MagazineNode* const new_front_magazine = static_cast<MagazineNode*>(magazine.head_);
+  PtrTag head_tag(depot_head_tag_.load(std::memory_order_relaxed));
+  for (;;)
+  {
+    PtrTag const new_head_tag(new_front_magazine, head_tag.tag());
+    new_front_magazine->set_next_magazine(static_cast<MagazineNode*>(head_tag.ptr()));
+    // The std::memory_order_release makes the above store, and the nodes of the magazine, visible to pop_depot.
+    preemption_point();
+    if (AI_LIKELY(depot_head_tag_.compare_exchange_weak(head_tag.encoded_, new_head_tag.encoded_, std::memory_order_release)))
+      break;
+  }
+  magazine = {};
+}
+
+} // namespace memory
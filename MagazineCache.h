@@ -0,0 +1,202 @@
+/**
+ * memory -- C++ Memory utilities
+ *
+ * @file
+ * @brief Declaration of class MagazineCache.
+ *
+ * @Copyright (C) 2026  Carlo Wood.
+ *
+ * pub   dsa3072/C155A4EEE4E527A2 2018-08-16 Carlo Wood (CarloWood on Libera) <carlo@alinoe.com>
+ * fingerprint: 8020 B266 6305 EE2F D53E  6827 C155 A4EE E4E5 27A2
+ *
+ * This file is part of memory.
+ *
+ * memory is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * memory is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with memory.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "PtrTag.h"
+#include "CacheLine.h"
+#include "ThreadIndex.h"
+#include "utils/macros.h"
+#include <atomic>
+#include <memory>
+#include <utility>
+#include "debug.h"
+
+namespace memory {
+
+// class MagazineCache
+//
+// A per-thread cache of free nodes that can be put in front of a shared free list
+// (for example, the SimpleSegregatedStorage of a NodeMemoryResource).
+//
+// Every thread has two "magazines": singly linked lists of at most `magazine_size` free nodes,
+// called `loaded` and `previous`. Allocation pops a node from `loaded` and deallocation pushes
+// a node onto `loaded`; neither touches memory that is shared with other threads.
+//
+// Only when `loaded` is empty (upon allocation) or full (upon deallocation) the roles of
+// `loaded` and `previous` are swapped, and only if that doesn't help a whole magazine is
+// exchanged with the "depot": a lock-free stack of full magazines that is shared by all threads.
+// Each exchange with the depot is a single CAS.
+//
+//  depot_head_tag_ -->.------------------.      .------------------.
+//                     | next_ -----------+-->.. | next_ -----------+-->.. (magazine_size nodes, linked with next_)
+//                     | next_magazine_ --+----->| next_magazine_ --+--> nullptr
+//                     `------------------'      `------------------'
+//
+// The invariant is that `previous` is always either full or empty. Hence,
+// - allocate: if `loaded` is empty and `previous` is full then swap them; otherwise
+//   pop a full magazine from the depot into `loaded`. If the depot is empty too,
+//   allocate() returns nullptr and the caller should fall back to the shared free list.
+// - deallocate: if `loaded` is full and `previous` is empty then swap them; otherwise
+//   push `previous` onto the depot and move `loaded` to `previous`.
+//
+// The per-thread magazines are stored in this object, indexed by ThreadIndex.
+// Threads with an index larger than or equal to `max_threads` are not cached:
+// allocate() returns nullptr and deallocate() returns false for them.
+//
+// Note that at most max_threads * 2 * magazine_size nodes can be "stuck" in the
+// magazines of threads that are not allocating; the depot is available to all threads.
+//
+class MagazineCache
+{
+ public:
+  static constexpr ThreadIndex::index_type default_max_threads = 256;
+
+ private:
+  // The first node of a full magazine in the depot.
+  struct MagazineNode : PtrTag::FreeNode
+  {
+    MagazineNode* next_magazine_;       // The first node of the next full magazine in the depot.
+                                        // Like FreeNode::next_, pop_depot reads this speculatively: use the (relaxed) atomic accessors.
+
+    MagazineNode* next_magazine() const
+    {
+      return std::atomic_ref<MagazineNode*>(const_cast<MagazineNode*&>(next_magazine_)).load(std::memory_order_relaxed);
+    }
+
+    void set_next_magazine(MagazineNode* next_magazine)
+    {
+      std::atomic_ref<MagazineNode*>(next_magazine_).store(next_magazine, std::memory_order_relaxed);
+    }
+  };
+
+  struct Magazine
+  {
+    PtrTag::FreeNode* head_;            // The first node of this magazine, or nullptr if the magazine is empty.
+    unsigned int count_;                // The number of nodes in this magazine.
+
+    [[gnu::always_inline]] void push(void* ptr)
+    {
+      PtrTag::FreeNode* node = static_cast<PtrTag::FreeNode*>(ptr);
+      node->set_next(head_);
+      head_ = node;
+      ++count_;
+    }
+
+    [[gnu::always_inline]] void* pop()
+    {
+      PtrTag::FreeNode* node = head_;
+      head_ = node->next();
+      --count_;
+      return node;
+    }
+  };
+
+  // Make sure that the magazines of different threads do not share a cache line.
+  struct alignas(cache_line_size) ThreadSlot
+  {
+    Magazine loaded_;
+    Magazine previous_;
+  };
+
+  unsigned int const magazine_size_;                    // The number of nodes in a full magazine.
+  ThreadIndex::index_type const max_threads_;           // The number of elements in slots_.
+  std::unique_ptr<ThreadSlot[]> slots_;                 // The per-thread magazines, indexed by ThreadIndex.
+  alignas(cache_line_size) std::atomic<PtrTag::encoded_type> depot_head_tag_;      // Encodes a pointer to the first MagazineNode of the depot, plus a tag.
+
+  bool pop_depot(Magazine& magazine);
+  void push_depot(Magazine& magazine);
+
+  [[gnu::always_inline]] ThreadSlot* thread_slot() const
+  {
+    ThreadIndex::index_type const index = ThreadIndex::get();
+    return AI_LIKELY(index < max_threads_) ? &slots_[index] : nullptr;
+  }
+
+ public:
+  // The minimum size of the nodes that are cached.
+  static constexpr size_t minimum_node_size = sizeof(MagazineNode);
+
+  MagazineCache(unsigned int magazine_size, ThreadIndex::index_type max_threads = default_max_threads);
+
+  // Return a cached node, or nullptr if no cached node is available for the current thread.
+  void* allocate()
+  {
+    ThreadSlot* slot = thread_slot();
+    if (AI_UNLIKELY(!slot))
+      return nullptr;
+    if (AI_UNLIKELY(slot->loaded_.count_ == 0))
+    {
+      if (slot->previous_.count_ > 0)
+        std::swap(slot->loaded_, slot->previous_);
+      else if (!pop_depot(slot->loaded_))
+        return nullptr;
+    }
+    return slot->loaded_.pop();
+  }
+
+  // Returns true if the current thread has magazines.
+  bool has_slot() const { return thread_slot() != nullptr; }
+
+  // Accessor.
+  unsigned int magazine_size() const { return magazine_size_; }
+
+  // Load the (currently empty) magazines of the current thread with `count` nodes,
+  // a nullptr terminated chain that starts at `head`. Only call this after allocate()
+  // returned nullptr while has_slot() is true, and count <= magazine_size.
+  void load(PtrTag::FreeNode* head, unsigned int count)
+  {
+    ThreadSlot* slot = thread_slot();
+    ASSERT(slot && slot->loaded_.count_ == 0 && slot->previous_.count_ == 0 && count <= magazine_size_);
+    slot->loaded_.head_ = head;
+    slot->loaded_.count_ = count;
+  }
+
+  // Cache ptr, a node previously returned by the NodeMemoryResource that this cache is in front of.
+  // Returns false if ptr was not cached (because the current thread has no slot).
+  bool deallocate(void* ptr)
+  {
+    ThreadSlot* slot = thread_slot();
+    if (AI_UNLIKELY(!slot))
+      return false;
+    if (AI_UNLIKELY(slot->loaded_.count_ == magazine_size_))
+    {
+      if (slot->previous_.count_ == 0)
+        std::swap(slot->loaded_, slot->previous_);
+      else
+      {
+        push_depot(slot->previous_);
+        slot->previous_ = slot->loaded_;
+        slot->loaded_ = {};
+      }
+    }
+    slot->loaded_.push(ptr);
+    return true;
+  }
+};
+
+} // namespace memory
@@ -31,39 +31,203 @@
 
 namespace memory {
 
+// A NULL next_ pointer of a free block means that the next free block is just the next
+// block in the file (or, if that is the end of the mapping, that this is the last free block).
+// This allows using the mapped memory without initialization, but also means that the end of
+// the free list must be marked explicitly when a block is deallocated while the free list is
+// empty: that is done with end_of_list_node().
+//
+// The head of the free list is normally stored in this object, but it can be moved
+// elsewhere with use_head_tag(), for example into the header of the mapped file itself,
+// so that the free list survives a restart.
+//
+// The links of the free list (the next_ pointers and the pointer in the head) are normally
+// absolute addresses. After calling use_offset_links(mapped_base) they are stored relative
+// to mapped_base instead (plus offset_bias, so that a link is never NULL or equal to
+// end_of_list_node()), so that the same free list can be used by processes that map the
+// file at different addresses. Both are handled by the same code: an absolute link is
+// simply an offset relative to zero.
+//
 class MappedSegregatedStorage : public SimpleSegregatedStorageBase
 {
  public:
+  // The value that is added to offsets, to avoid the special values of a link.
+  static constexpr uintptr_t offset_bias = 2 * alignof(PtrTag::FreeNode);
+
+ private:
+  std::atomic<PtrTag::encoded_type>* head_tag_ptr_;     // Points to the head of the free list (normally this->head_tag_).
+  uintptr_t link_base_;                                 // Zero for absolute links, or mapped_base - offset_bias for offset links.
+
+  [[gnu::always_inline]] bool CAS_head_tag(PtrTag& head_tag, PtrTag new_head_tag, std::memory_order order)
+  {
+    preemption_point();
+    return head_tag_ptr_->compare_exchange_weak(head_tag.encoded_, new_head_tag.encoded_, order);
+  }
+
+  // Convert between the address of a node and the link that is stored in next_ (or the head).
+  [[gnu::always_inline]] PtrTag::FreeNode* to_link(void* node) const
+  {
+    return reinterpret_cast<PtrTag::FreeNode*>(reinterpret_cast<uintptr_t>(node) - link_base_);
+  }
+
+  [[gnu::always_inline]] PtrTag::FreeNode* from_link(PtrTag::FreeNode* link) const
+  {
+    return reinterpret_cast<PtrTag::FreeNode*>(reinterpret_cast<uintptr_t>(link) + link_base_);
+  }
+
+ public:
+  // The value of next_ that marks the end of the free list.
+  static PtrTag::FreeNode* end_of_list_node() { return reinterpret_cast<PtrTag::FreeNode*>(alignof(PtrTag::FreeNode)); }
+
+  MappedSegregatedStorage() : head_tag_ptr_(&this->head_tag_), link_base_(0) { }
+
+  // Use *head_tag as the head of the free list, from now on. Call this before using the storage.
+  // If `head_tag` already contains a free list (as opposed to being zero) then that is used as-is.
+  void use_head_tag(std::atomic<PtrTag::encoded_type>* head_tag) { head_tag_ptr_ = head_tag; }
+
+  // Store all links relative to mapped_base, from now on. Call this before using the storage.
+  void use_offset_links(void* mapped_base) { link_base_ = reinterpret_cast<uintptr_t>(mapped_base) - offset_bias; }
+
+  // Initialize this MappedSegregatedStorage with an existing free-list.
+  void initialize(void* head)
+  {
+    // Call this after default construction, before using the segregated storage.
+    ASSERT(PtrTag(*head_tag_ptr_).is_end_of_list());
+    head_tag_ptr_->store(PtrTag::encode(to_link(head), 0), std::memory_order_relaxed);
+  }
+
+  // Accessor; note that the pointer of the returned value is a link (see from_link).
+  PtrTag head_tag() const { return PtrTag(head_tag_ptr_->load(std::memory_order_acquire)); }
+
   void* allocate(void* mapped_base, size_t mapped_size, size_t block_size)
   {
     // Load the current value of head_tag_ into `head_tag`.
     // Use std::memory_order_acquire to synchronize with the std::memory_order_release in deallocate,
     // so that value of `next` read below will be the value written in deallocate corresponding to
     // this head value.
-    PtrTag head_tag(this->head_tag_.load(std::memory_order_acquire));
-    while (head_tag != PtrTag::end_of_list)
+    PtrTag head_tag(head_tag_ptr_->load(std::memory_order_acquire));
+    while (!head_tag.is_end_of_list())
     {
-      PtrTag new_head_tag = head_tag.next();
+      PtrTag::FreeNode* const front_node = from_link(head_tag.ptr());
+      PtrTag::FreeNode* const next_link = front_node->link();
+      PtrTag new_head_tag(next_link, head_tag.tag() + 1);
       // If the next pointer is NULL then this could be a block that wasn't allocated before.
       // In that case the real next block is just the next block in the file.
-      if (AI_UNLIKELY(new_head_tag.ptr() == nullptr))
+      if (AI_UNLIKELY(next_link == nullptr))
       {
-        char* front_node = reinterpret_cast<char*>(head_tag.ptr());
-        char* second_node = front_node + block_size;
-        new_head_tag = PtrTag::encode(second_node, head_tag.tag() + 1);
+        char* second_node = reinterpret_cast<char*>(front_node) + block_size;
         if (AI_UNLIKELY(second_node == static_cast<char*>(mapped_base) + mapped_size))
-          new_head_tag = PtrTag::end_of_list;
+          new_head_tag = PtrTag::encode(nullptr, head_tag.tag() + 1);
+        else
+          new_head_tag = PtrTag::encode(to_link(second_node), head_tag.tag() + 1);
       }
+      else if (AI_UNLIKELY(next_link == end_of_list_node()))
+        new_head_tag = PtrTag::encode(nullptr, head_tag.tag() + 1);
       // The std::memory_order_acquire is used in case of failure and required for the next
       // read of next_ at the top of the current loop (the previous line).
-      if (AI_LIKELY(this->CAS_head_tag(head_tag, new_head_tag, std::memory_order_acquire)))
+      if (AI_LIKELY(CAS_head_tag(head_tag, new_head_tag, std::memory_order_acquire)))
         // Return the old head.
-        return head_tag.ptr();
+        return front_node;
       // head_tag_ was changed (the new value is now in `head_tag`). Try again with the new value.
+      count_cas_retry();
     }
     // Reached the end of the list.
     return nullptr;
   }
+
+  // Allocate up to n blocks and write them to ptrs[0] ... ptrs[n - 1], detaching whole chains with a single CAS.
+  // Returns the number of blocks actually allocated; this is only less than n when the mapped memory is exhausted.
+  size_t allocate_n(void* mapped_base, size_t mapped_size, size_t block_size, void** ptrs, size_t n)
+  {
+    char* const mapped_end = static_cast<char*>(mapped_base) + mapped_size;
+    size_t total = 0;
+    // See allocate() for the reason of the memory order.
+    PtrTag head_tag(head_tag_ptr_->load(std::memory_order_acquire));
+    while (total < n && !head_tag.is_end_of_list())
+    {
+      // Walk the free list, see SimpleSegregatedStorageBase::allocate_chain.
+      // The nodes are written to ptrs, but only belong to us if the CAS below succeeds.
+      PtrTag::FreeNode* node = from_link(head_tag.ptr());
+      PtrTag::FreeNode* next_node;
+      size_t length = 0;
+      bool stale = false;
+      for (;;)
+      {
+        ptrs[total + length++] = node;
+        PtrTag::FreeNode* const next_link = node->link();
+        next_node = nullptr;
+        // A NULL next pointer means that the next block is just the next block in the file (see allocate()).
+        if (AI_UNLIKELY(next_link == nullptr))
+        {
+          char* second_node = reinterpret_cast<char*>(node) + block_size;
+          if (AI_LIKELY(second_node != mapped_end))
+            next_node = reinterpret_cast<PtrTag::FreeNode*>(second_node);
+        }
+        else if (AI_LIKELY(next_link != end_of_list_node()))
+          next_node = from_link(next_link);
+        if (next_node == nullptr || total + length == n)
+          break;
+        if (AI_UNLIKELY(head_tag != head_tag_ptr_->load(std::memory_order_acquire)))
+        {
+          stale = true;
+          break;
+        }
+        node = next_node;
+      }
+      if (AI_UNLIKELY(stale))
+      {
+        head_tag = head_tag_ptr_->load(std::memory_order_acquire);
+        continue;
+      }
+      PtrTag const new_head_tag(next_node ? to_link(next_node) : nullptr, head_tag.tag() + 1);
+      if (AI_LIKELY(CAS_head_tag(head_tag, new_head_tag, std::memory_order_acquire)))
+      {
+        total += length;
+        head_tag = head_tag_ptr_->load(std::memory_order_acquire);
+      }
+      else
+        // head_tag_ was changed (the new value is now in `head_tag`). Try again with the new value.
+        count_cas_retry();
+    }
+    return total;
+  }
+
+  // Splice the chain first ... last into the free list with a single CAS.
+  // The blocks between first and last must already be linked (with to_link, or NULL for "the next block in the file").
+  void deallocate_chain(PtrTag::FreeNode* first, PtrTag::FreeNode* last)
+  {
+    PtrTag::FreeNode* const first_link = to_link(first);
+    PtrTag head_tag(head_tag_ptr_->load(std::memory_order_relaxed));
+    for (;;)
+    {
+      PtrTag const new_head_tag(first_link, head_tag.tag());
+      // Do not store a NULL pointer in next_, that would mean "the next block in the file".
+      PtrTag::FreeNode* next_link = head_tag.ptr();
+      last->set_link(next_link ? next_link : end_of_list_node());
+      // See SimpleSegregatedStorageBase::deallocate for the reason of the memory order.
+      if (AI_LIKELY(CAS_head_tag(head_tag, new_head_tag, std::memory_order_release)))
+        return;
+      count_cas_retry();
+    }
+  }
+
+  // ptr must be a value previously returned by allocate().
+  void deallocate(void* ptr)
+  {
+    PtrTag::FreeNode* node = static_cast<PtrTag::FreeNode*>(ptr);
+    deallocate_chain(node, node);
+  }
+
+  // Deallocate ptrs[0] ... ptrs[n - 1], values previously returned by allocate(), with a single CAS.
+  void deallocate_n(void* const* ptrs, size_t n)
+  {
+    if (AI_UNLIKELY(n == 0))
+      return;
+    // Link the nodes, using links rather than pointers.
+    for (size_t i = 0; i < n - 1; ++i)
+      static_cast<PtrTag::FreeNode*>(ptrs[i])->set_link(to_link(ptrs[i + 1]));
+    deallocate_chain(static_cast<PtrTag::FreeNode*>(ptrs[0]), static_cast<PtrTag::FreeNode*>(ptrs[n - 1]));
+  }
 };
 
 } // namespace memory
@@ -32,7 +32,9 @@
 #ifdef USE_ENCHANTUM
 #include "utils/to_string.h"
 #endif
+#include <cerrno>
 #include <fcntl.h>
+#include <sys/file.h>
 #include <sys/stat.h>
 #include <sys/mman.h>
 
@@ -99,6 +101,14 @@ std::string print_flags(int flags)
     empty = false;
     flags &= ~MAP_FIXED;
   }
+  if ((flags & MAP_FIXED_NOREPLACE))
+  {
+    if (!empty)
+      result += "|";
+    result += "MAP_FIXED_NOREPLACE";
+    empty = false;
+    flags &= ~MAP_FIXED_NOREPLACE;
+  }
   ASSERT(flags == 0);
   if (empty)
     result = "0";
@@ -109,7 +119,8 @@ std::string print_flags(int flags)
 #endif
 
 MemoryMappedPool::MemoryMappedPool(std::filesystem::path const& filename, size_t block_size, size_t file_size,
-    Mode mode, bool zero_init) : MemoryPagePoolBase(block_size), mapped_base_(MAP_FAILED)
+    Mode mode, bool zero_init, size_t max_size, bool recoverable, bool offset_links) :
+  MemoryPagePoolBase(block_size), mapped_base_(MAP_FAILED), mapped_size_(0), max_size_(max_size), fd_(-1), mode_(mode), header_(nullptr)
 {
   DoutEntering(dc::notice, "MemoryMappedPool::MemoryMappedPool(" << filename << ", " << block_size << ", " << file_size << ", " <<
 #ifdef USE_ENCHANTUM
@@ -117,11 +128,16 @@ MemoryMappedPool::MemoryMappedPool(std::filesystem::path const& filename, size_t
 #else
       static_cast<int>(mode) <<
 #endif
-      ", " << std::boolalpha << zero_init << ") [" << this << "]");
+      ", " << std::boolalpha << zero_init << ", " << max_size << ", " << recoverable << ", " << offset_links << ") [" << this << "]");
 
   // block_size must be capable of containing a FreeNode.
   ASSERT(block_size >= sizeof(typename PtrTag::FreeNode));
 
+  // The shared mode is persistent, and requires the free list to be stored in the file, with offset links.
+  bool const persistent = mode == Mode::persistent || mode == Mode::shared;
+  if (mode == Mode::shared)
+    recoverable = offset_links = true;
+
   // block_size must be a multiple of memory_page_size (and larger than 0).
   ASSERT(block_size % memory_page_size() == 0);
 
@@ -130,6 +146,15 @@ MemoryMappedPool::MemoryMappedPool(std::filesystem::path const& filename, size_t
   // The file_size must be a multiple of memory_page_size.
   ASSERT(file_size % memory_page_size() == 0);
 
+  // A read-only pool can not grow.
+  ASSERT(max_size == 0 || mode != Mode::read_only);
+
+  // A read-only pool can not be recoverable: the header is written to.
+  ASSERT(!recoverable || mode != Mode::read_only);
+
+  // Offset links are only useful if the free list is stored in the file.
+  ASSERT(!offset_links || recoverable);
+
   // The following possibilities exist:
   //
   //  .---- File does not (N) exist (or not readable) - ⎫
@@ -208,7 +233,7 @@ MemoryMappedPool::MemoryMappedPool(std::filesystem::path const& filename, size_t
   }
   else if (!is_writable)
   {
-    if (mode == Mode::persistent)                       // R-P- is not possible.
+    if (persistent)                                     // R-P- is not possible.
       // Persistence requires writing to the file.
       error = "Persistent mode requested, but file [FILEPATH] is not writable.";
     else if (zero_init)                                 // R--Z is not possible.
@@ -256,7 +281,7 @@ MemoryMappedPool::MemoryMappedPool(std::filesystem::path const& filename, size_t
     // Open the existing file.
     int flags = O_RDONLY;
     mode_t m;
-    if (mode == Mode::persistent)
+    if (persistent)
     {
       // W-P0
       // W-PZ
@@ -296,7 +321,7 @@ MemoryMappedPool::MemoryMappedPool(std::filesystem::path const& filename, size_t
     else
       mapped_size_ = file_size;
 
-    if (mode == Mode::persistent && zero_init)
+    if (persistent && zero_init)
     {
       // W-PZ
       //
@@ -320,31 +345,495 @@ MemoryMappedPool::MemoryMappedPool(std::filesystem::path const& filename, size_t
   int prot = PROT_READ|PROT_WRITE;
   int flags = MAP_PRIVATE;
 
-  if (mode == Mode::persistent)
+  if (persistent)
     flags = MAP_SHARED;
   else if (mode == Mode::read_only)
     prot = PROT_READ;
 
+  // Read the header of an existing recoverable pool.
+  FileHeaderInfo previous_info{};
+  bool has_header = false;
+  if (recoverable)
+  {
+    // The head of the free list is stored in the file, which only works if it is updated with a lock-free CAS:
+    // a lock (as libatomic uses for a double width PtrTag without cmpxchg16b) lives in the process, not in the file.
+    if (!std::atomic<PtrTag::encoded_type>{}.is_lock_free())
+      THROW_LALERT("The file [FILEPATH] can not be used as a recoverable or shared pool: the free list head (PtrTag) is not lock-free on this machine.",
+          AIArgs("[FILEPATH]", absolute_file_path));
+    // The header uses the first block; the file must contain at least one more block.
+    if (mapped_size_ < 2 * block_size)
+      THROW_LALERT("The file [FILEPATH] is too small to contain a recoverable pool with blocks of [BLOCKSIZE] bytes.",
+          AIArgs("[FILEPATH]", absolute_file_path)("[BLOCKSIZE]", block_size));
+    if (file_exists && !zero_init &&
+        ::pread(fd, &previous_info, sizeof(previous_info), 0) == static_cast<ssize_t>(sizeof(previous_info)))
+    {
+      // A header with a zero magic number was never (completely) initialized.
+      has_header = previous_info.magic != 0;
+      if (has_header)
+        validate_header(previous_info, absolute_file_path);
+    }
+  }
+
+  // An existing file determines itself whether or not it uses offset links.
+  if (has_header)
+  {
+    offset_links = (previous_info.flags & FileHeaderInfo::offset_links_flag);
+    if (mode == Mode::shared && !offset_links)
+      THROW_LALERT("The file [FILEPATH] can not be used in shared mode, because it was created without offset links.",
+          AIArgs("[FILEPATH]", absolute_file_path));
+    // Blocks beyond the high water mark are not in use (the file can be larger if a process died while growing it).
+    mapped_size_ = previous_info.high_water_mark;
+    // In shared mode every process must map the same range of the file (see grow_shared).
+    if (mode == Mode::shared)
+    {
+      if (max_size_ == 0)
+        max_size_ = previous_info.max_size;
+      else if (max_size_ != previous_info.max_size)
+        THROW_LALERT("The shared pool [FILEPATH] has a maximum size of [MAXSIZE] bytes, not [SIZE].",
+            AIArgs("[FILEPATH]", absolute_file_path)("[MAXSIZE]", previous_info.max_size)("[SIZE]", max_size_));
+    }
+  }
+
+  // Try to map a recoverable pool with absolute links at the same address as the previous time, so that the free list can be used as-is.
+  void* const hint = has_header && !offset_links ? reinterpret_cast<void*>(previous_info.base_address) : nullptr;
+
+  void* addr = nullptr;
+  if (max_size_ == 0)
+    max_size_ = mapped_size_;
+  else if (mode == Mode::shared)
+  {
+    // The maximum size must be a multiple of memory_page_size, and not less than the size of the file.
+    ASSERT(max_size_ % memory_page_size() == 0 && max_size_ >= mapped_size_);
+    // In shared mode we simply map max_size_ bytes of the file. The part beyond the end of the
+    // file becomes accessible, in all processes, when one of them extends the file (see grow()).
+  }
+  else
+  {
+    // The maximum size must be a multiple of memory_page_size, and not less than the size of the file.
+    ASSERT(max_size_ % memory_page_size() == 0 && max_size_ >= mapped_size_);
+
+    // Reserve max_size_ bytes of virtual address space, so that the mapping can grow without moving.
+    int reserve_flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE;
+    if (hint)
+    {
+      addr = ::mmap(hint, max_size_, PROT_NONE, reserve_flags | MAP_FIXED_NOREPLACE, -1, 0);
+      Dout(dc::system, "::mmap(" << hint << ", " << max_size_ << ", PROT_NONE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE|MAP_FIXED_NOREPLACE, -1, 0) = " << addr);
+    }
+    if (!hint || addr == MAP_FAILED)
+    {
+      addr = ::mmap(nullptr, max_size_, PROT_NONE, reserve_flags, -1, 0);
+      Dout(dc::system, "::mmap(nullptr, " << max_size_ << ", PROT_NONE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0) = " << addr);
+    }
+    if (addr == MAP_FAILED)
+      THROW_LALERTE("Failed to reserve [SIZE] bytes of virtual address space", AIArgs("[SIZE]", max_size_));
+    mapped_base_ = addr;
+    flags |= MAP_FIXED;
+  }
+
   // Map the file into the process's virtual address space.
-  Dout(dc::system|continued_cf, "::mmap(nullptr, " << mapped_size_ << ", " << print_prot(prot) << ", " <<
-      print_flags(flags) << ", " << fd << ", 0) = ");
-  mapped_base_ = ::mmap(nullptr, mapped_size_, prot, flags, fd, 0);
-  Dout(dc::finish, mapped_base_);
+  size_t const mapped_size = mode == Mode::shared ? max_size_ : mapped_size_.load();
+  void* mapped_base = MAP_FAILED;
+  if (hint && !addr)
+  {
+    Dout(dc::system|continued_cf, "::mmap(" << hint << ", " << mapped_size << ", " << print_prot(prot) << ", " <<
+        print_flags(flags | MAP_FIXED_NOREPLACE) << ", " << fd << ", 0) = ");
+    mapped_base = ::mmap(hint, mapped_size, prot, flags | MAP_FIXED_NOREPLACE, fd, 0);
+    Dout(dc::finish, mapped_base);
+  }
+  if (mapped_base == MAP_FAILED)
+  {
+    Dout(dc::system|continued_cf, "::mmap(" << addr << ", " << mapped_size << ", " << print_prot(prot) << ", " <<
+        print_flags(flags) << ", " << fd << ", 0) = ");
+    mapped_base = ::mmap(addr, mapped_size, prot, flags, fd, 0);
+    Dout(dc::finish, mapped_base);
+  }
 
   // Check for errors.
-  if (mapped_base_ == MAP_FAILED)
+  if (mapped_base == MAP_FAILED)
+  {
+    // The destructor won't be called; release the reserved address space, if any.
+    if (addr)
+      ::munmap(addr, max_size_);
     THROW_LALERTE("Failed to map file [FILEPATH] of size [SIZE]",
-        AIArgs("[FILEPATH]", absolute_file_path)("[SIZE]", mapped_size_));
+        AIArgs("[FILEPATH]", absolute_file_path)("[SIZE]", mapped_size));
+  }
+  mapped_base_ = mapped_base;
+  mss_.set_stats(&stats_);
+  stats_.set_resident(mapped_size_);
 
-  // Set head_tag_ to point to the start of mapped memory.
-  mss_.initialize(mapped_base_);
+  // Keep the file open if we have to extend it later, or to hold the lock on it in shared mode.
+  if ((persistent && max_size_ > mapped_size_) || mode == Mode::shared)
+    std::swap(fd_, fd);
+
+  if (!recoverable)
+  {
+    // Set head_tag_ to point to the start of mapped memory.
+    mss_.initialize(mapped_base_);
+    return;
+  }
+
+  header_ = static_cast<FileHeader*>(mapped_base_);
+  if (offset_links)
+    mss_.use_offset_links(mapped_base_);
+  bool const holds_exclusive_lock = mode == Mode::shared && open_shared(has_header, absolute_file_path);
+  if (has_header && !offset_links && mapped_base_ != hint)
+  {
+    // We could not map the file at the same address as before; translate all pointers in the free list.
+    relocate(previous_info.base_address);
+  }
+  // From now on the head of the free list is stored in the file.
+  mss_.use_head_tag(&header_->head_tag);
+  if (!has_header)
+  {
+    // Initialize a new header. The first block is used for the header, the rest is free.
+    header_->info.version = FileHeaderInfo::current_version;
+    header_->info.ptr_tag_encoding = FileHeaderInfo::current_ptr_tag_encoding;
+    header_->info.flags = offset_links ? FileHeaderInfo::offset_links_flag : 0;
+    header_->info.block_size = block_size_;
+    header_->info.high_water_mark = mapped_size_;
+    header_->info.max_size = max_size_;
+    header_->head_tag.store(PtrTag::end_of_list, std::memory_order_relaxed);
+    mss_.initialize(static_cast<char*>(mapped_base_) + block_size_);
+  }
+  // In shared mode every process has its own base address, so there is no point in storing it.
+  if (mode != Mode::shared)
+  {
+    header_->info.base_address = reinterpret_cast<uintptr_t>(mapped_base_);
+    header_->info.max_size = max_size_;
+  }
+  if (!has_header)
+  {
+    // Write the magic number last, so that a partially initialized header is never mistaken for a valid one.
+    std::atomic_thread_fence(std::memory_order_release);
+    header_->info.magic = FileHeaderInfo::magic_value;
+  }
+  if (holds_exclusive_lock)
+  {
+    // Now that the header and the mutex are initialized, let other processes in (see open_shared).
+    // This conversion is not atomic, but a process that gets the exclusive lock in between only
+    // finds an initialized header and an unlocked mutex.
+    if (::flock(fd_, LOCK_SH) == -1)
+      THROW_LALERTE("flock([FILEPATH], LOCK_SH)", AIArgs("[FILEPATH]", absolute_file_path));
+  }
+}
+
+bool MemoryMappedPool::open_shared(bool has_header, std::filesystem::path const& absolute_file_path)
+{
+  // Every process that uses the pool holds a shared lock on the file. If we can get an exclusive lock
+  // then no other process is using the pool: the state of the mutex in the file is then meaningless
+  // (the previous user might have died, or the machine crashed, while it was locked).
+  bool const sole_user = ::flock(fd_, LOCK_EX | LOCK_NB) == 0;
+  if (!sole_user)
+  {
+    if (!has_header)
+      THROW_LALERT("The shared pool [FILEPATH] is being created by another process.", AIArgs("[FILEPATH]", absolute_file_path));
+    // Wait until the process that holds the exclusive lock (if any) has initialized the shared state.
+    if (::flock(fd_, LOCK_SH) == -1)
+      THROW_LALERTE("flock([FILEPATH], LOCK_SH)", AIArgs("[FILEPATH]", absolute_file_path));
+  }
+  else
+  {
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(&header_->grow_mutex, &attr);
+    pthread_mutexattr_destroy(&attr);
+    if (has_header)
+      recover_grow_state();
+    else
+      header_->growing = 0;
+  }
+  if (has_header)
+    mapped_size_ = high_water_mark().load(std::memory_order_acquire);
+  // The caller downgrades the exclusive lock after initializing the header.
+  return sole_user;
+}
+
+size_t MemoryMappedPool::update_mapped_size()
+{
+  size_t mapped_size = mapped_size_.load(std::memory_order_acquire);
+  if (mode_ != Mode::shared)
+    return mapped_size;
+  size_t const high_water_mark = this->high_water_mark().load(std::memory_order_acquire);
+  // The whole range up to max_size_ is mapped; mapped_size_ only ever grows.
+  while (mapped_size < high_water_mark)
+    if (mapped_size_.compare_exchange_weak(mapped_size, high_water_mark, std::memory_order_release, std::memory_order_acquire))
+    {
+      stats_.set_resident(high_water_mark);
+      return high_water_mark;
+    }
+  return mapped_size;
+}
+
+void MemoryMappedPool::recover_grow_state()
+{
+  // A previous process died while adding the region [high_water_mark, growing) to the free list.
+  // It is unknown whether or not the region was linked into the free list, so it is (at worst) leaked.
+  uint64_t const growing = header_->growing;
+  if (growing != 0)
+  {
+    Dout(dc::warning, "MemoryMappedPool: recovering from a process that died while growing the pool [" << this << "].");
+    if (growing > high_water_mark().load(std::memory_order_relaxed))
+      high_water_mark().store(growing, std::memory_order_release);
+    header_->growing = 0;
+  }
+}
+
+void MemoryMappedPool::validate_header(FileHeaderInfo const& info, std::filesystem::path const& absolute_file_path)
+{
+  std::string error;
+  if (info.magic != FileHeaderInfo::magic_value)
+    error = "The file [FILEPATH] is not a memory pool (bad magic number).";
+  else if (info.version != FileHeaderInfo::current_version)
+    error = "The file [FILEPATH] has an unsupported format version.";
+  else if (info.ptr_tag_encoding != FileHeaderInfo::current_ptr_tag_encoding)
+    error = "The file [FILEPATH] was created with a different MEMORY_PTR_TAG configuration.";
+  else if (info.block_size != block_size_)
+    error = "The file [FILEPATH] was created with a different block size.";
+  else if (info.high_water_mark > mapped_size_ || (info.max_size != 0 && info.high_water_mark > info.max_size) ||
+      info.base_address % memory_page_size() != 0)
+    error = "The header of file [FILEPATH] is corrupt.";
+  if (!error.empty())
+    THROW_LALERT(error, AIArgs("[FILEPATH]", absolute_file_path));
+}
+
+void MemoryMappedPool::relocate(uintptr_t previous_base)
+{
+  DoutEntering(dc::notice, "MemoryMappedPool::relocate(" << std::hex << previous_base << std::dec << ") [" << this << "]");
+  ptrdiff_t const delta = reinterpret_cast<intptr_t>(mapped_base_) - static_cast<intptr_t>(previous_base);
+  auto translate = [delta](PtrTag::FreeNode* node){
+    return reinterpret_cast<PtrTag::FreeNode*>(reinterpret_cast<char*>(node) + delta);
+  };
+
+  PtrTag head_tag(header_->head_tag.load(std::memory_order_relaxed));
+  if (head_tag.is_end_of_list())
+    return;
+  PtrTag::FreeNode* node = translate(head_tag.ptr());
+  header_->head_tag.store(PtrTag::encode(node, head_tag.tag()), std::memory_order_relaxed);
+
+  // There is at most one run of never used blocks (with a NULL next_ pointer), and it always ends with
+  // the last block below the high water mark (see grow()). Only that last block can have an explicit next_.
+  PtrTag::FreeNode* const last_node =
+    reinterpret_cast<PtrTag::FreeNode*>(static_cast<char*>(mapped_base_) + header_->info.high_water_mark - block_size_);
+  for (;;)
+  {
+    PtrTag::FreeNode* next_node = node->link();
+    if (next_node == nullptr)
+    {
+      if (node == last_node)
+        break;
+      // Skip the run of never used blocks.
+      node = last_node;
+      continue;
+    }
+    if (next_node == MappedSegregatedStorage::end_of_list_node())
+      break;
+    next_node = translate(next_node);
+    node->set_link(next_node);
+    node = next_node;
+  }
+}
+
+void MemoryMappedPool::sync(bool async)
+{
+  size_t const mapped_size = update_mapped_size();
+  if (::msync(mapped_base_, mapped_size, async ? MS_ASYNC : MS_SYNC) == -1)
+    THROW_LALERTE("msync([BASE], [SIZE], [FLAGS])", AIArgs("[BASE]", mapped_base_)
+        ("[SIZE]", mapped_size)("[FLAGS]", async ? "MS_ASYNC" : "MS_SYNC"));
+}
+
+void MemoryMappedPool::set_sync_interval(std::chrono::milliseconds interval, bool async)
+{
+  // Stop the current thread, if any (this blocks until it is joined).
+  sync_thread_ = std::jthread{};
+  if (interval == std::chrono::milliseconds::zero())
+    return;
+  // Periodic write back only makes sense if the mapping is backed by the file.
+  ASSERT(mode_ == Mode::persistent || mode_ == Mode::shared);
+  sync_thread_ = std::jthread([this, interval, async](std::stop_token stop_token){
+    std::mutex sync_mutex;
+    std::unique_lock<std::mutex> lock(sync_mutex);
+    // Wait for `interval` or until a stop is requested.
+    while (!background_cv_.wait_for(lock, stop_token, interval, [](){ return false; }) && !stop_token.stop_requested())
+    {
+      if (::msync(mapped_base_, update_mapped_size(), async ? MS_ASYNC : MS_SYNC) == -1)
+        Dout(dc::warning|error_cf, "msync(" << mapped_base_ << ", ...)");
+    }
+  });
+}
+
+void MemoryMappedPool::advise(Advice advice)
+{
+  int const madvise_advice =
+    advice == Advice::random ? MADV_RANDOM :
+    advice == Advice::sequential ? MADV_SEQUENTIAL :
+    advice == Advice::will_need ? MADV_WILLNEED : MADV_NORMAL;
+  size_t const mapped_size = update_mapped_size();
+  if (::madvise(mapped_base_, mapped_size, madvise_advice) == -1)
+    THROW_LALERTE("madvise([BASE], [SIZE], [ADVICE])", AIArgs("[BASE]", mapped_base_)
+        ("[SIZE]", mapped_size)("[ADVICE]", madvise_advice));
+}
+
+void MemoryMappedPool::populate(size_t begin, size_t end)
+{
+  char* const start = static_cast<char*>(mapped_base_) + begin * block_size_;
+  size_t const length = (end - begin) * block_size_;
+#ifdef MADV_POPULATE_WRITE
+  if (::madvise(start, length, mode_ == Mode::read_only ? MADV_POPULATE_READ : MADV_POPULATE_WRITE) == 0)
+    return;
+#endif
+  // Not supported by this kernel: touch every page.
+  size_t const page_size = memory_page_size();
+  for (size_t offset = 0; offset < length; offset += page_size)
+  {
+    if (mode_ == Mode::read_only)
+      [[maybe_unused]] volatile char c = start[offset];
+    else
+      // An atomic no-op that is a write access, but does not change concurrently written data.
+      std::atomic_ref<char>(start[offset]).fetch_add(0, std::memory_order_relaxed);
+  }
+}
+
+void MemoryMappedPool::populate(size_t number_of_blocks)
+{
+  DoutEntering(dc::notice, "MemoryMappedPool::populate(" << number_of_blocks << ") [" << this << "]");
+  populate(0, std::min(number_of_blocks, update_mapped_size() / block_size_));
+}
+
+void MemoryMappedPool::populate_in_background(size_t number_of_blocks, size_t step)
+{
+  // Stop the current thread, if any (this blocks until it is joined).
+  populate_thread_ = std::jthread{};
+  // step must be at least one block.
+  ASSERT(step > 0);
+  populate_thread_ = std::jthread([this, number_of_blocks, step](std::stop_token stop_token){
+    size_t const end = std::min(number_of_blocks, update_mapped_size() / block_size_);
+    for (size_t begin = 0; begin < end && !stop_token.stop_requested(); begin += step)
+      populate(begin, std::min(begin + step, end));
+  });
 }
 
 MemoryMappedPool::~MemoryMappedPool()
 {
   DoutEntering(dc::notice, "MemoryMappedPool::~MemoryMappedPool() [" << this << "]");
+  // Stop the background threads before unmapping.
+  sync_thread_ = std::jthread{};
+  populate_thread_ = std::jthread{};
+  // This also unmaps the part of the reserved address space that was never used.
   if (mapped_base_ != MAP_FAILED)
-    ::munmap(mapped_base_, mapped_size_);
+    ::munmap(mapped_base_, max_size_);
+  if (fd_ != -1)
+    ::close(fd_);
+}
+
+bool MemoryMappedPool::grow(size_t mapped_size)
+{
+  DoutEntering(dc::notice, "MemoryMappedPool::grow(" << mapped_size << ") [" << this << "]");
+
+  if (mode_ == Mode::shared)
+    return grow_shared(mapped_size);
+
+  std::unique_lock<std::mutex> lock = stats_.lock(grow_mutex_);
+
+  // If another thread already grew the mapping then just try again.
+  if (mapped_size_.load(std::memory_order_relaxed) != mapped_size)
+    return true;
+
+  // Double the size of the mapping (but add at least one block), in whole blocks, but never beyond max_size_.
+  size_t extra_size = std::min(std::max(mapped_size, block_size_), max_size_ - mapped_size) / block_size_ * block_size_;
+  if (extra_size == 0)
+    return false;
+
+  char* const region = static_cast<char*>(mapped_base_) + mapped_size;
+  void* addr;
+  if (mode_ != Mode::copy_on_write)
+  {
+    // Extend the file; the new part of the file reads as zeroes.
+    if (::fallocate(fd_, 0, mapped_size, extra_size) == -1)
+    {
+      Dout(dc::warning|error_cf, "fallocate(" << fd_ << ", 0, " << mapped_size << ", " << extra_size << ")");
+      return false;
+    }
+    addr = ::mmap(region, extra_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_FIXED, fd_, mapped_size);
+  }
+  else
+  {
+    // Copy-on-write: there is nothing to write back, so use anonymous (zeroed) memory.
+    addr = ::mmap(region, extra_size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_FIXED, -1, 0);
+  }
+  if (addr == MAP_FAILED)
+  {
+    Dout(dc::warning|error_cf, "mmap(" << (void*)region << ", " << extra_size << ", ...)");
+    return false;
+  }
+  mapped_size_.store(mapped_size + extra_size, std::memory_order_release);
+  stats_.set_resident(mapped_size + extra_size);
+  stats_.add(PoolStats::refills);
+
+  // Update the high water mark before linking the new blocks (see relocate()).
+  if (header_)
+    header_->info.high_water_mark = mapped_size + extra_size;
+
+  // All blocks of the new region are zeroed, so their next_ pointer means "the next block in the file".
+  // Only the last block of the region must point to the rest of the free list.
+  mss_.deallocate_chain(reinterpret_cast<PtrTag::FreeNode*>(region),
+      reinterpret_cast<PtrTag::FreeNode*>(region + extra_size - block_size_));
+
+  Dout(dc::notice, "Grew the mapping with " << extra_size << " bytes to " << (mapped_size + extra_size) << " bytes.");
+  return true;
+}
+
+bool MemoryMappedPool::grow_shared(size_t mapped_size)
+{
+  int error = pthread_mutex_lock(&header_->grow_mutex);
+  if (AI_UNLIKELY(error == EOWNERDEAD))
+  {
+    // The previous owner of the mutex died while holding it.
+    recover_grow_state();
+    pthread_mutex_consistent(&header_->grow_mutex);
+  }
+  else if (AI_UNLIKELY(error != 0))
+  {
+    Dout(dc::warning, "pthread_mutex_lock returned " << error);
+    return false;
+  }
+  auto&& unlock = at_scope_end([this]{ pthread_mutex_unlock(&header_->grow_mutex); });
+
+  // If another thread, or process, already grew the pool then just try again.
+  size_t const high_water_mark = this->high_water_mark().load(std::memory_order_acquire);
+  if (high_water_mark != mapped_size)
+  {
+    mapped_size_.store(high_water_mark, std::memory_order_release);
+    stats_.set_resident(high_water_mark);
+    return true;
+  }
+
+  // Double the size of the pool (but add at least one block), in whole blocks, but never beyond max_size_.
+  size_t extra_size = std::min(std::max(mapped_size, block_size_), max_size_ - mapped_size) / block_size_ * block_size_;
+  if (extra_size == 0)
+    return false;
+
+  // Extend the file; this makes the new part of the mapping accessible in all processes (and it reads as zeroes).
+  if (::fallocate(fd_, 0, mapped_size, extra_size) == -1)
+  {
+    Dout(dc::warning|error_cf, "fallocate(" << fd_ << ", 0, " << mapped_size << ", " << extra_size << ")");
+    return false;
+  }
+
+  // If we die after this point, the region might be leaked (see recover_grow_state()).
+  header_->growing = mapped_size + extra_size;
+  char* const region = static_cast<char*>(mapped_base_) + mapped_size;
+  mss_.deallocate_chain(reinterpret_cast<PtrTag::FreeNode*>(region),
+      reinterpret_cast<PtrTag::FreeNode*>(region + extra_size - block_size_));
+  this->high_water_mark().store(mapped_size + extra_size, std::memory_order_release);
+  header_->growing = 0;
+  mapped_size_.store(mapped_size + extra_size, std::memory_order_release);
+  stats_.set_resident(mapped_size + extra_size);
+  stats_.add(PoolStats::refills);
+
+  Dout(dc::notice, "Grew the shared pool with " << extra_size << " bytes to " << (mapped_size + extra_size) << " bytes.");
+  return true;
 }
 
 } // namespace memory
@@ -29,34 +29,234 @@
 
 #include "MemoryPagePool.h"
 #include "MappedSegregatedStorage.h"
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
 #include <filesystem>
+#include <limits>
+#include <mutex>
+#include <pthread.h>
+#include <thread>
 
 namespace memory {
 
+// A memory pool that returns fixed-size blocks from a memory mapped file.
+//
+// If max_size is larger than the size of the file then the pool is growable:
+// max_size bytes of virtual address space are reserved up front and, when all
+// blocks are in use, the file is extended with fallocate and more of the
+// reserved range is mapped (MAP_FIXED). Hence mapped_base() never changes.
+// The mapping is doubled every time, up to max_size. In copy_on_write mode
+// the added part is anonymous memory (there is no need to extend the file).
+//
+// If recoverable is true then the first block of the file is used for a header
+// (FileHeader) that contains a magic number, a format version, the high water mark
+// and the head of the free list itself. Every change to the free list is a single
+// CAS on that head (after writing the next_ pointer of the block), so when a process
+// dies the file always contains a consistent free list (blocks that were allocated
+// by the process that died are, of course, never freed). Reopening the file continues
+// with that free list in O(1): the file is mapped at the same address as before
+// (MAP_FIXED_NOREPLACE) so that the pointers in the free list remain valid. Only if
+// that address is no longer available, the pointers in the free list are relocated,
+// which takes time proportional to the number of free blocks (and should not be
+// interrupted). Call sync() to also survive a power failure. The head of the free list
+// must be lock-free for this, otherwise the constructor throws. With MEMORY_PTR_TAG_DOUBLE_WIDTH
+// that depends on the compiler and the CPU (libatomic of GCC reports a 16 byte atomic as not
+// lock-free, even with -mcx16).
+//
+// If in addition offset_links is true (when the file is created) then the free list
+// uses offsets relative to the start of the mapping instead of pointers, and the file
+// can be mapped at any address (for example by a different process) without
+// relocation. Use OffsetPtr<T> for pointers between objects stored in the pool.
+//
+// Mode::shared implies recoverable and offset_links, and allows several processes to
+// allocate from (and deallocate to) the same pool at the same time; for example to hand
+// over large buffers between processes without copying them. Because all changes to the
+// free list are single CAS operations on the head in the file, a process that dies can
+// not corrupt the free list. Growing the pool (if max_size is given) is serialized with
+// a robust, process shared mutex in the header: if a process dies while holding it then
+// the next process that locks it repairs the header (at worst the region that was being
+// added is leaked). In shared mode each process maps max_size bytes of the file up front,
+// so that a region added by one process is immediately accessible to all of them.
+// Every process holds a shared flock(2) on the file; the first process to open the pool
+// (re)initializes the mutex while holding an exclusive lock. Note that the file must be
+// created (by one process) before other processes open it. The max_size of the pool is
+// stored in the file: pass zero (or the same value) when opening an existing shared pool.
+//
+// The first access to a page of the mapping causes a page fault (a read from disk, if
+// the page is not in the page cache). Call populate() or populate_in_background() to
+// fault in (part of) the pool up front, and advise() to tell the kernel about the
+// expected access pattern. In persistent mode set_sync_interval() can be used to write
+// dirty pages back to the file periodically, instead of all at once by the kernel.
+//
 class MemoryMappedPool : public MemoryPagePoolBase
 {
- protected:
-  void* mapped_base_;           // The virtual address returned by mmap.
-  size_t mapped_size_;          // The total size of the mapped memory.
-  MappedSegregatedStorage mss_;
-
  public:
   enum class Mode
   {
     persistent,
     copy_on_write,
-    read_only
+    read_only,
+    shared              // Like persistent, but the pool can be used by several processes at the same time (see above).
+  };
+
+ protected:
+  void* mapped_base_;                   // The virtual address returned by mmap.
+  std::atomic<size_t> mapped_size_;     // The total size of the mapped memory.
+  size_t max_size_;                     // The size of the reserved virtual address space (equal to mapped_size_ if not growable).
+  int fd_;                              // The file descriptor of the file, only kept open if it might have to be extended.
+  Mode const mode_;
+  std::mutex grow_mutex_;               // Serializes calls to grow().
+  MappedSegregatedStorage mss_;
+
+  struct FileHeaderInfo
+  {
+    static constexpr uint64_t magic_value = 0x4c4f4f5050414d4d;       // "MMAPPOOL" (little endian).
+    static constexpr uint32_t current_version = 3;
+    static constexpr uint32_t offset_links_flag = 1;                  // The links of the free list are offsets (see MappedSegregatedStorage::use_offset_links).
+#if defined(MEMORY_PTR_TAG_DOUBLE_WIDTH)
+    static constexpr uint32_t current_ptr_tag_encoding = 2;
+#elif defined(MEMORY_PTR_TAG_HIGH_BITS)
+    static constexpr uint32_t current_ptr_tag_encoding = 1;
+#else
+    static constexpr uint32_t current_ptr_tag_encoding = 0;
+#endif
+
+    uint64_t magic;                     // Equal to magic_value once the header is initialized.
+    uint32_t version;                   // The format version of the file.
+    uint32_t ptr_tag_encoding;          // The PtrTag representation of head_tag (see MEMORY_PTR_TAG).
+    uint32_t flags;                     // A bit mask of the *_flag values above.
+    uint32_t reserved;                  // Zero.
+    uint64_t block_size;                // The block size of the pool.
+    uint64_t base_address;              // The address to which the file was mapped the last time (absolute links in the free list are only valid for this address).
+    uint64_t high_water_mark;           // The size of the part of the file that is used.
+    uint64_t max_size;                  // The max_size of the pool (in shared mode every process must map this many bytes).
   };
 
+  struct FileHeader
+  {
+    FileHeaderInfo info;
+    std::atomic<PtrTag::encoded_type> head_tag;         // The head of the free list.
+    // Only used in shared mode.
+    uint64_t growing;                                   // The new high water mark while a process is growing the pool, otherwise zero.
+    pthread_mutex_t grow_mutex;                         // A robust, process shared mutex that serializes growing the pool.
+  };
+
+  FileHeader* header_;                  // Points to the start of the mapping if this pool is recoverable, otherwise nullptr.
+
+  // Grow the mapping. The argument is the value of mapped_size_ that was used for the failed allocation.
+  // Returns false if the mapping could not be grown.
+  bool grow(size_t mapped_size);
+  bool grow_shared(size_t mapped_size);
+
+  // The high water mark in the header, which is shared between processes in shared mode.
+  std::atomic_ref<uint64_t> high_water_mark() const { return std::atomic_ref<uint64_t>(header_->info.high_water_mark); }
+
+  // Lock the file and initialize the process shared state, if we are the first process that uses the file.
+  // Returns true if we are; we then hold an exclusive lock on the file until the header is initialized.
+  bool open_shared(bool has_header, std::filesystem::path const& absolute_file_path);
+
+  // Return mapped_size_, after updating it in shared mode (another process might have grown the pool).
+  size_t update_mapped_size();
+
+  // Fix the header after a process died while growing the pool. This must be called while holding grow_mutex.
+  void recover_grow_state();
+
+  // Throw if info is not a valid header for this pool.
+  void validate_header(FileHeaderInfo const& info, std::filesystem::path const& absolute_file_path);
+
+  // Translate the pointers of the free list of the header after mapping the file at a different address.
+  void relocate(uintptr_t previous_base);
+
+ public:
   MemoryMappedPool(std::filesystem::path const& filename, size_t block_size,
-      size_t file_size = 0, Mode mode = Mode::persistent, bool zero_init = false);
+      size_t file_size = 0, Mode mode = Mode::persistent, bool zero_init = false, size_t max_size = 0,
+      bool recoverable = false, bool offset_links = false);
   ~MemoryMappedPool() override;
 
-  void* allocate() override { return mss_.allocate(mapped_base_, mapped_size_, block_size_); }
-  void deallocate(void* ptr) override { mss_.deallocate(ptr); }
+  void* allocate() override
+  {
+    for (;;)
+    {
+      size_t const mapped_size = mapped_size_.load(std::memory_order_acquire);
+      void* ptr = mss_.allocate(mapped_base_, mapped_size, block_size_);
+      if (AI_LIKELY(ptr))
+      {
+        stats_.add(PoolStats::allocations);
+        return ptr;
+      }
+      if (mapped_size == max_size_ || !grow(mapped_size))
+        return nullptr;
+    }
+  }
+
+  void deallocate(void* ptr) override { stats_.add(PoolStats::deallocations); mss_.deallocate(ptr); }
+
+  size_t allocate_n(void** ptrs, size_t n) override
+  {
+    size_t count = 0;
+    for (;;)
+    {
+      size_t const mapped_size = mapped_size_.load(std::memory_order_acquire);
+      count += mss_.allocate_n(mapped_base_, mapped_size, block_size_, ptrs + count, n - count);
+      if (AI_LIKELY(count == n) || mapped_size == max_size_ || !grow(mapped_size))
+      {
+        stats_.add(PoolStats::allocations, count);
+        return count;
+      }
+    }
+  }
+
+  void deallocate_n(void* const* ptrs, size_t n) override { stats_.add(PoolStats::deallocations, n); mss_.deallocate_n(ptrs, n); }
 
-  blocks_t pool_blocks() const { return pool_blocks_; }
+  blocks_t pool_blocks() const { return mapped_size_.load(std::memory_order_relaxed) / block_size_; }
   void* mapped_base() const { return mapped_base_; }
+  size_t mapped_size() const { return mapped_size_.load(std::memory_order_relaxed); }
+  size_t max_size() const { return max_size_; }
+
+  // Return the mapped part of the file. The region only grows in place, at the fixed mapped_base() (see above).
+  std::vector<Region> regions() override { return {{mapped_base_, update_mapped_size()}}; }
+
+  // Write all changes to the file to disk (msync); only useful in persistent mode.
+  // If `async` is true, the write back is only scheduled (MS_ASYNC) and this returns immediately.
+  void sync(bool async = false);
+
+  // Call sync(async) every `interval` from a background thread. An interval of zero stops the background thread.
+  void set_sync_interval(std::chrono::milliseconds interval, bool async = true);
+
+  // Warm-up.
+  //
+  // The first access to every page of a freshly mapped pool causes a page fault. The following functions
+  // can be used to move those page faults to a moment of choice, or to give the kernel a hint about the
+  // expected access pattern.
+
+  enum class Advice
+  {
+    normal,             // MADV_NORMAL.
+    random,             // MADV_RANDOM: disable readahead.
+    sequential,         // MADV_SEQUENTIAL: aggressive readahead, pages can be freed quickly after they were accessed.
+    will_need           // MADV_WILLNEED: start reading the file into the page cache now.
+  };
+
+  // Apply madvise to the (currently) mapped part of the file.
+  void advise(Advice advice);
+
+  // Fault in the first `number_of_blocks` blocks (or all mapped blocks if that is smaller), this has the same effect as
+  // MAP_POPULATE but can also be used for only part of the pool, or after growing it. Uses MADV_POPULATE_WRITE
+  // (MADV_POPULATE_READ for read_only) if supported by the kernel, and otherwise touches every page.
+  void populate(size_t number_of_blocks = std::numeric_limits<size_t>::max());
+
+  // Call populate(number_of_blocks) from a background thread, in steps of `step` blocks.
+  void populate_in_background(size_t number_of_blocks = std::numeric_limits<size_t>::max(), size_t step = 256);
+
+ private:
+  // Populate blocks [begin, end).
+  void populate(size_t begin, size_t end);
+
+  std::condition_variable_any background_cv_;   // Used to wake up the background threads when they must stop.
+  std::jthread sync_thread_;                    // The thread that calls sync() periodically, if any.
+  std::jthread populate_thread_;                // The thread that prefaults blocks, if any.
 };
 
 } // namespace memory
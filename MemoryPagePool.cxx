@@ -27,13 +27,32 @@
 
 #include "sys.h"
 #include "MemoryPagePool.h"
+#include <fstream>
+#include <limits>
+#include <string>
+#include <sys/mman.h>
 
 namespace memory {
 
-MemoryPagePool::MemoryPagePool(size_t block_size, blocks_t minimum_chunk_size, blocks_t maximum_chunk_size) :
+size_t MemoryPagePoolBase::allocate_n(void** ptrs, size_t n)
+{
+  size_t count = 0;
+  while (count < n && (ptrs[count] = allocate()))
+    ++count;
+  return count;
+}
+
+void MemoryPagePoolBase::deallocate_n(void* const* ptrs, size_t n)
+{
+  for (size_t i = 0; i < n; ++i)
+    deallocate(ptrs[i]);
+}
+
+MemoryPagePool::MemoryPagePool(size_t block_size, blocks_t minimum_chunk_size, blocks_t maximum_chunk_size, HugePages huge_pages) :
   MemoryPagePoolBase(block_size),
   minimum_chunk_size_(minimum_chunk_size ? minimum_chunk_size : default_minimum_chunk_size()),
-  maximum_chunk_size_(maximum_chunk_size ? maximum_chunk_size : default_maximum_chunk_size(minimum_chunk_size_))
+  maximum_chunk_size_(maximum_chunk_size ? maximum_chunk_size : default_maximum_chunk_size(minimum_chunk_size_)),
+  huge_pages_(huge_pages), free_blocks_(0), low_water_mark_(0), refill_requested_(false)
 {
   // minimum_chunk_size must be larger or equal than 1.
   ASSERT(minimum_chunk_size_ >= 1);
@@ -41,22 +60,327 @@ MemoryPagePool::MemoryPagePool(size_t block_size, blocks_t minimum_chunk_size, b
   ASSERT(maximum_chunk_size_ >= minimum_chunk_size_);
 
   DoutEntering(dc::notice, "MemoryPagePool::MemoryPagePool(" <<
-      block_size << ", " << minimum_chunk_size << ", " << maximum_chunk_size << ") [" << this << "]");
+      block_size << ", " << minimum_chunk_size << ", " << maximum_chunk_size << ", " << static_cast<int>(huge_pages) << ") [" << this << "]");
 
   // This capacity is enough for allocating twice the maximum_chunk_size of memory (and then rounded up to the nearest power of two).
   chunks_.reserve(utils::nearest_power_of_two(1 + utils::log2(maximum_chunk_size_)));
   Dout(dc::notice, "The block size (" << block_size << " bytes) is " << (block_size / memory_page_size()) << " times the memory page size on this machine.");
   Dout(dc::notice, "The capacity of chunks_ is " << chunks_.capacity() << '.');
+  sss_.set_stats(&stats_);
+}
+
+std::vector<MemoryPagePoolBase::Region> MemoryPagePool::regions()
+{
+  std::scoped_lock<std::mutex> lock(sss_.add_block_mutex_);
+  std::vector<Region> result;
+  for (Chunk const& chunk : chunks_)
+    if (!chunk.decommitted)
+      result.push_back({chunk.ptr, chunk.blocks * block_size_});
+  return result;
 }
 
 void MemoryPagePool::release()
 {
   DoutEntering(dc::notice, "MemoryPagePool::release()");
   std::scoped_lock<std::mutex> lock(sss_.add_block_mutex_);
+  sss_.discard_bump_region();
   // Wink out any remaining allocations.
-  for (auto ptr : chunks_)
-    std::free(ptr);
+  for (Chunk const& chunk : chunks_)
+  {
+    if (chunk.guarded)
+      ::munmap(chunk.ptr, chunk.blocks * block_size_ + memory_page_size());
+    else if (chunk.mmapped)
+    {
+      // The length of a MAP_HUGETLB mapping was a multiple of the hugetlb page size.
+      size_t const hps = hugetlb_page_size();
+      ::munmap(chunk.ptr, (chunk.blocks * block_size_ + hps - 1) & ~(hps - 1));
+    }
+    else
+    {
+      hardening::unpoison(chunk.ptr, chunk.blocks * block_size_);
+      std::free(chunk.ptr);
+    }
+  }
   Dout(dc::notice, "current size is " << (pool_blocks_ * block_size_) << " bytes.");
+  chunks_.clear();
+  pool_blocks_ = 0;
+  free_blocks_.store(0, std::memory_order_relaxed);
+  stats_.set_resident(0);
+}
+
+bool MemoryPagePool::add_new_chunk(blocks_t min_blocks)
+{
+  // Reuse a decommitted chunk, if any (the kernel provides zeroed pages again upon first touch).
+  for (Chunk& chunk : chunks_)
+    if (chunk.decommitted && chunk.blocks >= min_blocks)
+    {
+      size_t const size = chunk.blocks * block_size_;
+      chunk.decommitted = false;
+      chunk.was_free = false;
+      free_blocks_.fetch_add(chunk.blocks, std::memory_order_relaxed);
+      sss_.add_block(chunk.ptr, size, block_size_);
+      pool_blocks_ += chunk.blocks;
+      stats_.add_resident(size);
+      return true;
+    }
+  blocks_t extra_blocks = std::max(std::clamp(pool_blocks_, minimum_chunk_size_, maximum_chunk_size_), min_blocks);
+  Chunk chunk = allocate_chunk(extra_blocks * block_size_);
+  if (AI_UNLIKELY(chunk.ptr == nullptr))
+    return false;
+  free_blocks_.fetch_add(chunk.blocks, std::memory_order_relaxed);
+  sss_.add_block(chunk.ptr, chunk.blocks * block_size_, block_size_);
+  pool_blocks_ += chunk.blocks;
+  stats_.add_resident(chunk.blocks * block_size_);
+  chunks_.push_back(chunk);
+  return true;
+}
+
+//static
+size_t MemoryPagePool::huge_page_size()
+{
+  static size_t const huge_page_size_ = [](){
+    size_t size = 0;
+    std::ifstream hpage_pmd_size("/sys/kernel/mm/transparent_hugepage/hpage_pmd_size");
+    if (!(hpage_pmd_size >> size) || size == 0 || (size & (size - 1)) != 0)
+      size = 0x200000;          // Use 2 MiB if the kernel doesn't tell us.
+    return size;
+  }();
+  return huge_page_size_;
+}
+
+//static
+size_t MemoryPagePool::hugetlb_page_size()
+{
+  static size_t const hugetlb_page_size_ = [](){
+    // MAP_HUGETLB without a MAP_HUGE_* flag uses the default huge page size, which is not necessarily the PMD size.
+    std::ifstream meminfo("/proc/meminfo");
+    std::string key;
+    while (meminfo >> key)
+    {
+      size_t size_kb;
+      if (key == "Hugepagesize:" && meminfo >> size_kb && size_kb > 0 && (size_kb & (size_kb - 1)) == 0)
+        return size_kb * 1024;
+      meminfo.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
+    }
+    return huge_page_size();    // Use the PMD size if the kernel doesn't tell us.
+  }();
+  return hugetlb_page_size_;
+}
+
+MemoryPagePool::Chunk MemoryPagePool::allocate_chunk(size_t size)
+{
+  if (huge_pages_ == HugePages::hugetlb)
+  {
+    // Round the size of the chunk up to a multiple of the hugetlb page size, and then down to a multiple of the block size.
+    size_t const hps = hugetlb_page_size();
+    size_t const huge_size = (size + hps - 1) & ~(hps - 1);
+    void* ptr = ::mmap(nullptr, huge_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (AI_LIKELY(ptr != MAP_FAILED))
+      return {ptr, static_cast<blocks_t>(huge_size / block_size_), true, false, false, false};
+    Dout(dc::warning, "MemoryPagePool: mmap(MAP_HUGETLB) failed: falling back to transparent huge pages [" << this << "].");
+    huge_pages_ = HugePages::transparent;
+  }
+  if (huge_pages_ == HugePages::transparent)
+  {
+    // Round the size of the chunk up to a multiple of the (PMD sized) huge page size, and then down to a multiple of the block size.
+    size_t const hps = huge_page_size();
+    size_t const huge_size = (size + hps - 1) & ~(hps - 1);
+    void* ptr = std::aligned_alloc(hps, huge_size);
+    if (AI_LIKELY(ptr != nullptr))
+    {
+      if (::madvise(ptr, huge_size, MADV_HUGEPAGE) == 0)
+        return {ptr, static_cast<blocks_t>(huge_size / block_size_), false, false, false, false};
+      // Transparent huge pages are not supported by this kernel.
+      std::free(ptr);
+    }
+    Dout(dc::warning, "MemoryPagePool: transparent huge pages are not available: falling back to normal pages [" << this << "].");
+    huge_pages_ = HugePages::none;
+  }
+  blocks_t const blocks = size / block_size_;
+  if constexpr (hardening::guard_pages)
+  {
+    // Map one extra page behind the chunk and make it inaccessible, so that an overrun of the last block faults.
+    size_t const page_size = memory_page_size();
+    void* ptr = ::mmap(nullptr, size + page_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (AI_UNLIKELY(ptr == MAP_FAILED))
+      return {nullptr, 0, false, false, false, false};
+    if (AI_UNLIKELY(::mprotect(static_cast<char*>(ptr) + size, page_size, PROT_NONE) != 0))
+      Dout(dc::warning, "MemoryPagePool: mprotect of the guard page failed [" << this << "].");
+    return {ptr, blocks, true, false, false, true};
+  }
+  return {std::aligned_alloc(memory_page_size(), size), blocks, false, false, false, false};
+}
+
+MemoryPagePool::blocks_t MemoryPagePool::trim_chunks(bool only_if_was_free, TrimAdvice advice)
+{
+  // The regions are in use by something that doesn't expect the pages to be replaced (see pin_regions()).
+  // Because regions() takes add_block_mutex_ too, a pin_regions() followed by regions() never misses a decommit.
+  if (pinned_.load(std::memory_order_relaxed) > 0)
+    return 0;
+
+  // Take the whole free list. Concurrent calls to allocate() will find the free list empty and
+  // block on add_block_mutex_ until we put the remaining blocks back.
+  PtrTag::FreeNode* const free_list = sss_.detach_all();
+
+  // The index into chunks_ of each committed chunk, sorted by address.
+  std::vector<size_t> sorted;
+  sorted.reserve(chunks_.size());
+  for (size_t i = 0; i < chunks_.size(); ++i)
+    if (!chunks_[i].decommitted)
+      sorted.push_back(i);
+  std::sort(sorted.begin(), sorted.end(), [this](size_t i1, size_t i2){ return chunks_[i1].ptr < chunks_[i2].ptr; });
+  auto chunk_of = [&](PtrTag::FreeNode* node) -> size_t {
+    // Find the last chunk that starts at or before node.
+    auto iter = std::upper_bound(sorted.begin(), sorted.end(), static_cast<void*>(node),
+        [this](void* ptr, size_t i){ return ptr < chunks_[i].ptr; });
+    // Every block on the free list must be part of one of our chunks.
+    ASSERT(iter != sorted.begin());
+    return *--iter;
+  };
+
+  // Count the number of free blocks of each chunk.
+  std::vector<blocks_t> free_blocks(chunks_.size(), 0);
+  for (PtrTag::FreeNode* node = free_list; node; node = node->next())
+    ++free_blocks[chunk_of(node)];
+  // The blocks of the bump region of sss_ are free too.
+  char* const bump_begin = sss_.bump_begin();
+  size_t const bump_chunk = bump_begin != sss_.bump_end() ? chunk_of(reinterpret_cast<PtrTag::FreeNode*>(bump_begin)) : chunks_.size();
+  if (bump_chunk < chunks_.size())
+    free_blocks[bump_chunk] += (sss_.bump_end() - bump_begin) / block_size_;
+
+  // Select the chunks that are completely free, as long as at least low_water_mark_ blocks remain free.
+  blocks_t const low_water_mark = low_water_mark_.load(std::memory_order_relaxed);
+  blocks_t remaining_free_blocks = this->free_blocks();
+  std::vector<bool> decommit(chunks_.size(), false);
+  for (size_t i : sorted)
+  {
+    Chunk& chunk = chunks_[i];
+    bool const is_free = free_blocks[i] == chunk.blocks;
+    decommit[i] = is_free && (!only_if_was_free || chunk.was_free) && remaining_free_blocks >= low_water_mark + chunk.blocks;
+    if (decommit[i])
+      remaining_free_blocks -= chunk.blocks;
+    chunk.was_free = is_free && !decommit[i];
+  }
+
+  // Put all blocks of the other chunks back on the free list. This must be done before
+  // calling madvise, which clears the next_ pointers of the blocks of the decommitted chunks.
+  PtrTag::FreeNode* first = nullptr;
+  PtrTag::FreeNode* last = nullptr;
+  PtrTag::FreeNode* next_node;
+  for (PtrTag::FreeNode* node = free_list; node; node = next_node)
+  {
+    next_node = node->next();
+    if (decommit[chunk_of(node)])
+      continue;
+    if (last)
+      last->set_next(node);
+    else
+      first = node;
+    last = node;
+  }
+  if (first)
+  {
+    last->set_next(nullptr);
+    sss_.deallocate_chain(first, last);
+  }
+
+  // The bump region is part of one chunk; forget about it if that chunk is going to be decommitted.
+  if (bump_chunk < chunks_.size() && decommit[bump_chunk])
+    sss_.discard_bump_region();
+
+  // Decommit the selected chunks.
+  blocks_t decommitted_blocks = 0;
+  int const madvise_advice = advice == TrimAdvice::free ? MADV_FREE : MADV_DONTNEED;
+  for (size_t i : sorted)
+  {
+    if (!decommit[i])
+      continue;
+    Chunk& chunk = chunks_[i];
+    size_t const size = chunk.blocks * block_size_;
+    if (AI_UNLIKELY(::madvise(chunk.ptr, size, madvise_advice) != 0))
+    {
+      // Keep the chunk; all of its blocks are free.
+      sss_.add_block(chunk.ptr, size, block_size_);
+      continue;
+    }
+    chunk.decommitted = true;
+    pool_blocks_ -= chunk.blocks;
+    free_blocks_.fetch_sub(chunk.blocks, std::memory_order_relaxed);
+    stats_.add_resident(-static_cast<int64_t>(size));
+    decommitted_blocks += chunk.blocks;
+  }
+
+  Dout(dc::notice(decommitted_blocks > 0), "MemoryPagePool: decommitted " << decommitted_blocks << " blocks [" << this << "].");
+  return decommitted_blocks;
+}
+
+MemoryPagePool::blocks_t MemoryPagePool::trim(TrimAdvice advice)
+{
+  DoutEntering(dc::notice, "MemoryPagePool::trim() [" << this << "]");
+  std::scoped_lock<std::mutex> lock(sss_.add_block_mutex_);
+  return trim_chunks(false, advice);
+}
+
+MemoryPagePool::blocks_t MemoryPagePool::decay(TrimAdvice advice)
+{
+  std::scoped_lock<std::mutex> lock(sss_.add_block_mutex_);
+  return trim_chunks(true, advice);
+}
+
+bool MemoryPagePool::reserve_locked(blocks_t n_blocks)
+{
+  // Add one chunk with all missing blocks: adding several chunks would put the whole bump region
+  // of every chunk but the last on the free list (see SimpleSegregatedStorage::add_block), touching all their blocks.
+  blocks_t const free_blocks = this->free_blocks();
+  return free_blocks >= n_blocks || add_new_chunk(n_blocks - free_blocks);
+}
+
+bool MemoryPagePool::reserve(blocks_t n_blocks)
+{
+  DoutEntering(dc::notice, "MemoryPagePool::reserve(" << n_blocks << ") [" << this << "]");
+  std::scoped_lock<std::mutex> lock(sss_.add_block_mutex_);
+  return reserve_locked(n_blocks);
+}
+
+void MemoryPagePool::set_low_water_mark(blocks_t low_water_mark, std::chrono::milliseconds interval)
+{
+  // Stop the current thread, if any (this blocks until it is joined).
+  refill_thread_ = std::jthread{};
+  low_water_mark_.store(low_water_mark, std::memory_order_relaxed);
+  if (low_water_mark == 0)
+    return;
+  refill_thread_ = std::jthread([this, interval](std::stop_token stop_token){
+    std::mutex refill_mutex;
+    std::unique_lock<std::mutex> lock(refill_mutex);
+    for (;;)
+    {
+      refill_requested_.store(false, std::memory_order_relaxed);
+      {
+        std::scoped_lock<std::mutex> add_block_lock(sss_.add_block_mutex_);
+        if (AI_UNLIKELY(!reserve_locked(low_water_mark_.load(std::memory_order_relaxed))))
+          Dout(dc::warning, "MemoryPagePool: out of memory while refilling [" << this << "].");
+      }
+      // Wait for `interval`, until an allocation had to add a chunk itself, or until a stop is requested.
+      refill_cv_.wait_for(lock, stop_token, interval, [this](){ return refill_requested_.load(std::memory_order_relaxed); });
+      if (stop_token.stop_requested())
+        break;
+    }
+  });
+}
+
+void MemoryPagePool::set_decay_interval(std::chrono::milliseconds interval, TrimAdvice advice)
+{
+  // Stop the current thread, if any (this blocks until it is joined).
+  decay_thread_ = std::jthread{};
+  if (interval == std::chrono::milliseconds::zero())
+    return;
+  decay_thread_ = std::jthread([this, interval, advice](std::stop_token stop_token){
+    std::mutex decay_mutex;
+    std::unique_lock<std::mutex> lock(decay_mutex);
+    // Wait for `interval` or until a stop is requested.
+    while (!decay_cv_.wait_for(lock, stop_token, interval, [](){ return false; }) && !stop_token.stop_requested())
+      decay(advice);
+  });
 }
 
 } // namespace memory
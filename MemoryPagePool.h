@@ -31,8 +31,15 @@
 #include "utils/log2.h"                         // utils::log2
 #include "utils/nearest_power_of_two.h"         // utils::nearest_power_of_two
 #include "SimpleSegregatedStorage.h"
+#include "PoolStats.h"
+#include "HeapProfiler.h"
 #include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
 #include <mutex>
+#include <thread>
+#include <vector>
 #include <unistd.h>
 #include "debug.h"
 
@@ -57,73 +64,254 @@ class MemoryPagePoolBase : public details::MemoryPageSize
  public:
   using blocks_t = unsigned int;
 
+  // A contiguous range of memory that blocks are allocated from.
+  struct Region
+  {
+    void* begin;                        // The start of the region.
+    size_t size;                        // The size of the region in bytes (a multiple of the block size).
+  };
+
  protected:
   size_t const block_size_;             // The size of a block as returned by allocate(), in bytes.
   blocks_t pool_blocks_;                // The total amount of available memory, in blocks.
+  PoolStats stats_;                     // Allocation statistics; resident_bytes is updated whenever pool_blocks_ changes.
+  std::atomic<int> pinned_;             // The number of pin_regions() calls that weren't undone yet; no memory is decommitted while non-zero.
 
  protected:
-  MemoryPagePoolBase(size_t block_size) : block_size_(block_size), pool_blocks_(0) { }
+  MemoryPagePoolBase(size_t block_size) : block_size_(block_size), pool_blocks_(0), pinned_(0) { }
 
   virtual ~MemoryPagePoolBase() = default;
 
  public:
-  // Accessor.
+  // Accessors.
   size_t block_size() const { return block_size_; }
+  PoolStats const& stats() const { return stats_; }
 
   virtual void* allocate() = 0;
   virtual void deallocate(void* ptr) = 0;
+
+  // Allocate n blocks and write them to ptrs[0] ... ptrs[n - 1].
+  // Returns the number of blocks actually allocated; this is only less than n when out of memory.
+  virtual size_t allocate_n(void** ptrs, size_t n);
+
+  // Deallocate the n blocks ptrs[0] ... ptrs[n - 1].
+  virtual void deallocate_n(void* const* ptrs, size_t n);
+
+  // Return the regions of memory that the blocks are currently allocated from (for example to register them with io_uring).
+  // The pool can grow afterwards; blocks from new regions are not part of the returned value.
+  virtual std::vector<Region> regions() = 0;
+
+  // Stop returning memory of the regions to the operating system (see MemoryPagePool::trim), until the matching unpin_regions().
+  // For example, io_uring pins the pages of registered buffers: after decommitting them the pool would hand out
+  // new pages, while the kernel keeps using the old ones. Calls can be nested.
+  void pin_regions() { pinned_.fetch_add(1, std::memory_order_relaxed); }
+  void unpin_regions() { pinned_.fetch_sub(1, std::memory_order_relaxed); }
 };
 
 // A memory pool that returns fixed-size memory blocks allocated with std::aligned_alloc and aligned to memory_page_size.
 //
+// The pool grows on demand. Memory can be returned to the operating system by calling trim(),
+// which decommits (madvise) the chunks of which all blocks are free, or by calling
+// set_decay_interval(), which starts a background thread that only decommits chunks that
+// remained completely free for at least one whole interval. Neither does anything while the
+// regions are pinned (see pin_regions()).
+//
+// Decommitted chunks are not freed, because a concurrent allocate() might still read the
+// next_ pointer of a block that it saw as head of the free list before the chunk was decommitted
+// (it will then fail its CAS). The physical memory is released however, and a decommitted chunk
+// is reused before a new chunk is allocated.
+//
+// A new chunk is added to the pool from the first allocate() that finds the free list empty,
+// while other threads that need a block wait for it. To take that off the request path the pool
+// can be pre-warmed with reserve(), and/or a low-water mark of free blocks can be maintained by
+// a background thread (see set_low_water_mark()).
+//
+// Optionally chunks can be backed by huge pages, to reduce the number of TLB misses when
+// accessing the blocks (see HugePages). The size of a chunk is then rounded up to a multiple
+// of the huge page size: hugetlb_page_size() for hugetlb and huge_page_size() for transparent.
+// If huge pages are not available the pool silently falls back to the next best mode:
+// hugetlb --> transparent --> none.
+//
 class MemoryPagePool : public MemoryPagePoolBase
 {
+ public:
+  enum class TrimAdvice
+  {
+    dont_need,          // Use madvise(MADV_DONTNEED): the memory is released immediately.
+    free                // Use madvise(MADV_FREE): the memory is released lazily, when the kernel needs it.
+  };
+
+  enum class HugePages
+  {
+    none,               // Allocate chunks with std::aligned_alloc, aligned to the memory page size.
+    transparent,        // Allocate chunks aligned to the huge page size and advise the kernel to use transparent huge pages (MADV_HUGEPAGE).
+    hugetlb             // Allocate chunks with mmap(MAP_HUGETLB), from the reserved huge page pool (see /proc/sys/vm/nr_hugepages).
+  };
+
  protected:
+  struct Chunk
+  {
+    void* ptr;                          // The start of the chunk, as returned by std::aligned_alloc or mmap.
+    blocks_t blocks;                    // The size of the chunk, in blocks.
+    bool mmapped;                       // Set if the chunk was allocated with mmap (and must be freed with munmap).
+    bool decommitted;                   // Set if the chunk was returned to the operating system (it is then not part of the free list).
+    bool was_free;                      // Set if the chunk was completely free during the previous call to decay().
+    bool guarded;                       // Set if the chunk is followed by a PROT_NONE guard page (see MEMORY_GUARD_PAGES).
+  };
+
   SimpleSegregatedStorage sss_;
   blocks_t const minimum_chunk_size_;  // The minimum size of internally allocated contiguous memory blocks, in blocks.
   blocks_t const maximum_chunk_size_;  // The maximum size of internally allocated contiguous memory blocks, in blocks.
-  std::vector<void*> chunks_;          // All allocated chunks that were allocated with std::aligned_alloc.
+  std::vector<Chunk> chunks_;          // All allocated chunks.
+  HugePages huge_pages_;               // The current huge page mode. Only changes (to a fallback mode) while allocating a new chunk.
+  // The number of blocks on the free list and in the bump region of sss_. It is incremented before blocks are made
+  // available and decremented after they were taken, so it is never less than the actual number of free blocks.
+  alignas(hot_alignment<std::atomic<blocks_t>>) std::atomic<blocks_t> free_blocks_;
+
+ private:
+  std::condition_variable_any decay_cv_;        // Used to wake up decay_thread_ when it must stop.
+  std::jthread decay_thread_;                   // The thread that calls decay() periodically, if any.
+  std::atomic<blocks_t> low_water_mark_;        // The number of free blocks that refill_thread_ keeps available, or zero.
+  std::atomic<bool> refill_requested_;          // Set when an allocation had to add a chunk itself.
+  std::condition_variable_any refill_cv_;       // Used to wake up refill_thread_.
+  std::jthread refill_thread_;                  // The thread that maintains low_water_mark_, if any.
+
+  // The add_new_block callable of allocate() and allocate_n().
+  bool add_new_chunk_on_demand()
+  {
+    bool success = add_new_chunk(0);
+    // The free list ran empty, so refill_thread_ didn't keep up: wake it up.
+    if (low_water_mark_.load(std::memory_order_relaxed) > 0)
+    {
+      refill_requested_.store(true, std::memory_order_relaxed);
+      refill_cv_.notify_one();
+    }
+    return success;
+  }
 
  protected:
   virtual blocks_t default_minimum_chunk_size() { return 2; }
   virtual blocks_t default_maximum_chunk_size(blocks_t UNUSED_ARG(minimum_chunk_size)) { return 1024; }
 
+  // Add a chunk of at least min_blocks blocks; recommit a decommitted chunk if there is one that is large enough.
+  // This runs in the critical area of SimpleSegregatedStorage::add_block_mutex_.
+  bool add_new_chunk(blocks_t min_blocks);
+
+  // Allocate a new chunk of at least `size` bytes, using huge_pages_. Returns the chunk with `blocks` set to the actual size.
+  // This runs in the critical area of SimpleSegregatedStorage::add_block_mutex_.
+  Chunk allocate_chunk(size_t size);
+
+  // Decommit completely free chunks; if only_if_was_free is set then only those that were also completely free the previous time.
+  // Chunks are not decommitted if that would bring the number of free blocks below the low-water mark.
+  // This runs in the critical area of SimpleSegregatedStorage::add_block_mutex_.
+  blocks_t trim_chunks(bool only_if_was_free, TrimAdvice advice);
+
+  // Return the number of free blocks (this can be slightly too large while other threads are allocating).
+  blocks_t free_blocks() const { return free_blocks_.load(std::memory_order_relaxed); }
+
+  // Add a single chunk, if needed, so that at least n_blocks blocks are free. Returns false if out of memory.
+  // This runs in the critical area of SimpleSegregatedStorage::add_block_mutex_.
+  bool reserve_locked(blocks_t n_blocks);
+
  public:
   MemoryPagePool(size_t block_size,                     // The size of a block as returned by allocate(), in bytes;
                                                         // must be a multiple of the memory page size.
                  blocks_t minimum_chunk_size = 0,       // A value of 0 will use the value returned by default_minimum_chunk_size().
-                 blocks_t maximum_chunk_size = 0);      // A value of 0 will use the value returned by
+                 blocks_t maximum_chunk_size = 0,       // A value of 0 will use the value returned by
                                                         // default_maximum_chunk_size(minimum_chunk_size).
+                 HugePages huge_pages = HugePages::none);       // Whether or not to back chunks with huge pages.
 
   ~MemoryPagePool() override
   {
     DoutEntering(dc::notice, "MemoryPagePool::~MemoryPagePool() [" << this << "]");
+    set_decay_interval(std::chrono::milliseconds::zero());
+    set_low_water_mark(0);
     release();
   }
 
   void* allocate() override
   {
-    return sss_.allocate([this](){
-        // This runs in the critical area of SimpleSegregatedStorage::add_block_mutex_.
-        blocks_t extra_blocks = std::clamp(pool_blocks_, minimum_chunk_size_, maximum_chunk_size_);
-        size_t extra_size = extra_blocks * block_size_;
-        void* chunk = std::aligned_alloc(memory_page_size(), extra_size);
-        if (AI_UNLIKELY(chunk == nullptr))
-          return false;
-        sss_.add_block(chunk, extra_size, block_size_);
-        pool_blocks_ += extra_blocks;
-        chunks_.push_back(chunk);
-        return true;
-    });
+    void* ptr = sss_.allocate([this](){ return add_new_chunk_on_demand(); });
+    if (AI_LIKELY(ptr))
+    {
+      free_blocks_.fetch_sub(1, std::memory_order_relaxed);
+      stats_.add(PoolStats::allocations);
+      heap_profiler::allocated(this, ptr, block_size_);
+      hardening::unpoison(ptr, block_size_);
+    }
+    return ptr;
   }
 
   void deallocate(void* ptr) override
   {
+    stats_.add(PoolStats::deallocations);
+    heap_profiler::freed(this, ptr);
+    // Poison the block before it is put on the free list, after which another thread might allocate it.
+    hardening::poison_free_block(ptr, block_size_, sizeof(PtrTag::FreeNode));
+    free_blocks_.fetch_add(1, std::memory_order_relaxed);
     sss_.deallocate(ptr);
   }
 
+  size_t allocate_n(void** ptrs, size_t n) override
+  {
+    size_t count = sss_.allocate_n(ptrs, n, [this](){ return add_new_chunk_on_demand(); });
+    free_blocks_.fetch_sub(count, std::memory_order_relaxed);
+    stats_.add(PoolStats::allocations, count);
+    for (size_t i = 0; i < count; ++i)
+    {
+      heap_profiler::allocated(this, ptrs[i], block_size_);
+      hardening::unpoison(ptrs[i], block_size_);
+    }
+    return count;
+  }
+
+  void deallocate_n(void* const* ptrs, size_t n) override
+  {
+    stats_.add(PoolStats::deallocations, n);
+    for (size_t i = 0; i < n; ++i)
+    {
+      heap_profiler::freed(this, ptrs[i]);
+      hardening::poison_free_block(ptrs[i], block_size_, sizeof(PtrTag::FreeNode));
+    }
+    free_blocks_.fetch_add(n, std::memory_order_relaxed);
+    sss_.deallocate_n(ptrs, n);
+  }
+
   void release();
 
+  // Return the committed chunks.
+  std::vector<Region> regions() override;
+
+  // Return the memory of all chunks that are completely free to the operating system.
+  // Returns the number of blocks that were decommitted.
+  blocks_t trim(TrimAdvice advice = TrimAdvice::dont_need);
+
+  // Like trim(), but only decommit chunks that were also completely free during the previous call to decay().
+  blocks_t decay(TrimAdvice advice = TrimAdvice::dont_need);
+
+  // Call decay() every `interval` from a background thread. An interval of zero stops the background thread.
+  void set_decay_interval(std::chrono::milliseconds interval, TrimAdvice advice = TrimAdvice::dont_need);
+
+  // Make sure that at least n_blocks blocks are free, adding a chunk if needed; for example
+  // to pre-warm the pool at startup. The chunk is large enough to contain all missing blocks
+  // (it can be larger than maximum_chunk_size), so that its memory is only touched when the
+  // blocks are allocated. Returns false if the pool ran out of memory.
+  bool reserve(blocks_t n_blocks);
+
+  // Keep at least low_water_mark blocks free, by adding chunks from a background thread.
+  // The thread checks every `interval`, and immediately after an allocation had to add a chunk itself.
+  // A low_water_mark of zero stops the background thread.
+  void set_low_water_mark(blocks_t low_water_mark, std::chrono::milliseconds interval = std::chrono::milliseconds(10));
+
+  // Return the size of a (PMD sized) huge page on this machine, in bytes. Used for HugePages::transparent.
+  static size_t huge_page_size();
+
+  // Return the default hugetlb page size on this machine (Hugepagesize in /proc/meminfo), in bytes. Used for HugePages::hugetlb.
+  static size_t hugetlb_page_size();
+
+  // Return the huge page mode that is currently in use (this might be a fallback of the mode passed to the constructor).
+  HugePages huge_pages() { std::scoped_lock<std::mutex> lock(sss_.add_block_mutex_); return huge_pages_; }
+
   blocks_t pool_blocks() { std::scoped_lock<std::mutex> lock(sss_.add_block_mutex_); return pool_blocks_; }
 };
 
@@ -27,11 +27,13 @@
 
 #include "sys.h"
 #include "NodeMemoryPool.h"
+#include "Hardening.h"
 #include "utils/macros.h"               // AI_UNLIKELY
 #include "utils/is_power_of_two.h"      // utils::is_power_of_two
-#include <algorithm>
+#include <bit>
 #include <cstddef>
 #include <cstdlib>
+#include <ostream>
 #include "debug.h"
 
 namespace memory {
@@ -44,7 +46,8 @@ union Next
 
 struct FreeList
 {
-  ssize_t* free;                // Points to Begin::free of the current block.
+  ssize_t* free;                // Points to Begin::free of the current block. If MEMORY_HARDENED is defined then
+                                // the lowest bit is set while the chunk is free (see free_flag).
   Next next_;                  // next_.ptr either points to the next free chunk in the free list, or is nullptr when there are no free chunks left.
 };
 
@@ -63,8 +66,12 @@ union Chunk
 struct Begin
 {
   ssize_t free;                 // Each allocated memory block (of nchunks_ chunks of size_ each) begins with a size_t
-                                // that counts the number of free chunks in the block.
+                                // that counts the number of free chunks in the block. This must be the first member
+                                // because FreeList::free and Allocated::free point to it (see static_free).
   NodeMemoryPool* pool;         // A pointer to the pool object to support overloading operator delete for objects.
+  FreeList* free_list;          // The first free chunk of this block, or nullptr if there are no free chunks left in this block.
+  Begin* prev;                  // The previous block in the same bin (or full_blocks_), or nullptr if this is the first one.
+  Begin* next;                  // The next block in the same bin (or full_blocks_), or nullptr if this is the last one.
   Chunk first_chunk;            // Subsequently there is a Chunk object, of which this is the first,
                                 // every offsetof(Allocated, data) + size_ bytes (aka the real size of "Allocated",
                                 // aka the real size of Chunk, where sizeof(FreeList) needs to be less than or equal
@@ -72,6 +79,7 @@ struct Begin
 };
 
 static_assert(offsetof(FreeList, next_) == offsetof(Allocated, data), "Unexpected alignment.");
+static_assert(offsetof(Begin, free) == 0, "Begin::free must be the first member of Begin.");
 
 #if CW_DEBUG
 static_assert(alignof(Chunk) == alignof(size_t), "Unexpected alignment of Chunk.");     // Because we shift all Chunk`s by a size_t (technically, alignof(size_t)
@@ -80,29 +88,93 @@ static_assert(utils::is_power_of_two(alignof(Chunk)), "Alignment of Chunk is exp
 static constexpr size_t chunk_align_mask = alignof(Chunk) - 1;
 #endif
 
+namespace {
+
+// The size of a block of nchunks chunks of size bytes (aka, the size of Begin::free plus Begin::pool, etc,
+// followed by nchunks of offsetof(Allocated, data) + size (the real size of Allocated)).
+size_t block_size(size_t nchunks, size_t size)
+{
+  return offsetof(Begin, first_chunk) + nchunks * (offsetof(Allocated, data) + size);
+}
+
+// If MEMORY_HARDENED is defined then this bit of FreeList::free is set while a chunk is free, to detect double frees.
+constexpr uintptr_t free_flag = hardening::enabled ? 1 : 0;
+
+#if CW_DEBUG
+// In debug mode this bit of Allocated::free is set while a chunk is on remote_frees_, to detect double remote frees.
+constexpr uintptr_t remote_free_flag = 2;
+#else
+constexpr uintptr_t remote_free_flag = 0;
+#endif
+
+ssize_t* with_free_flag(ssize_t* free)
+{
+  return reinterpret_cast<ssize_t*>(reinterpret_cast<uintptr_t>(free) | free_flag);
+}
+
+Begin* begin_of(ssize_t* free)
+{
+  return reinterpret_cast<Begin*>(reinterpret_cast<uintptr_t>(free) & ~(free_flag | remote_free_flag));
+}
+
+} // namespace
+
+void NodeMemoryPool::link_block(Begin* block, ssize_t free)
+{
+  Begin*& head = free == 0 ? full_blocks_ : bins_[bin_index(free)];
+  block->prev = nullptr;
+  block->next = head;
+  if (head)
+    head->prev = block;
+  head = block;
+  if (free > 0)
+    non_empty_bins_ |= uint32_t{1} << bin_index(free);
+}
+
+void NodeMemoryPool::unlink_block(Begin* block, ssize_t free)
+{
+  Begin*& head = free == 0 ? full_blocks_ : bins_[bin_index(free)];
+  if (block->prev)
+    block->prev->next = block->next;
+  else
+    head = block->next;
+  if (block->next)
+    block->next->prev = block->prev;
+  if (free > 0 && !head)
+    non_empty_bins_ &= ~(uint32_t{1} << bin_index(free));
+}
+
 void* NodeMemoryPool::alloc(size_t size)
 {
-  std::unique_lock<std::mutex> lock(pool_mutex_);
-  FreeList* ptr = free_list_;
-  if (AI_UNLIKELY(!ptr))
+  std::unique_lock<std::mutex> lock = stats_.lock(pool_mutex_);
+  stats_.add(PoolStats::allocations);
+  // Before allocating a new block, take back the chunks that were freed by other threads.
+  if (AI_UNLIKELY(non_empty_bins_ == 0) && remote_frees_.load(std::memory_order_relaxed))
+    drain_remote_frees();
+  if (AI_UNLIKELY(non_empty_bins_ == 0))
   {
     if (AI_UNLIKELY(!size_))
       size_ = size;    // If size_ wasn't initialized yet, set it to the size of the first allocation.
     // size_ must be greater or equal sizeof(Next), and a multiple of alignof(Chunk).
     ASSERT(size_ >= sizeof(Next) && (size_ & chunk_align_mask) == 0);
-    // Allocate space for Begin::free plus Begin::pool followed by nchunks_ of size_ (offsetof(Allocated, data) + size_) (the real size of Allocated).
-    Dout(dc::notice, "NodeMemoryPool::alloc: allocating " << (offsetof(Begin, first_chunk) + nchunks_ * (offsetof(Allocated, data) + size_)) << " bytes of memory [" << (void*)this << "].");
-    Begin* begin = static_cast<Begin*>(std::malloc(offsetof(Begin, first_chunk) + nchunks_ * (offsetof(Allocated, data) + size_)));
+    Dout(dc::notice, "NodeMemoryPool::alloc: allocating " << block_size(nchunks_, size_) << " bytes of memory [" << (void*)this << "].");
+    Begin* begin = static_cast<Begin*>(std::malloc(block_size(nchunks_, size_)));
     begin->pool = this;
-    ptr = free_list_ = &begin->first_chunk.free_list;
+    FreeList* ptr = begin->free_list = &begin->first_chunk.free_list;
     ptr->next_.n = nchunks_ - 1;
-    ptr->free = &begin->free;
-    *ptr->free = nchunks_;
-    blocks_.push_back(begin);
+    ptr->free = with_free_flag(&begin->free);
+    begin->free = nchunks_;
+    link_block(begin, nchunks_);
+    ++number_of_blocks_;
     total_free_ += nchunks_;
+    stats_.add(PoolStats::refills);
+    stats_.add_resident(block_size(nchunks_, size_));
   }
   // size must fit. If you use multiple sizes, allocate the largest size first.
   ASSERT(size <= size_);
+  // Take a chunk from one of the fullest blocks that still have free chunks.
+  Begin* begin = bins_[std::countr_zero(non_empty_bins_)];
+  FreeList* ptr = begin->free_list;
   if (AI_UNLIKELY(ptr->next_.n < nchunks_ && ptr->next_.ptr))
   {
     size_t n = ptr->next_.n;
@@ -111,10 +183,19 @@ void* NodeMemoryPool::alloc(size_t size)
     ptr->next_.ptr->next_.n = n - 1;
     ptr->next_.ptr->free = ptr->free;
   }
-  free_list_ = ptr->next_.ptr;
-  --*ptr->free;
+  begin->free_list = ptr->next_.ptr;
+  // Mark the chunk as allocated.
+  ptr->free = &begin->free;
+  ssize_t const free = begin->free--;
+  ASSERT(begin->free >= 0);
+  if (free == 1 || bin_index(free - 1) != bin_index(free))
+  {
+    // Move the block to the list that corresponds with its new number of free chunks.
+    unlink_block(begin, free);
+    link_block(begin, free - 1);
+  }
   --total_free_;
-  ASSERT(*ptr->free >= 0);
+  hardening::unpoison(reinterpret_cast<Chunk*>(ptr)->allocated.data, size_);
   return reinterpret_cast<Chunk*>(ptr)->allocated.data;
 }
 
@@ -122,64 +203,121 @@ void NodeMemoryPool::free(void* p)
 {
   // Interpret the pointer p as pointing to Chunk::allocated::data and reinterpret/convert it to a pointer to Chunk::free_list.
   FreeList* ptr = reinterpret_cast<FreeList*>(reinterpret_cast<char*>(p) - offsetof(Allocated, data));
+  std::unique_lock<std::mutex> lock = stats_.lock(pool_mutex_);
+  stats_.add(PoolStats::deallocations);
+  free_locked(ptr);
+  // Take back the chunks that were freed by other threads while we have the lock anyway.
+  if (AI_UNLIKELY(remote_frees_.load(std::memory_order_relaxed)))
+    drain_remote_frees();
+}
+
+NodeMemoryPool::~NodeMemoryPool()
+{
   std::unique_lock<std::mutex> lock(pool_mutex_);
-  ptr->next_.ptr = free_list_;
-  free_list_ = ptr;
-  ++*ptr->free;
-  ++total_free_;
-  ASSERT(*ptr->free <= (ssize_t)nchunks_);
-  if (AI_UNLIKELY(*ptr->free == (ssize_t)nchunks_) && total_free_ >= 2 * nchunks_)
-  {
-    // The last chunk of this block was freed; delete it.
-    // Find begin and end of the block.
-    char* const begin = reinterpret_cast<char*>(ptr->free) - offsetof(Begin, free);                             // The actual start of the allocated memory block (Begin*).
-    char* const end = begin + offsetof(Begin, first_chunk) + nchunks_ * (offsetof(Allocated, data) + size_);  // One passed the end of the allocated memory block.
-    // Run over the whole free list. Note that when FreeList* == nullptr we reached the end of the free list.
-    // However, if a pointer value interpreted as a size_t is less than nchunks_ then that means that the
-    // next size_t chunks are free chunks and then the free list ends.
-    // free_list_ itself always points to the first free chunk, so the first test is always true.
-    for (FreeList** fpp = &free_list_; reinterpret_cast<size_t>(*fpp) >= nchunks_; fpp = &(*fpp)->next_.ptr)
+  drain_remote_frees();
+  // Free the blocks that are completely free; blocks with chunks that are still in use are leaked.
+  for (Begin* begin : bins_)
+    while (begin)
     {
-      // When *fpp points inside the block that we're about to delete, then just skip it until we
-      // either reach the end of the free list (*fpp == nullptr) or reinterpret_cast<size_t>(*fpp) is
-      // less than nchunks_ (in which case it will not be >= begin either).
-      while (begin <= reinterpret_cast<char*>(*fpp) && reinterpret_cast<char*>(*fpp) < end)
-        *fpp = (*fpp)->next_.ptr;
-      // Hence, if at this point reinterpret_cast<size_t>(*fpp) < nchunks_, then that happened
-      // because *fpp was just assigned that value in the above while loop, which means that
-      // all remaining chunks are also part of the deleted block. And we need to set *fpp to nullptr.
-      if (reinterpret_cast<size_t>(*fpp) < nchunks_)
+      Begin* next = begin->next;
+      if (begin->free == static_cast<ssize_t>(nchunks_))
       {
-        // We reached the end of the free list.
-        *fpp = nullptr; // Any remaining "free" chunk count refers to the block that is being deleted.
-        break;
+        hardening::unpoison(begin, block_size(nchunks_, size_));
+        std::free(begin);
       }
+      begin = next;
     }
+}
+
+#if CW_DEBUG
+//static
+void NodeMemoryPool::mark_remote_free(void* ptr)
+{
+  Allocated* allocated = reinterpret_cast<Allocated*>(static_cast<char*>(ptr) - offsetof(Allocated, data));
+  // A chunk that is freed twice would point to itself (or form a longer cycle) on remote_frees_.
+  ASSERT(!(reinterpret_cast<uintptr_t>(allocated->free) & (free_flag | remote_free_flag)));
+  allocated->free = reinterpret_cast<ssize_t*>(reinterpret_cast<uintptr_t>(allocated->free) | remote_free_flag);
+}
+#endif
+
+void NodeMemoryPool::drain_remote_frees()
+{
+  // Take the whole stack at once; the std::memory_order_acquire synchronizes with the release in remote_free.
+  void* p = remote_frees_.exchange(nullptr, std::memory_order_acquire);
+  while (p)
+  {
+    void* next = *static_cast<void**>(p);
+    FreeList* ptr = reinterpret_cast<FreeList*>(static_cast<char*>(p) - offsetof(Allocated, data));
+#if CW_DEBUG
+    ptr->free = reinterpret_cast<ssize_t*>(reinterpret_cast<uintptr_t>(ptr->free) & ~remote_free_flag);
+#endif
+    free_locked(ptr);
+    p = next;
+  }
+}
+
+void NodeMemoryPool::free_locked(FreeList* ptr)
+{
+  if (hardening::enabled && AI_UNLIKELY(reinterpret_cast<uintptr_t>(ptr->free) & free_flag))
+    hardening::corruption_detected("double free", reinterpret_cast<Chunk*>(ptr)->allocated.data);
+  // Freeing a chunk that is still on remote_frees_ is a double free too.
+  ASSERT(!(reinterpret_cast<uintptr_t>(ptr->free) & remote_free_flag));
+  Begin* const begin = reinterpret_cast<Begin*>(ptr->free);
+  ptr->free = with_free_flag(ptr->free);
+  ptr->next_.ptr = begin->free_list;
+  // Poison the chunk, except for next_.
+  hardening::poison_free_block(reinterpret_cast<Chunk*>(ptr)->allocated.data, size_, sizeof(Next));
+  begin->free_list = ptr;
+  ssize_t const free = ++begin->free;
+  ++total_free_;
+  ASSERT(free <= (ssize_t)nchunks_);
+  if (AI_UNLIKELY(free == (ssize_t)nchunks_) && total_free_ >= 2 * nchunks_)
+  {
+    // The last chunk of this block was freed; delete it.
+    // Since all chunks of this block are on its own free list, this doesn't affect other blocks.
+    unlink_block(begin, free - 1);
     total_free_ -= nchunks_;
+    --number_of_blocks_;
+    stats_.add_resident(-static_cast<int64_t>(block_size(nchunks_, size_)));
+    hardening::unpoison(begin, block_size(nchunks_, size_));
     std::free(begin);
-    blocks_.erase(std::remove(blocks_.begin(), blocks_.end(), reinterpret_cast<Begin*>(begin)));
+    return;
+  }
+  if (free == 1 || bin_index(free) != bin_index(free - 1))
+  {
+    // Move the block to the list that corresponds with its new number of free chunks.
+    unlink_block(begin, free - 1);
+    link_block(begin, free);
   }
 }
 
 //static
-void NodeMemoryPool::static_free(void* ptr)
+NodeMemoryPool* NodeMemoryPool::owner(void* ptr)
 {
   Allocated* allocated = reinterpret_cast<Allocated*>(reinterpret_cast<char*>(ptr) - offsetof(Allocated, data));
-  NodeMemoryPool* self = reinterpret_cast<Begin*>(allocated->free)->pool;
-  self->free(ptr);
+  return begin_of(allocated->free)->pool;
+}
+
+//static
+void NodeMemoryPool::static_free(void* ptr)
+{
+  owner(ptr)->free(ptr);
 }
 
 std::ostream& operator<<(std::ostream& os, NodeMemoryPool const& pool)
 {
   std::unique_lock<std::mutex> lock(pool.pool_mutex_);
-  size_t allocated_size = (offsetof(Begin, first_chunk) + pool.nchunks_ * (offsetof(Allocated, data) + pool.size_)) * pool.blocks_.size();
-  size_t num_chunks = pool.nchunks_ * pool.blocks_.size();
+  size_t allocated_size = block_size(pool.nchunks_, pool.size_) * pool.number_of_blocks_;
+  size_t num_chunks = pool.nchunks_ * pool.number_of_blocks_;
   size_t num_free_chunks = 0;
-  for (Begin* begin : pool.blocks_)
-    num_free_chunks += begin->free;
+  // Blocks in full_blocks_ have no free chunks.
+  for (Begin* first : pool.bins_)
+    for (Begin* begin = first; begin; begin = begin->next)
+      num_free_chunks += begin->free;
   ASSERT(num_free_chunks == pool.total_free_);
   os << "NodeMemoryPool stats: node size: " << pool.size_ << "; allocated size: " << allocated_size <<
-      "; total/used/free: " << num_chunks << '/' << (num_chunks - num_free_chunks) << '/' << num_free_chunks;
+      "; total/used/free: " << num_chunks << '/' << (num_chunks - num_free_chunks) << '/' << num_free_chunks <<
+      "; " << pool.stats_.snapshot();
   return os;
 }
 
@@ -27,13 +27,17 @@
 
 #pragma once
 
+#include "PoolStats.h"
+#include <array>
+#include <atomic>
+#include <cstdint>
 #include <iosfwd>
 #include <mutex>
-#include <vector>
 #include "debug.h"
 
 namespace memory {
 class NodeMemoryPool;
+class ShardedNodeMemoryPool;
 } // namespace memory
 
 inline void* operator new(std::size_t size, memory::NodeMemoryPool& pool);
@@ -95,25 +99,63 @@ std::ostream& operator<<(std::ostream& os, NodeMemoryPool const& pool);
 // Foo* foo = new(pool) Foo(42);        // Allocate memory from memory pool and construct object.
 // delete foo;                          // Destruct object and return memory to the memory pool.
 //
-// NodeMemoryPool is thread-safe.
+// NodeMemoryPool is thread-safe. If many threads use the same pool concurrently
+// then consider using a ShardedNodeMemoryPool instead.
+
+//
+// Implementation
+//
+// Every block has its own free list. Blocks that have at least one free chunk are kept in
+// one of number_of_bins intrusive doubly linked lists ("bins"), according to how many free
+// chunks they have; blocks without free chunks are kept in full_blocks_. The bins allow
+// alloc() to take a chunk from one of the fullest blocks in constant time (which reduces
+// fragmentation), and free() to release a block that became completely free in constant time.
 
 class NodeMemoryPool
 {
  private:
+  static constexpr int number_of_bins = 8;      // The number of fill levels that blocks with free chunks are sorted in.
+
   mutable std::mutex pool_mutex_;       // Protects the pool against concurrent accesses.
 
   size_t const nchunks_;                // The number of `size_' sized chunks to allocate at once. Should always be larger than 0.
-  FreeList* free_list_;                 // The next free chunk, or nullptr if there isn't any left.
-  std::vector<Begin*> blocks_;          // A list of all allocated blocks.
+  std::array<Begin*, number_of_bins> bins_;     // bins_[i] is the first block of a list of blocks with bin_index(free) == i.
+  uint32_t non_empty_bins_;             // Bit i is set iff bins_[i] != nullptr.
+  Begin* full_blocks_;                  // The first block of a list of blocks without free chunks.
+  size_t number_of_blocks_;             // The total number of allocated blocks.
   size_t size_;                         // The (fixed) size of a single chunk in bytes.
-                                        // alloc() always returns a chunk of this size except the first time when free_list_ is still 0.
+                                        // alloc() always returns a chunk of this size except the first time when no block was allocated yet.
   size_t total_free_;                   // The current total number of free chunks in the memory pool.
+  PoolStats stats_;                     // Allocation statistics. Contention is measured on pool_mutex_.
+  alignas(cache_line_size) std::atomic<void*> remote_frees_; // A lock-free stack of chunks freed by other threads (see remote_free).
 
   friend void* ::operator new(std::size_t size, NodeMemoryPool& pool);
+  friend class ShardedNodeMemoryPool;
   void* alloc(size_t size);
 
+  // Return the bin that a block with `free` (> 0) free chunks belongs to; the fuller a block, the lower the index.
+  int bin_index(ssize_t free) const { return (free - 1) * number_of_bins / nchunks_; }
+
+  // Add block to, or remove block from, the list that corresponds with `free` free chunks.
+  void link_block(Begin* block, ssize_t free);
+  void unlink_block(Begin* block, ssize_t free);
+
+  // Return the chunk FreeList* ptr to its block. pool_mutex_ must be locked.
+  void free_locked(FreeList* ptr);
+
+  // Free all chunks on remote_frees_. pool_mutex_ must be locked.
+  void drain_remote_frees();
+
+#if CW_DEBUG
+  // Mark the chunk ptr as being on remote_frees_; asserts that it isn't already (a double remote_free would turn the stack into a cycle).
+  static void mark_remote_free(void* ptr);
+#endif
+
  public:
-  NodeMemoryPool(int nchunks, size_t chunk_size = 0) : nchunks_(nchunks), free_list_(nullptr), size_(chunk_size), total_free_(0) { }
+  NodeMemoryPool(int nchunks, size_t chunk_size = 0) :
+    nchunks_(nchunks), bins_{}, non_empty_bins_(0), full_blocks_(nullptr), number_of_blocks_(0), size_(chunk_size), total_free_(0),
+    remote_frees_(nullptr) { }
+  ~NodeMemoryPool();
 
   template<class Tp>
   Tp* malloc() { return static_cast<Tp*>(alloc(sizeof(Tp))); }
@@ -121,6 +163,30 @@ class NodeMemoryPool
   void free(void* ptr);
   static void static_free(void* ptr);
 
+  // Return the pool that ptr was allocated from.
+  static NodeMemoryPool* owner(void* ptr);
+
+  // Like free(), but lock-free: ptr is pushed onto a stack of chunks that are only really freed
+  // by the next call to free(), by the next call to alloc() that needs a new block, or by the
+  // destructor. This is intended for threads that free chunks that were allocated by another
+  // thread (see ShardedNodeMemoryPool), so that they do not contend for pool_mutex_ with the
+  // thread(s) that allocate from this pool.
+  void remote_free(void* ptr)
+  {
+#if CW_DEBUG
+    mark_remote_free(ptr);
+#endif
+    stats_.add(PoolStats::deallocations);
+    void* head = remote_frees_.load(std::memory_order_relaxed);
+    do
+      *static_cast<void**>(ptr) = head;
+    // The std::memory_order_release makes the above store visible to drain_remote_frees.
+    while (!remote_frees_.compare_exchange_weak(head, ptr, std::memory_order_release, std::memory_order_relaxed));
+  }
+
+  // Accessor. Use stats().snapshot() for cheap statistics that, unlike operator<<, do not lock the pool.
+  PoolStats const& stats() const { return stats_; }
+
   friend std::ostream& operator<<(std::ostream& os, NodeMemoryPool const& pool);
 };
 
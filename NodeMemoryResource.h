@@ -29,13 +29,19 @@
 
 #include "MemoryPagePool.h"
 #include "SimpleSegregatedStorage.h"
+#include "MagazineCache.h"
+#include "PoolStats.h"
+#include "Hardening.h"
+#include "HeapProfiler.h"
+#include <cstring>
+#include <memory>
 #include "debug.h"
 
 namespace memory {
 
 // class NodeMemoryResource
 //
-// A fixed size memory resource that uses a MemoryPagePool as upstream.
+// A fixed size memory resource that uses a MemoryPagePool (or any other MemoryPagePoolBase) as upstream.
 // The block size is determined during runtime from the first allocation,
 // which allows it to be used for allocators that allocate unknown types.
 //
@@ -50,16 +56,27 @@ namespace memory {
 // Note: it is possible to specify a block size upon construction (which obviously must be
 // larger or equal to the actual (largest) block size that will be allocated).
 //
+// Optionally a per-thread MagazineCache can be put in front of the shared free list by passing
+// a non-zero magazine_size. In that case the common allocate/deallocate path does not touch
+// memory that is shared with other threads. The (largest) block size must then be at least
+// MagazineCache::minimum_node_size.
+//
+//   memory::NodeMemoryResource nmr(mpp, 0, 32);         // Use magazines of 32 nodes per thread.
+//
 class NodeMemoryResource
 {
  public:
   // Create an uninitialized NodeMemoryResource. Call init() to initialize it.
-  NodeMemoryResource() : mpp_(nullptr), block_size_(0) { }
+  NodeMemoryResource() : mpp_(nullptr), block_size_(0) { sss_.set_stats(&stats_); }
 
   // Create an initialized NodeMemoryResource.
-  NodeMemoryResource(MemoryPagePool& mpp, size_t block_size = 0) : mpp_(&mpp), block_size_(block_size)
+  NodeMemoryResource(MemoryPagePoolBase& mpp, size_t block_size = 0, unsigned int magazine_size = 0) :
+    mpp_(&mpp), block_size_(block_size), magazine_cache_(magazine_size ? new MagazineCache(magazine_size) : nullptr)
   {
-    DoutEntering(dc::notice, "NodeMemoryResource::NodeMemoryResource({" << (void*)mpp_ << "}, " << block_size << ") [" << this << "]");
+    DoutEntering(dc::notice, "NodeMemoryResource::NodeMemoryResource({" << (void*)mpp_ << "}, " << block_size << ", " << magazine_size << ") [" << this << "]");
+    sss_.set_stats(&stats_);
+    // The block size must be large enough to be stored in a magazine.
+    ASSERT(!magazine_cache_ || block_size == 0 || block_size >= MagazineCache::minimum_node_size);
   }
 
   // Destructor.
@@ -69,12 +86,18 @@ class NodeMemoryResource
   }
 
   // Late initialization.
-  void init(MemoryPagePool* mpp_ptr, size_t block_size = 0)
+  void init(MemoryPagePoolBase* mpp_ptr, size_t block_size = 0, unsigned int magazine_size = 0)
   {
     // A NodeMemoryResource object may only be initialized once.
     ASSERT(mpp_ == nullptr);
     mpp_ = mpp_ptr;
     block_size_ = block_size;
+    if (magazine_size > 0)
+    {
+      // The block size must be large enough to be stored in a magazine.
+      ASSERT(block_size == 0 || block_size >= MagazineCache::minimum_node_size);
+      magazine_cache_.reset(new MagazineCache(magazine_size));
+    }
     Dout(dc::notice(block_size > 0), "NodeMemoryResource::block_size_ using [" << mpp_ << "] set to " << block_size << " [" << this << "]");
   }
 
@@ -102,6 +125,8 @@ class NodeMemoryResource
       // If this is inside a call to memory::DequeMemoryResource::allocate then you forgot to
       // construct a memory::DequeMemoryResource::Initialization object at the top of main.
       ASSERT(mpp_ != nullptr);
+      // The block size must be large enough to be stored in a magazine.
+      ASSERT(!magazine_cache_ || block_size >= MagazineCache::minimum_node_size);
       block_size_.store(block_size, std::memory_order_relaxed);
       stored_block_size = block_size;
       Dout(dc::notice, "NodeMemoryResource::block_size_ using [" << mpp_ << "] set to " << block_size << " [" << this << "]");
@@ -110,27 +135,152 @@ class NodeMemoryResource
     else
       ASSERT(block_size <= stored_block_size);
 #endif
-    void* ptr = sss_.allocate([this, stored_block_size](){
-          void* chunk = mpp_->allocate();
-          if (!chunk)
-            return false;
-          sss_.add_block(chunk, mpp_->block_size(), stored_block_size);
-          return true;
-        });
+    auto add_new_block = [this, stored_block_size](){ return add_new_chunk(stored_block_size); };
+    if (magazine_cache_)
+    {
+      void* ptr = magazine_cache_->allocate();
+      if (AI_LIKELY(ptr))
+        return allocated(ptr, stored_block_size);
+      if (magazine_cache_->has_slot())
+      {
+        // The magazines of this thread and the depot are empty. Detach a whole magazine worth of
+        // nodes from the shared free list with a single CAS; return the first and cache the rest.
+        size_t count;
+        PtrTag::FreeNode* chain = sss_.allocate_chain(magazine_cache_->magazine_size(), count, add_new_block);
+        if (AI_UNLIKELY(!chain))
+          return nullptr;
+        magazine_cache_->load(chain->next(), count - 1);
+        return allocated(chain, stored_block_size);
+      }
+    }
+    void* ptr = sss_.allocate(add_new_block);
     //Dout(dc::finish, ptr);
-    return ptr;
+    return AI_LIKELY(ptr) ? allocated(ptr, stored_block_size) : nullptr;
   }
 
+  // Allocate n blocks of block_size bytes and write them to ptrs[0] ... ptrs[n - 1].
+  // Whole chains of blocks are detached from the shared free list with a single CAS (the magazines are bypassed).
+  // Returns the number of blocks actually allocated; this is only less than n when out of memory.
+  size_t allocate_n(size_t block_size, void** ptrs, size_t n)
+  {
+    if (AI_UNLIKELY(n == 0))
+      return 0;
+    // Let allocate() deal with the initialization of block_size_.
+    ptrs[0] = allocate(block_size);
+    if (AI_UNLIKELY(ptrs[0] == nullptr))
+      return 0;
+    size_t const stored_block_size = block_size_.load(std::memory_order_relaxed);
+    size_t count = sss_.allocate_n(ptrs + 1, n - 1, [this, stored_block_size](){ return add_new_chunk(stored_block_size); });
+    for (size_t i = 1; i <= count; ++i)
+      allocated(ptrs[i], stored_block_size);
+    // The upstream pool is exhausted, but there might still be free blocks in the magazines.
+    if (AI_UNLIKELY(magazine_cache_ && 1 + count < n))
+    {
+      void* ptr;
+      while (1 + count < n && (ptr = magazine_cache_->allocate()))
+        ptrs[1 + count++] = allocated(ptr, stored_block_size);
+    }
+    return 1 + count;
+  }
+
+  // Deallocate the n blocks ptrs[0] ... ptrs[n - 1] with a single CAS.
+  void deallocate_n(void* const* ptrs, size_t n)
+  {
+    for (size_t i = 0; i < n; ++i)
+      freed(ptrs[i]);
+    sss_.deallocate_n(ptrs, n);
+  }
+
+  // Accessors.
+  size_t block_size() const { return block_size_.load(std::memory_order_relaxed); }   // Returns 0 if still unknown.
+  MemoryPagePoolBase* mpp() const { return mpp_; }
+  PoolStats const& stats() const { return stats_; }
+
   void deallocate(void* ptr)
   {
     //DoutEntering(dc::notice, "NodeMemoryResource::deallocate(" << ptr << ")");
+    freed(ptr);
+    if (magazine_cache_ && AI_LIKELY(magazine_cache_->deallocate(ptr)))
+      return;
     sss_.deallocate(ptr);
   }
 
  private:
-  MemoryPagePool* mpp_;
+  // The number of bytes at the start of a free block that are used by the free list (or a magazine).
+  static constexpr size_t free_list_size = MagazineCache::minimum_node_size;
+  // If MEMORY_HARDENED is defined then deallocate writes canary_value ^ ptr in the last word of
+  // a block (if the block is large enough), to detect double frees.
+  static constexpr uintptr_t canary_value = 0x6e6f64656672656e;
+
+  // Return the offset of the canary in a block of stored_block_size bytes, or stored_block_size if there is no canary.
+  static size_t canary_offset(size_t stored_block_size)
+  {
+    if (!hardening::enabled || stored_block_size < free_list_size + sizeof(uintptr_t))
+      return stored_block_size;
+    return stored_block_size - sizeof(uintptr_t);
+  }
+
+  // Called for every block that is returned by allocate and allocate_n.
+  [[gnu::always_inline]] void* allocated(void* ptr, size_t stored_block_size)
+  {
+    stats_.add(PoolStats::allocations);
+    heap_profiler::allocated(this, ptr, stored_block_size);
+    hardening::unpoison(ptr, stored_block_size);
+    if constexpr (hardening::enabled)
+    {
+      size_t const offset = canary_offset(stored_block_size);
+      if (offset < stored_block_size)
+        std::memset(static_cast<char*>(ptr) + offset, 0, sizeof(uintptr_t));
+    }
+    return ptr;
+  }
+
+  // Called for every block that is passed to deallocate and deallocate_n, before it is added to a free list.
+  [[gnu::always_inline]] void freed(void* ptr)
+  {
+    stats_.add(PoolStats::deallocations);
+    heap_profiler::freed(this, ptr);
+    size_t const stored_block_size = block_size_.load(std::memory_order_relaxed);
+    size_t const offset = canary_offset(stored_block_size);
+    if constexpr (hardening::enabled)
+    {
+      if (offset < stored_block_size)
+      {
+        uintptr_t const canary = canary_value ^ reinterpret_cast<uintptr_t>(ptr);
+        uintptr_t value;
+        std::memcpy(&value, static_cast<char*>(ptr) + offset, sizeof(uintptr_t));
+        if (AI_UNLIKELY(value == canary))
+          hardening::corruption_detected("double free", ptr);
+        std::memcpy(static_cast<char*>(ptr) + offset, &canary, sizeof(uintptr_t));
+      }
+    }
+    // Poison the block, except for the free list and the canary.
+    hardening::poison_free_block(ptr, offset, free_list_size);
+  }
+
+  // Add a new chunk from the upstream MemoryPagePool to sss_, partitioned in blocks of stored_block_size.
+  // This runs in the critical area of SimpleSegregatedStorage::add_block_mutex_.
+  bool add_new_chunk(size_t stored_block_size)
+  {
+    void* chunk;
+    {
+      // The blocks carved out of chunk are sampled by allocate(); don't sample the chunk too.
+      heap_profiler::DownstreamScope downstream;
+      chunk = mpp_->allocate();
+    }
+    if (!chunk)
+      return false;
+    sss_.add_block(chunk, mpp_->block_size(), stored_block_size, free_list_size);
+    stats_.add_resident(mpp_->block_size());
+    return true;
+  }
+
+ private:
+  MemoryPagePoolBase* mpp_;
   SimpleSegregatedStorage sss_;
   std::atomic<size_t> block_size_;
+  std::unique_ptr<MagazineCache> magazine_cache_;       // Optional per-thread cache in front of sss_.
+  PoolStats stats_;                                     // Allocation statistics.
 };
 
 } // namespace memory
@@ -0,0 +1,160 @@
+/**
+ * memory -- C++ Memory utilities
+ *
+ * @file
+ * @brief Definition of class NumaMemoryPagePool.
+ *
+ * @Copyright (C) 2026  Carlo Wood.
+ *
+ * pub   dsa3072/C155A4EEE4E527A2 2018-08-16 Carlo Wood (CarloWood on Libera) <carlo@alinoe.com>
+ * fingerprint: 8020 B266 6305 EE2F D53E  6827 C155 A4EE E4E5 27A2
+ *
+ * This file is part of memory.
+ *
+ * memory is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * memory is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with memory.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "sys.h"
+#include "NumaMemoryPagePool.h"
+#include "utils/AIAlert.h"
+#include <algorithm>
+#include <fstream>
+#include <linux/mempolicy.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <vector>
+
+namespace memory {
+
+namespace {
+
+// Return the number of possible NUMA nodes, or 1 if that can not be determined.
+unsigned int number_of_numa_nodes()
+{
+  // The format of this file is a list of ranges, for example "0-1" or "0,2-3" (the last number is the highest node).
+  std::ifstream possible("/sys/devices/system/node/possible");
+  std::string line;
+  if (!std::getline(possible, line))
+    return 1;
+  auto pos = line.find_last_of(",-");
+  unsigned long highest_node = std::stoul(pos == std::string::npos ? line : line.substr(pos + 1));
+  return highest_node + 1;
+}
+
+// The glibc wrapper for mbind is part of libnuma, use the system call directly.
+long mbind(void* addr, unsigned long len, int mode, unsigned long const* nodemask, unsigned long maxnode, unsigned int flags)
+{
+  return ::syscall(SYS_mbind, addr, len, mode, nodemask, maxnode, flags);
+}
+
+} // namespace
+
+NumaMemoryPagePool::NumaMemoryPagePool(size_t block_size, blocks_t minimum_chunk_size, blocks_t maximum_chunk_size,
+    size_t reserved_size_per_node) :
+  MemoryPagePoolBase(block_size), number_of_nodes_(number_of_numa_nodes()), base_(nullptr),
+  reserved_size_per_node_(reserved_size_per_node / block_size * block_size),
+  minimum_chunk_size_(minimum_chunk_size ? minimum_chunk_size : 2),
+  maximum_chunk_size_(maximum_chunk_size ? maximum_chunk_size : 1024)
+{
+  DoutEntering(dc::notice, "NumaMemoryPagePool::NumaMemoryPagePool(" << block_size << ", " << minimum_chunk_size << ", " <<
+      maximum_chunk_size << ", " << reserved_size_per_node << ") [" << this << "]");
+
+  // block_size must be a multiple of memory_page_size (and larger than 0).
+  ASSERT(block_size > 0 && block_size % memory_page_size() == 0);
+  // maximum_chunk_size must be larger or equal than minimum_chunk_size.
+  ASSERT(maximum_chunk_size_ >= minimum_chunk_size_);
+  // The reserved range of a node must be able to contain at least one block.
+  ASSERT(reserved_size_per_node_ > 0);
+
+  Dout(dc::notice, "Number of NUMA nodes: " << number_of_nodes_);
+
+  size_t const total_size = number_of_nodes_ * reserved_size_per_node_;
+  void* base = ::mmap(nullptr, total_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (base == MAP_FAILED)
+    THROW_LALERTE("Failed to reserve [SIZE] bytes of virtual address space", AIArgs("[SIZE]", total_size));
+  base_ = static_cast<char*>(base);
+
+  nodes_.reset(new Node[number_of_nodes_]);
+  for (unsigned int node = 0; node < number_of_nodes_; ++node)
+  {
+    Node& n = nodes_[node];
+    n.begin_ = n.committed_end_ = base_ + node * reserved_size_per_node_;
+    n.end_ = n.begin_ + reserved_size_per_node_;
+    n.pool_blocks_ = 0;
+    n.sss_.set_stats(&stats_);
+
+    if (number_of_nodes_ == 1)
+      continue;
+
+    // Bind the range of this node to the node. Pages are allocated on first touch, which will now be on this node.
+    constexpr size_t bits_per_word = 8 * sizeof(unsigned long);
+    std::vector<unsigned long> nodemask(node / bits_per_word + 1, 0UL);
+    nodemask[node / bits_per_word] = 1UL << (node % bits_per_word);
+    if (mbind(n.begin_, reserved_size_per_node_, MPOL_BIND, nodemask.data(), nodemask.size() * bits_per_word + 1, 0) == -1)
+      Dout(dc::warning|error_cf, "mbind() failed for node " << node << ": using the default memory policy");
+  }
+}
+
+NumaMemoryPagePool::~NumaMemoryPagePool()
+{
+  DoutEntering(dc::notice, "NumaMemoryPagePool::~NumaMemoryPagePool() [" << this << "]");
+  if (base_)
+    ::munmap(base_, number_of_nodes_ * reserved_size_per_node_);
+}
+
+std::vector<MemoryPagePoolBase::Region> NumaMemoryPagePool::regions()
+{
+  std::vector<Region> result;
+  for (unsigned int node = 0; node < number_of_nodes_; ++node)
+  {
+    Node& n = nodes_[node];
+    std::scoped_lock<std::mutex> lock(n.sss_.add_block_mutex_);
+    if (n.committed_end_ != n.begin_)
+      result.push_back({n.begin_, static_cast<size_t>(n.committed_end_ - n.begin_)});
+  }
+  return result;
+}
+
+bool NumaMemoryPagePool::add_new_chunk(unsigned int node)
+{
+  Node& n = nodes_[node];
+  blocks_t const available_blocks = (n.end_ - n.committed_end_) / block_size_;
+  if (AI_UNLIKELY(available_blocks == 0))
+    return false;
+  blocks_t extra_blocks = std::min(std::clamp(n.pool_blocks_, minimum_chunk_size_, maximum_chunk_size_), available_blocks);
+  size_t extra_size = extra_blocks * block_size_;
+  n.sss_.add_block(n.committed_end_, extra_size, block_size_);
+  n.committed_end_ += extra_size;
+  n.pool_blocks_ += extra_blocks;
+  stats_.add_resident(extra_size);
+  return true;
+}
+
+void* NumaMemoryPagePool::allocate_from_other_nodes(unsigned int node)
+{
+  for (unsigned int other = (node + 1) % number_of_nodes_; other != node; other = (other + 1) % number_of_nodes_)
+    if (void* ptr = nodes_[other].sss_.allocate([this, other](){ return add_new_chunk(other); }))
+      return ptr;
+  return nullptr;
+}
+
+NumaMemoryPagePool::blocks_t NumaMemoryPagePool::pool_blocks()
+{
+  blocks_t total = 0;
+  for (unsigned int node = 0; node < number_of_nodes_; ++node)
+    total += pool_blocks(node);
+  return total;
+}
+
+} // namespace memory
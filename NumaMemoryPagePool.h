@@ -0,0 +1,159 @@
+/**
+ * memory -- C++ Memory utilities
+ *
+ * @file
+ * @brief Declaration of class NumaMemoryPagePool.
+ *
+ * @Copyright (C) 2026  Carlo Wood.
+ *
+ * pub   dsa3072/C155A4EEE4E527A2 2018-08-16 Carlo Wood (CarloWood on Libera) <carlo@alinoe.com>
+ * fingerprint: 8020 B266 6305 EE2F D53E  6827 C155 A4EE E4E5 27A2
+ *
+ * This file is part of memory.
+ *
+ * memory is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * memory is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with memory.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "MemoryPagePool.h"
+#include <memory>
+#include <sched.h>
+#include "debug.h"
+
+namespace memory {
+
+// class NumaMemoryPagePool
+//
+// A memory pool that returns fixed-size memory blocks, just like MemoryPagePool,
+// but that keeps a separate free list per NUMA node. Allocation is served from the
+// NUMA node of the CPU that the calling thread is currently running on.
+//
+// For every node a large range of virtual address space is reserved up front
+// (MAP_NORESERVE, so that it only costs memory once touched), and bound to that
+// node with mbind(2). Chunks are carved from the start of that range as the pool
+// grows. Because the node of a block follows from its address, deallocate() always
+// returns a block to the free list of the node that it was allocated on, no matter
+// which thread frees it.
+//
+//  .--------------------------------------------------.--------------------------------------------------.
+//  | node 0: committed chunks ... | reserved          | node 1: committed chunks ... | reserved          |
+//  `--------------------------------------------------'--------------------------------------------------'
+//  ^                                                  ^
+//  base_                                              base_ + reserved_size_per_node_
+//
+// If the range of a node is exhausted, blocks are taken from the other nodes.
+// On machines (or kernels) without NUMA support this simply behaves as a single node pool.
+//
+// Usage:
+//
+//   memory::NumaMemoryPagePool mpp(0x8000);                     // Serves blocks of 32 kB.
+//   memory::NodeMemoryResource nmr(mpp);                        // Can be used everywhere a MemoryPagePool can.
+//
+class NumaMemoryPagePool : public MemoryPagePoolBase
+{
+ private:
+  // Make sure that the free lists of different nodes do not share a cache line.
+  struct alignas(cache_line_size) Node
+  {
+    SimpleSegregatedStorage sss_;
+    char* begin_;                       // The start of the reserved range of this node.
+    char* committed_end_;               // The end of the part of the range that was added to sss_.
+    char* end_;                         // The end of the reserved range of this node.
+    blocks_t pool_blocks_;              // The number of blocks that were added to sss_ (protected by sss_.add_block_mutex_).
+  };
+
+  unsigned int number_of_nodes_;        // The number of NUMA nodes.
+  std::unique_ptr<Node[]> nodes_;       // The per-node free lists.
+  char* base_;                          // The start of the reserved virtual address space.
+  size_t reserved_size_per_node_;       // The size of the reserved range per node, in bytes (a multiple of block_size_).
+  blocks_t const minimum_chunk_size_;   // The minimum number of blocks added to a node at a time.
+  blocks_t const maximum_chunk_size_;   // The maximum number of blocks added to a node at a time.
+
+  // This runs in the critical area of nodes_[node].sss_.add_block_mutex_.
+  bool add_new_chunk(unsigned int node);
+
+  void* allocate_from_other_nodes(unsigned int node);
+
+  // Return the NUMA node of the CPU that the current thread is running on.
+  unsigned int current_node() const
+  {
+    unsigned int cpu, node;
+    if (AI_UNLIKELY(::getcpu(&cpu, &node) == -1 || node >= number_of_nodes_))
+      return 0;
+    return node;
+  }
+
+  // Return the node that ptr was allocated from.
+  unsigned int node_of(void* ptr) const
+  {
+    // ptr must be a block that was returned by this pool.
+    ASSERT(base_ <= static_cast<char*>(ptr) && static_cast<char*>(ptr) < base_ + number_of_nodes_ * reserved_size_per_node_);
+    return (static_cast<char*>(ptr) - base_) / reserved_size_per_node_;
+  }
+
+ public:
+  static constexpr size_t default_reserved_size_per_node = size_t{16} << 30;    // 16 GiB of virtual address space.
+
+  NumaMemoryPagePool(size_t block_size,                 // The size of a block as returned by allocate(), in bytes;
+                                                        // must be a multiple of the memory page size.
+                     blocks_t minimum_chunk_size = 0,   // A value of 0 uses 2.
+                     blocks_t maximum_chunk_size = 0,   // A value of 0 uses 1024.
+                     size_t reserved_size_per_node = default_reserved_size_per_node);
+  ~NumaMemoryPagePool() override;
+
+  // Return the committed range of every node.
+  std::vector<Region> regions() override;
+
+  void* allocate() override
+  {
+    unsigned int const node = current_node();
+    void* ptr = nodes_[node].sss_.allocate([this, node](){ return add_new_chunk(node); });
+    if (AI_UNLIKELY(ptr == nullptr))
+      ptr = allocate_from_other_nodes(node);
+    if (AI_LIKELY(ptr))
+    {
+      stats_.add(PoolStats::allocations);
+      hardening::unpoison(ptr, block_size_);
+    }
+    return ptr;
+  }
+
+  void deallocate(void* ptr) override
+  {
+    stats_.add(PoolStats::deallocations);
+    hardening::poison_free_block(ptr, block_size_, sizeof(PtrTag::FreeNode));
+    nodes_[node_of(ptr)].sss_.deallocate(ptr);
+  }
+
+  size_t allocate_n(void** ptrs, size_t n) override
+  {
+    unsigned int const node = current_node();
+    size_t count = nodes_[node].sss_.allocate_n(ptrs, n, [this, node](){ return add_new_chunk(node); });
+    // Fall back to allocating one block at a time from the other nodes.
+    while (AI_UNLIKELY(count < n) && (ptrs[count] = allocate_from_other_nodes(node)))
+      ++count;
+    stats_.add(PoolStats::allocations, count);
+    for (size_t i = 0; i < count; ++i)
+      hardening::unpoison(ptrs[i], block_size_);
+    return count;
+  }
+
+  // Accessors.
+  unsigned int number_of_nodes() const { return number_of_nodes_; }
+  blocks_t pool_blocks(unsigned int node) { std::scoped_lock<std::mutex> lock(nodes_[node].sss_.add_block_mutex_); return nodes_[node].pool_blocks_; }
+  blocks_t pool_blocks();
+};
+
+} // namespace memory
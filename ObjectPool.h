@@ -0,0 +1,166 @@
+/**
+ * memory -- C++ Memory utilities
+ *
+ * @file
+ * @brief Definition of class template ObjectPool.
+ *
+ * @Copyright (C) 2026  Carlo Wood.
+ *
+ * pub   dsa3072/C155A4EEE4E527A2 2018-08-16 Carlo Wood (CarloWood on Libera) <carlo@alinoe.com>
+ * fingerprint: 8020 B266 6305 EE2F D53E  6827 C155 A4EE E4E5 27A2
+ *
+ * This file is part of memory.
+ *
+ * memory is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * memory is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with memory.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+#include "SimpleSegregatedStorage.h"
+#include "PoolStats.h"
+#include "Hardening.h"
+#include "utils/macros.h"
+#include <algorithm>
+#include <cstddef>
+#include <cstdlib>
+#include <mutex>
+#include <new>
+#include <utility>
+#include <vector>
+#include "debug.h"
+
+namespace memory {
+
+// class ObjectPool
+//
+// A memory pool for objects of type T, of which the size and alignment are known at compile time.
+//
+// Contrary to NodeMemoryPool and NodeMemoryResource, that only learn the size of the nodes
+// upon the first allocation, the node size, alignment and number of nodes per chunk are
+// constants here. Therefore there is no per-object header, no "allocate the largest size first"
+// rule, and the (lock-free) allocate/deallocate fast path is completely inlined.
+//
+// Every node is aligned to alignof(T), also if that is larger than alignof(std::max_align_t)
+// (the chunks are allocated with std::aligned_alloc).
+//
+// N is the number of objects per chunk (the default makes a chunk roughly 32 kB).
+// Chunks are allocated on demand, and only freed by the destructor of the pool.
+//
+// Usage:
+//
+//   memory::ObjectPool<Foo> pool;
+//
+//   Foo* foo = pool.create(42);        // Allocate memory from the pool and construct a Foo.
+//   pool.destroy(foo);                 // Destruct foo and return its memory to the pool.
+//
+// ObjectPool is thread-safe.
+//
+template<typename T, size_t N = std::max(size_t{2}, size_t{0x8000} / sizeof(T))>
+class ObjectPool
+{
+ public:
+  static constexpr size_t alignment = std::max(alignof(T), alignof(PtrTag::FreeNode));
+  static constexpr size_t node_size = (std::max(sizeof(T), sizeof(PtrTag::FreeNode)) + alignment - 1) & ~(alignment - 1);
+  static constexpr size_t nodes_per_chunk = N;
+  static constexpr size_t chunk_size = N * node_size;
+
+  // SimpleSegregatedStorage::add_block requires at least two nodes per chunk.
+  static_assert(N >= 2, "ObjectPool: N must be at least 2.");
+
+ private:
+  SimpleSegregatedStorage sss_;
+  std::vector<void*> chunks_;           // All allocated chunks (protected by sss_.add_block_mutex_).
+  PoolStats stats_;                     // Allocation statistics.
+
+  // This runs in the critical area of SimpleSegregatedStorage::add_block_mutex_.
+  bool add_new_chunk()
+  {
+    void* chunk = std::aligned_alloc(alignment, chunk_size);
+    if (AI_UNLIKELY(!chunk))
+      return false;
+    chunks_.push_back(chunk);
+    sss_.add_block(chunk, chunk_size, node_size);
+    stats_.add_resident(chunk_size);
+    return true;
+  }
+
+ public:
+  ObjectPool() { sss_.set_stats(&stats_); }
+
+  ObjectPool(ObjectPool const&) = delete;
+  ObjectPool& operator=(ObjectPool const&) = delete;
+
+  // The destructor does not call the destructor of objects that were not destroyed.
+  ~ObjectPool()
+  {
+    std::scoped_lock<std::mutex> lock(sss_.add_block_mutex_);
+    sss_.discard_bump_region();
+    for (void* chunk : chunks_)
+    {
+      hardening::unpoison(chunk, chunk_size);
+      std::free(chunk);
+    }
+  }
+
+  // Return uninitialized memory for one T, or nullptr when out of memory.
+  [[gnu::always_inline]] void* allocate()
+  {
+    void* ptr = sss_.allocate([this](){ return add_new_chunk(); });
+    if (AI_LIKELY(ptr))
+    {
+      stats_.add(PoolStats::allocations);
+      hardening::unpoison(ptr, node_size);
+    }
+    return ptr;
+  }
+
+  // ptr must be a value previously returned by allocate().
+  [[gnu::always_inline]] void deallocate(void* ptr)
+  {
+    stats_.add(PoolStats::deallocations);
+    hardening::poison_free_block(ptr, node_size, sizeof(PtrTag::FreeNode));
+    sss_.deallocate(ptr);
+  }
+
+  // Allocate memory for a T and construct it with args. Throws std::bad_alloc when out of memory.
+  template<typename... Args>
+  T* create(Args&&... args)
+  {
+    void* ptr = allocate();
+    if (AI_UNLIKELY(!ptr))
+      throw std::bad_alloc();
+    try
+    {
+      return new (ptr) T(std::forward<Args>(args)...);
+    }
+    catch (...)
+    {
+      deallocate(ptr);
+      throw;
+    }
+  }
+
+  // Destruct obj and return its memory to the pool. obj must have been returned by create().
+  void destroy(T* obj)
+  {
+    obj->~T();
+    deallocate(obj);
+  }
+
+  // Accessor.
+  PoolStats const& stats() const { return stats_; }
+};
+
+} // namespace memory
@@ -0,0 +1,96 @@
+/**
+ * memory -- C++ Memory utilities
+ *
+ * @file
+ * @brief Declaration of class OffsetPtr.
+ *
+ * @Copyright (C) 2026  Carlo Wood.
+ *
+ * pub   dsa3072/C155A4EEE4E527A2 2018-08-16 Carlo Wood (CarloWood on Libera) <carlo@alinoe.com>
+ * fingerprint: 8020 B266 6305 EE2F D53E  6827 C155 A4EE E4E5 27A2
+ *
+ * This file is part of memory.
+ *
+ * memory is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * memory is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with memory.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <type_traits>
+
+namespace memory {
+
+// class OffsetPtr
+//
+// A position independent pointer: it stores the distance from its own address to the
+// object that it points to. Hence an OffsetPtr that is stored inside a memory mapped
+// file, and points to another object inside that file, remains valid no matter at
+// which address the file is mapped (see MemoryMappedPool with offset_links).
+//
+// A distance of zero encodes nullptr; therefore an OffsetPtr can not point to itself.
+// Copying an OffsetPtr recalculates the distance for the address of the copy, so it is
+// not trivially copyable: do not memcpy it to a different address.
+//
+// Usage:
+//
+//   struct Node { memory::OffsetPtr<Node> next; int value; };
+//   Node* node = static_cast<Node*>(mmp.allocate());
+//   node->next = other_node;                           // Implicit conversion from Node*.
+//   Node* next = node->next.get();
+//
+template<typename T>
+class OffsetPtr
+{
+ private:
+  std::ptrdiff_t offset_;               // The distance from this to the object, in bytes; zero means nullptr.
+
+  std::ptrdiff_t offset_to(T const* ptr) const
+  {
+    return ptr ? reinterpret_cast<std::intptr_t>(ptr) - reinterpret_cast<std::intptr_t>(this) : 0;
+  }
+
+ public:
+  using element_type = T;
+
+  OffsetPtr() : offset_(0) { }
+  OffsetPtr(std::nullptr_t) : offset_(0) { }
+  OffsetPtr(T* ptr) : offset_(offset_to(ptr)) { }
+  OffsetPtr(OffsetPtr const& other) : offset_(offset_to(other.get())) { }
+
+  // Allow conversion from an OffsetPtr to a derived class.
+  template<typename U>
+  requires std::is_convertible_v<U*, T*>
+  OffsetPtr(OffsetPtr<U> const& other) : offset_(offset_to(other.get())) { }
+
+  OffsetPtr& operator=(OffsetPtr const& other) { offset_ = offset_to(other.get()); return *this; }
+  OffsetPtr& operator=(T* ptr) { offset_ = offset_to(ptr); return *this; }
+  OffsetPtr& operator=(std::nullptr_t) { offset_ = 0; return *this; }
+
+  T* get() const
+  {
+    return offset_ ? reinterpret_cast<T*>(reinterpret_cast<std::intptr_t>(this) + offset_) : nullptr;
+  }
+
+  T& operator*() const { return *get(); }
+  T* operator->() const { return get(); }
+  explicit operator bool() const { return offset_ != 0; }
+
+  friend bool operator==(OffsetPtr const& lhs, OffsetPtr const& rhs) { return lhs.get() == rhs.get(); }
+  friend bool operator==(OffsetPtr const& lhs, T const* rhs) { return lhs.get() == rhs; }
+  friend bool operator==(OffsetPtr const& lhs, std::nullptr_t) { return lhs.offset_ == 0; }
+};
+
+} // namespace memory
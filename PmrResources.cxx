@@ -0,0 +1,83 @@
+/**
+ * memory -- C++ Memory utilities
+ *
+ * @file
+ * @brief Definition of the std::pmr::memory_resource adaptors.
+ *
+ * @Copyright (C) 2026  Carlo Wood.
+ *
+ * pub   dsa3072/C155A4EEE4E527A2 2018-08-16 Carlo Wood (CarloWood on Libera) <carlo@alinoe.com>
+ * fingerprint: 8020 B266 6305 EE2F D53E  6827 C155 A4EE E4E5 27A2
+ *
+ * This file is part of memory.
+ *
+ * memory is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * memory is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with memory.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "sys.h"
+#include "PmrResources.h"
+
+namespace memory {
+
+namespace {
+
+// DequeMemoryResource requires at least the minimal deque map size (8 pointers).
+constexpr size_t deque_minimum_size = 8 * sizeof(void*);
+
+// DequeMemoryResource expects a whole number of pointers (it rounds down); round bytes up to that.
+constexpr size_t deque_size(size_t bytes)
+{
+  return std::max((bytes + sizeof(void*) - 1) & ~(sizeof(void*) - 1), deque_minimum_size);
+}
+
+} // namespace
+
+void* PmrDequeResource::do_allocate(size_t bytes, size_t alignment)
+{
+  if (AI_UNLIKELY(bytes > dmr_.upper_size() || alignment > alignof(void*)))
+    return upstream_->allocate(bytes, alignment);
+  return check(dmr_.allocate(deque_size(bytes)));
+}
+
+void PmrDequeResource::do_deallocate(void* ptr, size_t bytes, size_t alignment)
+{
+  if (AI_UNLIKELY(bytes > dmr_.upper_size() || alignment > alignof(void*)))
+    upstream_->deallocate(ptr, bytes, alignment);
+  else
+    dmr_.deallocate(ptr, deque_size(bytes));
+}
+
+PmrSizeClassResource::PmrSizeClassResource(MemoryPagePoolBase& mpp, std::pmr::memory_resource* upstream, unsigned int magazine_size) :
+  PmrResourceBase(upstream)
+{
+  DoutEntering(dc::notice, "PmrSizeClassResource::PmrSizeClassResource({" << (void*)&mpp << "}, " << upstream << ", " << magazine_size << ") [" << this << "]");
+
+  // Use power-of-two size classes up till the largest size that still fits minimum_blocks_per_chunk times in a block of mpp.
+  // Because the blocks of mpp are aligned to the memory page size, each size class is naturally aligned to its size
+  // (or the memory page size, whichever is smaller).
+  size_t const largest_size = std::min(mpp.block_size() / minimum_blocks_per_chunk, MemoryPagePoolBase::memory_page_size());
+  // The block size of mpp must allow at least one size class.
+  ASSERT(largest_size >= smallest_size_class);
+  number_of_size_classes_ = std::min(utils::log2(largest_size) - utils::log2(smallest_size_class) + 1, max_number_of_size_classes);
+  largest_size_class_ = smallest_size_class << (number_of_size_classes_ - 1);
+  for (int index = 0; index < number_of_size_classes_; ++index)
+  {
+    size_t const block_size = smallest_size_class << index;
+    // Size classes that are too small for a magazine node are not cached.
+    node_memory_resources_[index].init(&mpp, block_size, block_size >= MagazineCache::minimum_node_size ? magazine_size : 0);
+  }
+  Dout(dc::notice, "Using " << number_of_size_classes_ << " size classes; the largest size class is " << largest_size_class_ << " bytes.");
+}
+
+} // namespace memory
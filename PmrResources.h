@@ -0,0 +1,236 @@
+/**
+ * memory -- C++ Memory utilities
+ *
+ * @file
+ * @brief Declaration of the std::pmr::memory_resource adaptors.
+ *
+ * @Copyright (C) 2026  Carlo Wood.
+ *
+ * pub   dsa3072/C155A4EEE4E527A2 2018-08-16 Carlo Wood (CarloWood on Libera) <carlo@alinoe.com>
+ * fingerprint: 8020 B266 6305 EE2F D53E  6827 C155 A4EE E4E5 27A2
+ *
+ * This file is part of memory.
+ *
+ * memory is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * memory is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with memory.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "Arena.h"
+#include "NodeMemoryResource.h"
+#include "DequeMemoryResource.h"
+#include <algorithm>
+#include <array>
+#include <memory_resource>
+#include "debug.h"
+
+namespace memory {
+
+// The std::pmr::memory_resource adaptors.
+//
+// These classes make the pools of this library usable with std::pmr containers
+// (std::pmr::vector, std::pmr::unordered_map, std::pmr::string, etc).
+//
+// Each adaptor routes a request either to the wrapped pool, or to an upstream
+// std::pmr::memory_resource (by default std::pmr::get_default_resource()) when the
+// pool can not serve the requested size or alignment. Because the routing decision
+// only depends on the size and alignment, which std::pmr passes to both allocate and
+// deallocate, memory is always returned to where it came from.
+//
+//   PmrNodeResource      : wraps a NodeMemoryResource; serves requests of at most its block size.
+//   PmrPageResource      : wraps a MemoryPagePoolBase (MemoryPagePool, MemoryMappedPool, NumaMemoryPagePool, ...);
+//                          serves requests of at most its block size.
+//   PmrDequeResource     : wraps a DequeMemoryResource (by default DequeMemoryResource::s_instance);
+//                          serves the (pointer aligned) requests of at most its upper_size().
+//   PmrSizeClassResource : owns a NodeMemoryResource per power-of-two size class on top of a MemoryPagePoolBase;
+//                          this is the one to use for general purpose containers.
+//   PmrArenaResource     : wraps an Arena; deallocate does nothing, the memory is released by Arena::rewind or Arena::reset.
+//
+// The pools never return nullptr to a std::pmr container: if the pool is out of memory, std::bad_alloc is thrown.
+//
+// Usage:
+//
+//   memory::MemoryPagePool mpp(0x8000);
+//   memory::PmrSizeClassResource resource(mpp);
+//   std::pmr::vector<int> v(&resource);
+//   std::pmr::unordered_map<int, std::pmr::string> m(&resource);
+//
+class PmrResourceBase : public std::pmr::memory_resource
+{
+ protected:
+  std::pmr::memory_resource* upstream_;         // Used for requests that the wrapped pool can't serve.
+
+  PmrResourceBase(std::pmr::memory_resource* upstream) : upstream_(upstream) { }
+
+  // All adaptors route to a specific pool instance; therefore only the same object can deallocate memory allocated by it.
+  bool do_is_equal(std::pmr::memory_resource const& other) const noexcept override { return this == &other; }
+
+  // Throw std::bad_alloc if ptr is nullptr.
+  static void* check(void* ptr)
+  {
+    if (AI_UNLIKELY(ptr == nullptr))
+      throw std::bad_alloc();
+    return ptr;
+  }
+
+ public:
+  // Accessor.
+  std::pmr::memory_resource* upstream_resource() const { return upstream_; }
+};
+
+// Return the alignment that is guaranteed for blocks of `block_size` bytes that are
+// carved from a chunk that is aligned to `chunk_alignment` (a power of two).
+constexpr size_t block_alignment(size_t block_size, size_t chunk_alignment)
+{
+  return std::min(block_size & -block_size, chunk_alignment);
+}
+
+class PmrNodeResource : public PmrResourceBase
+{
+ private:
+  NodeMemoryResource& nmr_;
+  size_t const block_size_;             // A copy of nmr_.block_size().
+  size_t const alignment_;              // The alignment of the blocks returned by nmr_.
+
+ public:
+  // The block size of nmr must already be known (passed to its constructor or init()).
+  PmrNodeResource(NodeMemoryResource& nmr, std::pmr::memory_resource* upstream = std::pmr::get_default_resource()) :
+    PmrResourceBase(upstream), nmr_(nmr), block_size_(nmr.block_size()),
+    alignment_(block_alignment(block_size_, MemoryPagePoolBase::memory_page_size()))
+  {
+    // The block size of nmr must be known.
+    ASSERT(block_size_ > 0);
+  }
+
+ protected:
+  void* do_allocate(size_t bytes, size_t alignment) override
+  {
+    if (AI_UNLIKELY(bytes > block_size_ || alignment > alignment_))
+      return upstream_->allocate(bytes, alignment);
+    return check(nmr_.allocate(block_size_));
+  }
+
+  void do_deallocate(void* ptr, size_t bytes, size_t alignment) override
+  {
+    if (AI_UNLIKELY(bytes > block_size_ || alignment > alignment_))
+      upstream_->deallocate(ptr, bytes, alignment);
+    else
+      nmr_.deallocate(ptr);
+  }
+};
+
+class PmrPageResource : public PmrResourceBase
+{
+ private:
+  MemoryPagePoolBase& mpp_;
+
+ public:
+  PmrPageResource(MemoryPagePoolBase& mpp, std::pmr::memory_resource* upstream = std::pmr::get_default_resource()) :
+    PmrResourceBase(upstream), mpp_(mpp) { }
+
+ protected:
+  void* do_allocate(size_t bytes, size_t alignment) override
+  {
+    if (AI_UNLIKELY(bytes > mpp_.block_size() || alignment > MemoryPagePoolBase::memory_page_size()))
+      return upstream_->allocate(bytes, alignment);
+    return check(mpp_.allocate());
+  }
+
+  void do_deallocate(void* ptr, size_t bytes, size_t alignment) override
+  {
+    if (AI_UNLIKELY(bytes > mpp_.block_size() || alignment > MemoryPagePoolBase::memory_page_size()))
+      upstream_->deallocate(ptr, bytes, alignment);
+    else
+      mpp_.deallocate(ptr);
+  }
+};
+
+class PmrDequeResource : public PmrResourceBase
+{
+ private:
+  DequeMemoryResource& dmr_;
+
+ public:
+  PmrDequeResource(std::pmr::memory_resource* upstream = std::pmr::get_default_resource(),
+      DequeMemoryResource& dmr = DequeMemoryResource::s_instance) : PmrResourceBase(upstream), dmr_(dmr) { }
+
+ protected:
+  void* do_allocate(size_t bytes, size_t alignment) override;
+  void do_deallocate(void* ptr, size_t bytes, size_t alignment) override;
+};
+
+class PmrSizeClassResource : public PmrResourceBase
+{
+ public:
+  static constexpr size_t smallest_size_class = sizeof(PtrTag::FreeNode);
+  static constexpr int max_number_of_size_classes = 16;         // 8 bytes ... 256 kB.
+
+ private:
+  std::array<NodeMemoryResource, max_number_of_size_classes> node_memory_resources_;
+  int number_of_size_classes_;          // The number of elements of node_memory_resources_ that are in use.
+  size_t largest_size_class_;           // The block size of node_memory_resources_[number_of_size_classes_ - 1].
+
+  // Return the index into node_memory_resources_ for a request of bytes with the given alignment.
+  static int size_class(size_t bytes, size_t alignment)
+  {
+    size_t const size = std::max({bytes, alignment, smallest_size_class});
+    return utils::ceil_log2(size) - utils::log2(smallest_size_class);
+  }
+
+ public:
+  // Blocks larger than mpp.block_size() / minimum_blocks_per_chunk are allocated from upstream.
+  static constexpr size_t minimum_blocks_per_chunk = 4;
+
+  PmrSizeClassResource(MemoryPagePoolBase& mpp, std::pmr::memory_resource* upstream = std::pmr::get_default_resource(),
+      unsigned int magazine_size = 0);
+
+ protected:
+  void* do_allocate(size_t bytes, size_t alignment) override
+  {
+    if (AI_UNLIKELY(bytes > largest_size_class_ || alignment > largest_size_class_))
+      return upstream_->allocate(bytes, alignment);
+    int const index = size_class(bytes, alignment);
+    return check(node_memory_resources_[index].allocate(smallest_size_class << index));
+  }
+
+  void do_deallocate(void* ptr, size_t bytes, size_t alignment) override
+  {
+    if (AI_UNLIKELY(bytes > largest_size_class_ || alignment > largest_size_class_))
+      upstream_->deallocate(ptr, bytes, alignment);
+    else
+      node_memory_resources_[size_class(bytes, alignment)].deallocate(ptr);
+  }
+};
+
+class PmrArenaResource : public PmrResourceBase
+{
+ private:
+  Arena& arena_;
+
+ public:
+  // The Arena serves all requests itself (also the large ones), so there is no upstream resource.
+  PmrArenaResource(Arena& arena) : PmrResourceBase(std::pmr::null_memory_resource()), arena_(arena) { }
+
+ protected:
+  void* do_allocate(size_t bytes, size_t alignment) override
+  {
+    return check(arena_.allocate(bytes, alignment));
+  }
+
+  void do_deallocate(void* UNUSED_ARG(ptr), size_t UNUSED_ARG(bytes), size_t UNUSED_ARG(alignment)) override
+  {
+  }
+};
+
+} // namespace memory
@@ -0,0 +1,124 @@
+/**
+ * memory -- C++ Memory utilities
+ *
+ * @file
+ * @brief Definition of class PoolStats.
+ *
+ * @Copyright (C) 2026  Carlo Wood.
+ *
+ * pub   dsa3072/C155A4EEE4E527A2 2018-08-16 Carlo Wood (CarloWood on Libera) <carlo@alinoe.com>
+ * fingerprint: 8020 B266 6305 EE2F D53E  6827 C155 A4EE E4E5 27A2
+ *
+ * This file is part of memory.
+ *
+ * memory is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * memory is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with memory.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "sys.h"
+#include "PoolStats.h"
+#include <ostream>
+#include "debug.h"
+
+namespace memory {
+
+namespace {
+
+struct CounterInfo
+{
+  char const* name;     // The name of the Prometheus metric, without the "memory_pool_" prefix.
+  char const* help;
+};
+
+constexpr std::array<CounterInfo, PoolStats::number_of_counters> counter_info = {{
+  { "allocations_total", "Number of blocks allocated." },
+  { "deallocations_total", "Number of blocks deallocated." },
+  { "refills_total", "Number of times that memory was added to the pool." },
+  { "cas_retries_total", "Number of failed compare-and-exchanges on a free list head." },
+  { "lock_wait_nanoseconds_total", "Time spent waiting for a contended mutex." }
+}};
+
+} // namespace
+
+PoolStats::~PoolStats()
+{
+  // Use exchange, so that a (late) add() from another thread allocates a new group instead of using a deleted one.
+  for (std::atomic<Group*>& group : groups_)
+    delete group.exchange(nullptr, std::memory_order_acquire);
+}
+
+PoolStats::Group* PoolStats::create_group(ThreadIndex::index_type group_index)
+{
+  Group* group = new Group;
+  Group* expected = nullptr;
+  if (!groups_[group_index].compare_exchange_strong(expected, group, std::memory_order_acq_rel, std::memory_order_acquire))
+  {
+    // Another thread of the same group was first.
+    delete group;
+    return expected;
+  }
+  return group;
+}
+
+PoolStats::Snapshot PoolStats::snapshot() const
+{
+  Snapshot snapshot;
+  for (std::atomic<Group*> const& group_ptr : groups_)
+  {
+    Group const* group = group_ptr.load(std::memory_order_acquire);
+    if (!group)
+      continue;
+    for (Slot const& slot : group->slots_)
+      for (int counter = 0; counter < number_of_counters; ++counter)
+        snapshot.counters[counter] += slot.counters_[counter].load(std::memory_order_relaxed);
+  }
+  for (int counter = 0; counter < number_of_counters; ++counter)
+    snapshot.counters[counter] += shared_counters_[counter].load(std::memory_order_relaxed);
+  snapshot.resident_bytes = resident_bytes_.load(std::memory_order_relaxed);
+  return snapshot;
+}
+
+PoolStats::Snapshot& PoolStats::Snapshot::operator+=(Snapshot const& snapshot)
+{
+  for (int counter = 0; counter < number_of_counters; ++counter)
+    counters[counter] += snapshot.counters[counter];
+  resident_bytes += snapshot.resident_bytes;
+  return *this;
+}
+
+void PoolStats::Snapshot::write_prometheus(std::ostream& os, std::string_view pool_name) const
+{
+  for (int counter = 0; counter < number_of_counters; ++counter)
+  {
+    os << "# HELP memory_pool_" << counter_info[counter].name << ' ' << counter_info[counter].help << '\n';
+    os << "# TYPE memory_pool_" << counter_info[counter].name << " counter\n";
+    os << "memory_pool_" << counter_info[counter].name << "{pool=\"" << pool_name << "\"} " << counters[counter] << '\n';
+  }
+  os << "# HELP memory_pool_resident_bytes Memory currently owned by the pool.\n";
+  os << "# TYPE memory_pool_resident_bytes gauge\n";
+  os << "memory_pool_resident_bytes{pool=\"" << pool_name << "\"} " << resident_bytes << '\n';
+}
+
+std::ostream& operator<<(std::ostream& os, PoolStats::Snapshot const& snapshot)
+{
+  os << "allocations: " << snapshot[PoolStats::allocations] <<
+      "; deallocations: " << snapshot[PoolStats::deallocations] <<
+      "; refills: " << snapshot[PoolStats::refills] <<
+      "; CAS retries: " << snapshot[PoolStats::cas_retries] <<
+      "; lock wait: " << snapshot[PoolStats::lock_wait_ns] << " ns" <<
+      "; resident: " << snapshot.resident_bytes << " bytes";
+  return os;
+}
+
+} // namespace memory
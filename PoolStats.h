@@ -0,0 +1,164 @@
+/**
+ * memory -- C++ Memory utilities
+ *
+ * @file
+ * @brief Declaration of class PoolStats.
+ *
+ * @Copyright (C) 2026  Carlo Wood.
+ *
+ * pub   dsa3072/C155A4EEE4E527A2 2018-08-16 Carlo Wood (CarloWood on Libera) <carlo@alinoe.com>
+ * fingerprint: 8020 B266 6305 EE2F D53E  6827 C155 A4EE E4E5 27A2
+ *
+ * This file is part of memory.
+ *
+ * memory is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * memory is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with memory.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+#include "CacheLine.h"
+#include "ThreadIndex.h"
+#include "utils/macros.h"
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <iosfwd>
+#include <mutex>
+#include <string_view>
+
+namespace memory {
+
+// class PoolStats
+//
+// Always-on allocation statistics of a pool.
+//
+// Every thread (with a ThreadIndex less than max_threads) has its own cache line sized slot
+// of counters, which only that thread writes to: incrementing a counter is a relaxed load and
+// store, not a locked read-modify-write. The slots are allocated on first use, in groups of
+// slots_per_group threads, so that a pool that is used by few threads costs little memory.
+// Threads with a larger index share one set of counters, that is incremented with fetch_add.
+// The hot path does not take any lock and never writes to memory that is used by other threads.
+//
+// Reading the statistics is done with snapshot(), which sums the slots. Because the
+// counters are read one by one while other threads might be adding to them, a snapshot
+// is not an atomic picture of the whole pool; every individual counter is exact however
+// and monotonically increasing (except resident_bytes, which is a gauge).
+//
+// Usage:
+//
+//   memory::PoolStats::Snapshot snapshot = pool.stats().snapshot();
+//   snapshot.write_prometheus(std::cout, "my_pool");
+//
+class PoolStats
+{
+ public:
+  static constexpr ThreadIndex::index_type max_threads = 64;            // The number of threads that have their own slot.
+  static constexpr ThreadIndex::index_type slots_per_group = 8;         // The number of slots that are allocated at once.
+
+  enum counter_type
+  {
+    allocations,        // Number of blocks returned by allocate.
+    deallocations,      // Number of blocks passed to deallocate.
+    refills,            // Number of times that memory was added to the pool (e.g. by try_allocate_more).
+    cas_retries,        // Number of failed compare-and-exchanges on the head of a free list.
+    lock_wait_ns,       // Total time spent waiting for a contended mutex, in nanoseconds.
+    number_of_counters
+  };
+
+  struct Snapshot
+  {
+    std::array<uint64_t, number_of_counters> counters{};
+    int64_t resident_bytes{};           // Memory currently owned by the pool, in bytes.
+
+    uint64_t operator[](counter_type counter) const { return counters[counter]; }
+    uint64_t in_use() const { return counters[allocations] - counters[deallocations]; }
+
+    // Accumulate the statistics of another pool; for example of the shards of a sharded pool.
+    Snapshot& operator+=(Snapshot const& snapshot);
+
+    // Write the snapshot in the Prometheus text exposition format, labeled with pool="pool_name".
+    void write_prometheus(std::ostream& os, std::string_view pool_name) const;
+
+    friend std::ostream& operator<<(std::ostream& os, Snapshot const& snapshot);
+  };
+
+ private:
+  using counters_type = std::array<std::atomic<uint64_t>, number_of_counters>;
+
+  // The counters of one thread. Because a ThreadIndex is only reused after the thread that had it
+  // exited (which synchronizes with the thread that gets it next), only one thread at a time writes to a slot.
+  struct alignas(cache_line_size) Slot
+  {
+    counters_type counters_{};
+  };
+
+  struct Group
+  {
+    std::array<Slot, slots_per_group> slots_;
+  };
+
+  std::array<std::atomic<Group*>, max_threads / slots_per_group> groups_{};     // Allocated on first use.
+  counters_type shared_counters_{};     // The counters of the threads with an index of max_threads or larger.
+  std::atomic<int64_t> resident_bytes_{};
+
+  // Allocate groups_[group_index] (if another thread didn't do so already) and return it.
+  [[gnu::noinline]] Group* create_group(ThreadIndex::index_type group_index);
+
+ public:
+  PoolStats() = default;
+  PoolStats(PoolStats const&) = delete;
+  ~PoolStats();
+
+  // Add n to the counter of the current thread.
+  void add(counter_type counter, uint64_t n = 1)
+  {
+    ThreadIndex::index_type const index = ThreadIndex::get();
+    if (AI_UNLIKELY(index >= max_threads))
+    {
+      shared_counters_[counter].fetch_add(n, std::memory_order_relaxed);
+      return;
+    }
+    Group* group = groups_[index / slots_per_group].load(std::memory_order_acquire);
+    if (AI_UNLIKELY(!group))
+      group = create_group(index / slots_per_group);
+    std::atomic<uint64_t>& count = group->slots_[index % slots_per_group].counters_[counter];
+    // We are the only thread that writes to this slot.
+    count.store(count.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+  }
+
+  // Add bytes (which may be negative) to the resident memory of the pool. This is not on the hot path.
+  void add_resident(int64_t bytes) { resident_bytes_.fetch_add(bytes, std::memory_order_relaxed); }
+  void set_resident(int64_t bytes) { resident_bytes_.store(bytes, std::memory_order_relaxed); }
+
+  // Lock mutex and, if it was contended, add the time that was waited to lock_wait_ns.
+  template<class Mutex>
+  std::unique_lock<Mutex> lock(Mutex& mutex)
+  {
+    std::unique_lock<Mutex> lock(mutex, std::try_to_lock);
+    if (AI_UNLIKELY(!lock.owns_lock()))
+    {
+      auto const start = std::chrono::steady_clock::now();
+      lock.lock();
+      add(lock_wait_ns, std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count());
+    }
+    return lock;
+  }
+
+  // Return the sum of all slots.
+  Snapshot snapshot() const;
+};
+
+} // namespace memory
@@ -0,0 +1,61 @@
+/**
+ * memory -- C++ Memory utilities
+ *
+ * @file
+ * @brief Definition of preemption_point(), a hook for stress testing the lock-free free lists.
+ *
+ * @Copyright (C) 2026  Carlo Wood.
+ *
+ * pub   dsa3072/C155A4EEE4E527A2 2018-08-16 Carlo Wood (CarloWood on Libera) <carlo@alinoe.com>
+ * fingerprint: 8020 B266 6305 EE2F D53E  6827 C155 A4EE E4E5 27A2
+ *
+ * This file is part of memory.
+ *
+ * memory is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * memory is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with memory.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+#include <atomic>
+
+// Forced preemption points in the lock-free algorithms.
+//
+// The window between reading the head of a lock-free free list (and the next pointer of
+// the node that it points to) and the compare-and-exchange that replaces the head is only
+// a few instructions long, which makes races in it very unlikely to happen in a test.
+//
+// When configured with -DMEMORY_PREEMPTION_POINTS=ON (which defines MEMORY_PREEMPTION_POINTS)
+// preemption_point() is called right before every compare-and-exchange of a free list head
+// (SimpleSegregatedStorageBase, MappedSegregatedStorage and MagazineCache), and calls
+// preemption_point_hook if that is set. A stress test can set the hook to a function that
+// randomly yields or sleeps, to widen the window (see benchmarks/memory_stress.cxx).
+//
+// Otherwise preemption_point() does nothing.
+//
+namespace memory {
+
+#ifdef MEMORY_PREEMPTION_POINTS
+inline std::atomic<void (*)()> preemption_point_hook{nullptr};
+#endif
+
+[[gnu::always_inline]] inline void preemption_point()
+{
+#ifdef MEMORY_PREEMPTION_POINTS
+  if (auto hook = preemption_point_hook.load(std::memory_order_relaxed))
+    hook();
+#endif
+}
+
+} // namespace memory
@@ -27,10 +27,30 @@
 
 #pragma once
 
+#include "Hardening.h"
 #include "utils/macros.h"
+#include <atomic>
+#include <bit>
 #include <cstdint>
 #include "debug.h"
 
+// The representation of PtrTag is selected at configure time (cmake -DMEMORY_PTR_TAG=...):
+//
+//   low_bits     : The tag is stored in the lower two bits of the pointer, that are zero
+//                  because of its alignment. Cheap, but the tag wraps around after four
+//                  allocations from the same head, which makes allocate() vulnerable to ABA
+//                  when a thread is preempted for a long time in the middle of an allocation.
+//   high_bits    : Additionally store 16 bits of the tag in the upper (unused) 16 bits of a 64-bit pointer,
+//                  for a total of 18 bits. Requires that all free list nodes have an address below 2^48,
+//                  which is the case for user space on x86_64 and aarch64 (unless a mapping above
+//                  that address was explicitly requested with 5-level page tables).
+//   double_width : Store a full 64-bit counter next to the pointer and use a double-width CAS
+//                  (cmpxchg16b on x86_64); compile with -mcx16 and link with libatomic.
+//
+#if defined(MEMORY_PTR_TAG_DOUBLE_WIDTH) && defined(MEMORY_PTR_TAG_HIGH_BITS)
+#error "Define at most one of MEMORY_PTR_TAG_DOUBLE_WIDTH and MEMORY_PTR_TAG_HIGH_BITS."
+#endif
+
 namespace memory {
 
 struct PtrTag
@@ -39,33 +59,114 @@ struct PtrTag
   struct FreeNode
   {
     FreeNode* next_;    // Points to the next free node, nullptr (the meaning of which depends on PtrTag).
+                        // If MEMORY_HARDENED is defined then SimpleSegregatedStorage stores this pointer mangled:
+                        // use next() and set_next() (MappedSegregatedStorage uses link() and set_link(), unmangled).
+                        //
+                        // The free lists read next_ of the node at the head while another thread might just have
+                        // allocated that node and be writing to it; the value is discarded by the failing CAS.
+                        // Therefore all accesses to next_ are (relaxed) atomic.
+
+    FreeNode* link() const
+    {
+      return std::atomic_ref<FreeNode*>(const_cast<FreeNode*&>(next_)).load(std::memory_order_relaxed);
+    }
+
+    void set_link(FreeNode* link)
+    {
+      std::atomic_ref<FreeNode*>(next_).store(link, std::memory_order_relaxed);
+    }
+
+    FreeNode* next() const
+    {
+      if constexpr (hardening::enabled)
+        return reinterpret_cast<FreeNode*>(hardening::mangle(&next_, reinterpret_cast<std::uintptr_t>(link())));
+      else
+        return link();
+    }
+
+    void set_next(FreeNode* next)
+    {
+      if constexpr (hardening::enabled)
+        set_link(reinterpret_cast<FreeNode*>(hardening::mangle(&next_, reinterpret_cast<std::uintptr_t>(next))));
+      else
+        set_link(next);
+    }
+
+    // Return true if node is not properly aligned (which means that the free list is corrupt).
+    static bool is_misaligned(FreeNode const* node) { return reinterpret_cast<std::uintptr_t>(node) & (alignof(FreeNode) - 1); }
   };
 
-  std::uintptr_t encoded_;
+  using tag_type = std::uintptr_t;
+#ifdef MEMORY_PTR_TAG_DOUBLE_WIDTH
+  using encoded_type = unsigned __int128;
+#else
+  using encoded_type = std::uintptr_t;
+#endif
+
+  encoded_type encoded_;
+
+#if defined(MEMORY_PTR_TAG_DOUBLE_WIDTH)
+  static constexpr int tag_shift = 64;
+  static constexpr encoded_type ptr_mask = ~std::uintptr_t{0};
+#else
+  static constexpr std::uintptr_t low_tag_mask = 0x3;
+#if defined(MEMORY_PTR_TAG_HIGH_BITS)
+  static_assert(sizeof(std::uintptr_t) == 8, "MEMORY_PTR_TAG_HIGH_BITS requires 64-bit pointers.");
+  static constexpr int high_tag_shift = 48;
+  static constexpr std::uintptr_t high_tag_mask = ~std::uintptr_t{0} << high_tag_shift;
+  static constexpr std::uintptr_t ptr_mask = ~(high_tag_mask | low_tag_mask);
+#else
+  static constexpr std::uintptr_t ptr_mask = ~low_tag_mask;
+#endif
+#endif
+
+  // The encoding of an empty list (with a tag of zero).
+  // Use is_end_of_list() to test if a list is empty: an empty list can have any tag.
+  static constexpr encoded_type end_of_list = 0;
+
+  static constexpr encoded_type encode(void* ptr, tag_type tag)
+  {
+    std::uintptr_t const p = std::bit_cast<std::uintptr_t>(ptr);
+#if defined(MEMORY_PTR_TAG_DOUBLE_WIDTH)
+    return (encoded_type{tag} << tag_shift) | p;
+#else
+    // ptr must be aligned (and below 2^48 in the case of MEMORY_PTR_TAG_HIGH_BITS).
+    ASSERT((p & ~ptr_mask) == 0);
+#if defined(MEMORY_PTR_TAG_HIGH_BITS)
+    return p | (tag & low_tag_mask) | ((tag >> 2) << high_tag_shift);
+#else
+    return p | (tag & low_tag_mask);
+#endif
+#endif
+  }
 
-  static constexpr std::uintptr_t tag_mask = 0x3;
-  static constexpr std::uintptr_t ptr_mask = ~tag_mask;
-  static constexpr std::uintptr_t end_of_list = tag_mask;
+  FreeNode* ptr() const { return reinterpret_cast<FreeNode*>(static_cast<std::uintptr_t>(encoded_ & ptr_mask)); }
 
-  static constexpr std::uintptr_t encode(void* ptr, uint32_t tag)
+  tag_type tag() const
   {
-    return std::bit_cast<std::uintptr_t>(ptr) | (tag & tag_mask);
+#if defined(MEMORY_PTR_TAG_DOUBLE_WIDTH)
+    return static_cast<tag_type>(encoded_ >> tag_shift);
+#elif defined(MEMORY_PTR_TAG_HIGH_BITS)
+    return (encoded_ & low_tag_mask) | ((encoded_ >> high_tag_shift) << 2);
+#else
+    return encoded_ & low_tag_mask;
+#endif
   }
 
-  FreeNode* ptr() const { return reinterpret_cast<FreeNode*>(encoded_ & ptr_mask); }
-  std::uintptr_t tag() const { return encoded_ & tag_mask; }
+  bool is_end_of_list() const { return ptr() == nullptr; }
 
-  PtrTag(std::uintptr_t encoded) : encoded_(encoded) { }
-  PtrTag(FreeNode* node, std::uintptr_t tag) : encoded_(node ? PtrTag::encode(node, tag) : end_of_list) { }
+  PtrTag(encoded_type encoded) : encoded_(encoded) { }
+  // Passing nullptr for node results in an empty list that remembers the tag.
+  PtrTag(FreeNode* node, tag_type tag) : encoded_(PtrTag::encode(node, tag)) { }
 
   PtrTag next() const
   {
     FreeNode* front_node = ptr();
-    FreeNode* second_node = front_node->next_;
+    FreeNode* second_node = front_node->next();
     return {second_node, tag() + 1};
   }
 
-  bool operator!=(std::uintptr_t encoded) const { return encoded_ != encoded; }
+  bool operator!=(encoded_type encoded) const { return encoded_ != encoded; }
 };
 
 } // namespace memory
@@ -0,0 +1,63 @@
+/**
+ * memory -- C++ Memory utilities
+ *
+ * @file
+ * @brief Definition of class ShardedNodeMemoryPool.
+ *
+ * @Copyright (C) 2026  Carlo Wood.
+ *
+ * pub   dsa3072/C155A4EEE4E527A2 2018-08-16 Carlo Wood (CarloWood on Libera) <carlo@alinoe.com>
+ * fingerprint: 8020 B266 6305 EE2F D53E  6827 C155 A4EE E4E5 27A2
+ *
+ * This file is part of memory.
+ *
+ * memory is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * memory is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with memory.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "sys.h"
+#include "ShardedNodeMemoryPool.h"
+#include <algorithm>
+#include <ostream>
+#include <thread>
+#include "debug.h"
+
+namespace memory {
+
+ShardedNodeMemoryPool::ShardedNodeMemoryPool(int nchunks, size_t chunk_size, unsigned int number_of_shards)
+{
+  if (number_of_shards == 0)
+    number_of_shards = std::max(1U, std::thread::hardware_concurrency());
+  DoutEntering(dc::notice, "ShardedNodeMemoryPool::ShardedNodeMemoryPool(" << nchunks << ", " << chunk_size << ", " << number_of_shards << ") [" << this << "]");
+  shards_.reserve(number_of_shards);
+  for (unsigned int i = 0; i < number_of_shards; ++i)
+    shards_.emplace_back(new Shard(nchunks, chunk_size));
+}
+
+PoolStats::Snapshot ShardedNodeMemoryPool::stats() const
+{
+  PoolStats::Snapshot snapshot;
+  for (auto const& shard : shards_)
+    snapshot += shard->stats().snapshot();
+  return snapshot;
+}
+
+std::ostream& operator<<(std::ostream& os, ShardedNodeMemoryPool const& pool)
+{
+  os << "ShardedNodeMemoryPool with " << pool.shards_.size() << " shards:";
+  for (auto const& shard : pool.shards_)
+    os << "\n  " << *shard;
+  return os;
+}
+
+} // namespace memory
@@ -0,0 +1,116 @@
+/**
+ * memory -- C++ Memory utilities
+ *
+ * @file
+ * @brief Declaration of class ShardedNodeMemoryPool.
+ *
+ * @Copyright (C) 2026  Carlo Wood.
+ *
+ * pub   dsa3072/C155A4EEE4E527A2 2018-08-16 Carlo Wood (CarloWood on Libera) <carlo@alinoe.com>
+ * fingerprint: 8020 B266 6305 EE2F D53E  6827 C155 A4EE E4E5 27A2
+ *
+ * This file is part of memory.
+ *
+ * memory is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * memory is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with memory.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "NodeMemoryPool.h"
+#include "ThreadIndex.h"
+#include "utils/macros.h"
+#include <iosfwd>
+#include <memory>
+#include <vector>
+#include "debug.h"
+
+namespace memory {
+class ShardedNodeMemoryPool;
+} // namespace memory
+
+inline void* operator new(std::size_t size, memory::ShardedNodeMemoryPool& pool);
+
+namespace memory {
+
+std::ostream& operator<<(std::ostream& os, ShardedNodeMemoryPool const& pool);
+
+// class ShardedNodeMemoryPool
+//
+// A NodeMemoryPool that is split into a number of independent shards, each of
+// which is a NodeMemoryPool with its own mutex, blocks and free list.
+//
+// Every thread allocates from the shard with index ThreadIndex::get() % number_of_shards,
+// so that threads do not contend for the same mutex as long as there are not more threads
+// than shards. Memory is always returned to the shard that it was allocated from (this uses
+// the same back-pointer as NodeMemoryPool::static_free), so that each shard still releases
+// a block as soon as it becomes empty.
+//
+// A thread that frees a chunk of another shard (for example, a consumer that frees messages
+// that were allocated by a producer) does not lock the mutex of that shard: the chunk is
+// pushed onto the lock-free remote-free stack of the owning shard instead, which is
+// drained in one go by the owner when it would otherwise have to allocate a new block
+// (see NodeMemoryPool::remote_free). Note that objects deleted with NodeMemoryPool::static_free
+// (operator delete) always lock the owning shard.
+//
+// Usage is the same as that of NodeMemoryPool:
+//
+// memory::ShardedNodeMemoryPool pool(64);      // Will allocate 64 objects at a time, per shard.
+//
+// memory::Allocator<MyObject, memory::ShardedNodeMemoryPool> allocator(pool);
+// std::shared_ptr<MyObject> ptr = std::allocate_shared<MyObject>(allocator, ...MyObject constructor arguments...);
+//
+// And objects that use `void operator delete(void* ptr) { memory::NodeMemoryPool::static_free(ptr); }`
+// can be created with `new(pool) Foo(42)`.
+//
+// ShardedNodeMemoryPool is thread-safe.
+
+class ShardedNodeMemoryPool
+{
+ private:
+  // Make sure that the mutexes of different shards do not share a cache line.
+  struct alignas(cache_line_size) Shard : NodeMemoryPool
+  {
+    using NodeMemoryPool::NodeMemoryPool;
+  };
+
+  std::vector<std::unique_ptr<Shard>> shards_;
+
+  friend void* ::operator new(std::size_t size, ShardedNodeMemoryPool& pool);
+  void* alloc(size_t size) { return shards_[ThreadIndex::get() % shards_.size()]->alloc(size); }
+
+ public:
+  // A value of 0 for number_of_shards uses std::thread::hardware_concurrency().
+  ShardedNodeMemoryPool(int nchunks, size_t chunk_size = 0, unsigned int number_of_shards = 0);
+
+  template<class Tp>
+  Tp* malloc() { return static_cast<Tp*>(alloc(sizeof(Tp))); }
+
+  void free(void* ptr)
+  {
+    NodeMemoryPool* const owner = NodeMemoryPool::owner(ptr);
+    if (AI_LIKELY(owner == shards_[ThreadIndex::get() % shards_.size()].get()))
+      owner->free(ptr);
+    else
+      owner->remote_free(ptr);
+  }
+
+  // Return the sum of the statistics of all shards.
+  PoolStats::Snapshot stats() const;
+
+  friend std::ostream& operator<<(std::ostream& os, ShardedNodeMemoryPool const& pool);
+};
+
+} // namespace memory
+
+inline void* operator new(std::size_t size, memory::ShardedNodeMemoryPool& pool) { return pool.alloc(size); }
@@ -27,45 +27,93 @@
 
 #include "sys.h"
 #include "SimpleSegregatedStorage.h"
+#include <algorithm>
 #include "debug.h"
 
 namespace memory {
 
-bool SimpleSegregatedStorage::try_allocate_more(std::function<bool()> const& add_new_block)
+void SimpleSegregatedStorageBase::deallocate_chain(PtrTag::FreeNode* first, PtrTag::FreeNode* last)
 {
-  std::scoped_lock<std::mutex> lk(add_block_mutex_);
-  return this->head_tag_.load(std::memory_order_relaxed) != PtrTag::end_of_list || add_new_block();
+  PtrTag head_tag(head_tag_.load(std::memory_order_relaxed));
+  for (;;)
+  {
+    PtrTag const new_head_tag(first, head_tag.tag());
+    last->set_next(head_tag.ptr());
+    // See deallocate() for the reason of the memory order.
+    if (AI_LIKELY(CAS_head_tag(head_tag, new_head_tag, std::memory_order_release)))
+      return;
+    count_cas_retry();
+  }
+}
+
+//static
+PtrTag::FreeNode* SimpleSegregatedStorageBase::link_nodes(void* const* ptrs, size_t n)
+{
+  PtrTag::FreeNode* last = static_cast<PtrTag::FreeNode*>(ptrs[0]);
+  for (size_t i = 1; i < n; ++i)
+  {
+    PtrTag::FreeNode* node = static_cast<PtrTag::FreeNode*>(ptrs[i]);
+    last->set_next(node);
+    last = node;
+  }
+  return last;
+}
+
+void SimpleSegregatedStorageBase::deallocate_n(void* const* ptrs, size_t n)
+{
+  if (AI_UNLIKELY(n == 0))
+    return;
+  PtrTag::FreeNode* const last = link_nodes(ptrs, n);
+  deallocate_chain(static_cast<PtrTag::FreeNode*>(ptrs[0]), last);
 }
 
-// Only call this from the lambda add_new_block that was passed to allocate.
-void SimpleSegregatedStorage::add_block(void* block, size_t block_size, size_t partition_size)
+// Only call this from the lambda add_new_block that was passed to allocate (or otherwise with add_block_mutex_ locked).
+void SimpleSegregatedStorage::add_block(void* block, size_t block_size, size_t partition_size, size_t keep)
 {
   unsigned int const number_of_partitions = block_size / partition_size;
 
-  // block_size must be a multiple of partition_size (at least 2 times).
+  // block_size must be at least 2 times partition_size.
   ASSERT(number_of_partitions > 1);
 
-  char* const first_ptr = static_cast<char*>(block);
-  char* const last_ptr = first_ptr + (number_of_partitions - 1) * partition_size;     // > first_ptr, see ASSERT.
-  char* node = last_ptr;
-  do
-  {
-    char* next_node = node;
-    node = next_node - partition_size;
-    reinterpret_cast<typename PtrTag::FreeNode*>(node)->next_ = reinterpret_cast<typename PtrTag::FreeNode*>(next_node);
-  }
-  while (node != first_ptr);
+  // There is only one bump region; put what is left of the previous one on the free list.
+  while (AI_UNLIKELY(bump_ptr_ != bump_end_))
+    thread_bump_region();
+
+  // Slab colouring: the colour step must not reduce the alignment of the partitions.
+  size_t const leftover = block_size - number_of_partitions * partition_size;
+  size_t const colour_step = std::max(cache_line_size, partition_size & -partition_size);
+  unsigned int const number_of_colours = leftover / colour_step + 1;
+  size_t const colour_offset = (next_colour_++ % number_of_colours) * colour_step;
+
+  // Don't touch the partitions yet; they are put on the free list by thread_bump_region when needed.
+  bump_ptr_ = static_cast<char*>(block) + colour_offset;
+  bump_end_ = bump_ptr_ + number_of_partitions * partition_size;
+  bump_partition_size_ = partition_size;
+  bump_keep_ = std::min(keep, partition_size);
+  hardening::poison(bump_ptr_, bump_end_ - bump_ptr_);
+
+  thread_bump_region();
+}
+
+void SimpleSegregatedStorage::thread_bump_region()
+{
+  // The bump region may not be empty.
+  ASSERT(bump_ptr_ < bump_end_);
+
+  // Thread (at least) one partition, or as many as fit in bump_batch_size bytes.
+  size_t const batch_size = std::max(size_t{1}, bump_batch_size / bump_partition_size_) * bump_partition_size_;
+  char* const first_ptr = bump_ptr_;
+  char* const end = std::min(bump_end_, first_ptr + batch_size);
+  char* const last_ptr = end - bump_partition_size_;
+  bump_ptr_ = end;
 
-  typename PtrTag::FreeNode* const first_node = reinterpret_cast<typename PtrTag::FreeNode*>(first_ptr);
-  typename PtrTag::FreeNode* const last_node = reinterpret_cast<typename PtrTag::FreeNode*>(last_ptr);
-  // Use a tag of zero because this is a completely new block anyway.
-  PtrTag const new_head_tag{first_node, std::uintptr_t{0}};
-  PtrTag head_tag(this->head_tag_.load(std::memory_order_relaxed));
-  do
+  hardening::unpoison(last_ptr, bump_keep_);
+  for (char* node = first_ptr; node != last_ptr; node += bump_partition_size_)
   {
-    last_node->next_ = head_tag.ptr();
+    hardening::unpoison(node, bump_keep_);
+    reinterpret_cast<PtrTag::FreeNode*>(node)->set_next(reinterpret_cast<PtrTag::FreeNode*>(node + bump_partition_size_));
   }
-  while (!this->CAS_head_tag(head_tag, new_head_tag, std::memory_order_release));
+  deallocate_chain(reinterpret_cast<PtrTag::FreeNode*>(first_ptr), reinterpret_cast<PtrTag::FreeNode*>(last_ptr));
 }
 
 } // namespace memory
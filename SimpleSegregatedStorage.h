@@ -28,9 +28,11 @@
 #pragma once
 
 #include "PtrTag.h"
+#include "PoolStats.h"
+#include "CacheLine.h"
+#include "PreemptionPoint.h"
 #include "utils/macros.h"
 #include <atomic>
-#include <functional>
 #include <mutex>
 
 namespace memory {
@@ -65,64 +67,85 @@ namespace memory {
 //
 //   node->next_ = head_;
 //   head_ = node;
+//
+// The bulk operations allocate_chain/allocate_n and deallocate_chain/deallocate_n
+// detach, respectively splice, a whole chain of nodes from/into the free list with
+// a single (successful) CAS:
+//
+//   first = head_
+//   last = first->next_->next_-> ... ->next_   (n - 1 times)
+//   head_ = last->next_;
+//   last->next_ = nullptr;
+//   return first;
+//
+// and
+//
+//   last->next_ = head_;
+//   head_ = first;
 
 // SimpleSegregatedStorageBase
 //
 // Maintains an unordered free list of blocks.
+// Allocation is implemented by the derived classes, that each know how to deal with reaching the end of the list.
 //
 class SimpleSegregatedStorageBase
 {
  protected:
-  std::atomic<std::uintptr_t> head_tag_;        // Encodes a pointer that points to the first free memory block in the free-list,
-                                                // or end_of_list if the free-list is empty. Also encodes a "tag" of a few bits.
+  alignas(hot_alignment<std::atomic<PtrTag::encoded_type>>)
+  std::atomic<PtrTag::encoded_type> head_tag_;  // Encodes a pointer that points to the first free memory block in the free-list,
+                                                // or nullptr if the free-list is empty. Also encodes a "tag" (see PtrTag.h).
+  PoolStats* stats_;                            // If non-null, CAS retries, refills and lock contention are counted here.
 
   // Construct an empty free list.
-  SimpleSegregatedStorageBase() : head_tag_(PtrTag::end_of_list) { }
+  SimpleSegregatedStorageBase() : head_tag_(PtrTag::end_of_list), stats_(nullptr) { }
 
-  // Allow pointers to SimpleSegregatedStorageBase that are allocated on the heap I guess...
-  virtual ~SimpleSegregatedStorageBase() = default;
+  // Only destructed as part of a derived class; SimpleSegregatedStorageBase has no virtual functions, so no vptr.
+  ~SimpleSegregatedStorageBase() = default;
 
-  // Called if `allocate()` runs into the end of the list.
-  // Returning false means that this storage is simply out of memory.
-  virtual bool try_allocate_more(std::function<bool()> const& add_new_block) { return false; }
+  // Link ptrs[0] ... ptrs[n - 1] (n > 0) together through FreeNode::next_ and return the last node.
+  static PtrTag::FreeNode* link_nodes(void* const* ptrs, size_t n);
 
   [[gnu::always_inline]] bool CAS_head_tag(PtrTag& head_tag, PtrTag new_head_tag, std::memory_order order)
   {
+    preemption_point();
     return head_tag_.compare_exchange_weak(head_tag.encoded_, new_head_tag.encoded_, order);
   }
 
+  // Count a failed CAS on head_tag_.
+  void count_cas_retry()
+  {
+    if (stats_)
+      stats_->add(PoolStats::cas_retries);
+  }
+
  public:
+  // Count contention of this free list in `stats`, from now on. Call this before using the storage.
+  void set_stats(PoolStats* stats) { stats_ = stats; }
+
   // Initialize this SimpleSegregatedStorage with an existing free-list.
   void initialize(void* head)
   {
     // Call this after default construction, before using the segregated storage.
-    ASSERT(head_tag_ == PtrTag::end_of_list);
+    ASSERT(PtrTag(head_tag_).is_end_of_list());
     head_tag_ = PtrTag::encode(head, 0);
   }
 
-  void* allocate(std::function<bool()> const& add_new_block)
+  // Splice the chain first ... last (linked through FreeNode::next_) into the free list with a single CAS.
+  // All nodes of the chain must have been previously returned by allocate().
+  void deallocate_chain(PtrTag::FreeNode* first, PtrTag::FreeNode* last);
+
+  // Deallocate ptrs[0] ... ptrs[n - 1], values previously returned by allocate(), with a single CAS.
+  void deallocate_n(void* const* ptrs, size_t n);
+
+  // Detach the whole free list with a single CAS and return its first node (or nullptr if the list was empty).
+  // The returned chain is terminated with a nullptr. This increments the tag, so that a concurrent allocate()
+  // that already read the old head will fail its CAS even if the same node is put back as head later.
+  PtrTag::FreeNode* detach_all()
   {
-    for (;;)
-    {
-      // Load the current value of head_tag_ into `head_tag`.
-      // Use std::memory_order_acquire to synchronize with the std::memory_order_release in deallocate,
-      // so that value of `next` read below will be the value written in deallocate corresponding to
-      // this head value.
-      PtrTag head_tag(head_tag_.load(std::memory_order_acquire));
-      while (head_tag != PtrTag::end_of_list)
-      {
-        PtrTag new_head_tag = head_tag.next();
-        // The std::memory_order_acquire is used in case of failure and required for the next
-        // read of next_ at the top of the current loop (the previous line).
-        if (AI_LIKELY(CAS_head_tag(head_tag, new_head_tag, std::memory_order_acquire)))
-          // Return the old head.
-          return head_tag.ptr();
-        // head_tag_ was changed (the new value is now in `head_tag`). Try again with the new value.
-      }
-      // Reached the end of the list, try to allocate more memory.
-      if (!try_allocate_more(add_new_block))
-        return nullptr;
-    }
+    PtrTag head_tag(head_tag_.load(std::memory_order_acquire));
+    while (!CAS_head_tag(head_tag, PtrTag{nullptr, head_tag.tag() + 1}, std::memory_order_acquire))
+      ;
+    return head_tag.ptr();
   }
 
   // ptr must be a value previously returned by allocate().
@@ -133,26 +156,227 @@ class SimpleSegregatedStorageBase
     for (;;)
     {
       PtrTag const new_head_tag(new_front_node, head_tag.tag());
-      new_front_node->next_ = head_tag.ptr();
+      new_front_node->set_next(head_tag.ptr());
       // The std::memory_order_release is used in the case of success and causes the above
       // store to `new_front_node->next_` to be visible after a load-acquire of head_tag_
       // in allocate that reads the value of this `new_head_tag`.
       if (AI_LIKELY(CAS_head_tag(head_tag, new_head_tag, std::memory_order_release)))
         return;
+      count_cas_retry();
     }
   }
 };
 
+// SimpleSegregatedStorage
+//
+// A SimpleSegregatedStorageBase that can add memory to the free list when it runs empty.
+//
+// The allocating functions take a callable add_new_block, with signature bool(), that is
+// called (in the critical area of add_block_mutex_) when the free list is empty; it should
+// call add_block() and return true, or return false when out of memory. The callable is a
+// template parameter, so that the (lock-free) fast path can be completely inlined; it is
+// only invoked from try_allocate_more, which is never inlined.
+//
+// add_block() does not touch the memory of the new block: the block becomes the "bump region",
+// of which try_allocate_more puts the next bump_batch_size bytes worth of partitions on the
+// free list every time that the free list runs empty, before calling add_new_block again.
+// That way the pages of a new block are only touched when they are actually used.
+//
+//              .--- bump_ptr_                                   bump_end_ ---.
+//              v                                                             v
+//  | free list | untouched partitions ...                                    |
+//
+
 class SimpleSegregatedStorage : public SimpleSegregatedStorageBase
 {
  public:                                // To be used with std::scoped_lock<std::mutex> from calling classes.
+  alignas(hot_alignment<std::mutex>)
   std::mutex add_block_mutex_;          // Protect against calling add_block concurrently.
 
+ private:
+  // The following members are protected by add_block_mutex_.
+  unsigned int next_colour_ = 0;        // The colour of the next block passed to add_block.
+  char* bump_ptr_ = nullptr;            // The first partition of the bump region that is not on the free list yet.
+  char* bump_end_ = nullptr;            // The end of the bump region.
+  size_t bump_partition_size_ = 0;      // The partition size of the bump region.
+  size_t bump_keep_ = 0;                // The number of bytes of each partition that must not be poisoned.
+
+  // Put the next partitions of the (non-empty) bump region on the free list.
+  void thread_bump_region();
+
+  // Called if an allocation runs into the end of the list.
+  // Returning false means that this storage is simply out of memory.
+  template<typename AddNewBlock>
+  [[gnu::noinline]] bool try_allocate_more(AddNewBlock const& add_new_block);
+
  public:
+  // The number of bytes of the bump region that is put on the free list at once.
+  static constexpr size_t bump_batch_size = 4096;
+
   using SimpleSegregatedStorageBase::SimpleSegregatedStorageBase;
 
-  bool try_allocate_more(std::function<bool()> const& add_new_block) override;
-  void add_block(void* block, size_t block_size, size_t partition_size);
+  template<typename AddNewBlock>
+  void* allocate(AddNewBlock const& add_new_block)
+  {
+    for (;;)
+    {
+      // Load the current value of head_tag_ into `head_tag`.
+      // Use std::memory_order_acquire to synchronize with the std::memory_order_release in deallocate,
+      // so that value of `next` read below will be the value written in deallocate corresponding to
+      // this head value.
+      PtrTag head_tag(head_tag_.load(std::memory_order_acquire));
+      while (!head_tag.is_end_of_list())
+      {
+        PtrTag::FreeNode* const next_node = head_tag.ptr()->next();
+        PtrTag new_head_tag(next_node, head_tag.tag() + 1);
+        // The std::memory_order_acquire is used in case of failure and required for the next
+        // read of next_ at the top of the current loop (the previous line).
+        if (AI_LIKELY(CAS_head_tag(head_tag, new_head_tag, std::memory_order_acquire)))
+        {
+          // Only now that the CAS succeeded, next_node is known to be the value that was stored by deallocate.
+          if (hardening::enabled && AI_UNLIKELY(PtrTag::FreeNode::is_misaligned(next_node)))
+            hardening::corruption_detected("corrupted free list pointer", head_tag.ptr());
+          // Return the old head.
+          return head_tag.ptr();
+        }
+        // head_tag_ was changed (the new value is now in `head_tag`). Try again with the new value.
+        count_cas_retry();
+      }
+      // Reached the end of the list, try to allocate more memory.
+      if (!try_allocate_more(add_new_block))
+        return nullptr;
+    }
+  }
+
+  // Detach a chain of at most n (> 0) nodes from the free list with a single CAS.
+  // The returned chain is linked through FreeNode::next_ and terminated with a nullptr.
+  // The length of the chain is returned in `count`: this is less than n if the free list
+  // contained less than n nodes. Returns nullptr (and sets count to zero) if out of memory.
+  template<typename AddNewBlock>
+  PtrTag::FreeNode* allocate_chain(size_t n, size_t& count, AddNewBlock const& add_new_block);
+
+  // Allocate n nodes and write them to ptrs[0] ... ptrs[n - 1].
+  // Returns the number of nodes actually allocated; this is only less than n when out of memory.
+  template<typename AddNewBlock>
+  size_t allocate_n(void** ptrs, size_t n, AddNewBlock const& add_new_block);
+
+  // Partition block (of block_size bytes) into nodes of partition_size bytes and make them available for allocation.
+  // Only the first bump_batch_size bytes worth of nodes are put on the free list immediately (see the bump region above).
+  //
+  // The space that is left over at the end of block (block_size % partition_size bytes) is used
+  // for slab colouring: the first node starts at an offset that is a multiple of cache_line_size,
+  // that is different for consecutive blocks; so that the nodes of different blocks (which are
+  // typically page aligned) do not all map to the same cache sets.
+  //
+  // When compiled with AddressSanitizer the nodes are poisoned, except for their first `keep` bytes.
+  void add_block(void* block, size_t block_size, size_t partition_size, size_t keep = sizeof(PtrTag::FreeNode));
+
+  // The partitions of the last block passed to add_block that are not on the free list yet (see bump_ptr_).
+  // These must be called with add_block_mutex_ locked.
+  char* bump_begin() const { return bump_ptr_; }
+  char* bump_end() const { return bump_end_; }
+  // Forget about the bump region; for example, because its memory is released.
+  void discard_bump_region() { bump_ptr_ = bump_end_ = nullptr; }
 };
 
+template<typename AddNewBlock>
+bool SimpleSegregatedStorage::try_allocate_more(AddNewBlock const& add_new_block)
+{
+  std::unique_lock<std::mutex> lk = stats_ ? stats_->lock(add_block_mutex_) : std::unique_lock<std::mutex>(add_block_mutex_);
+  if (!PtrTag(this->head_tag_.load(std::memory_order_relaxed)).is_end_of_list())
+    return true;
+  // Use the rest of the current block first.
+  if (bump_ptr_ != bump_end_)
+  {
+    thread_bump_region();
+    return true;
+  }
+  if (!add_new_block())
+    return false;
+  if (stats_)
+    stats_->add(PoolStats::refills);
+  return true;
+}
+
+template<typename AddNewBlock>
+PtrTag::FreeNode* SimpleSegregatedStorage::allocate_chain(size_t n, size_t& count, AddNewBlock const& add_new_block)
+{
+  // Requesting zero nodes makes no sense.
+  ASSERT(n > 0);
+  for (;;)
+  {
+    // See allocate() for the reason of the memory order.
+    PtrTag head_tag(head_tag_.load(std::memory_order_acquire));
+    while (!head_tag.is_end_of_list())
+    {
+      // Walk the free list to find the last node of the chain that we want to detach.
+      //
+      // Contrary to allocate(), that only reads head->next_, we follow next_ pointers of nodes
+      // that could have been allocated by another thread in the meantime (after which next_
+      // would contain user data). Therefore, every value of next_ that is read is validated
+      // by checking that head_tag_ didn't change before dereferencing it.
+      PtrTag::FreeNode* last_node = head_tag.ptr();
+      PtrTag::FreeNode* next_node;
+      size_t length = 1;
+      bool stale = false;
+      for (;;)
+      {
+        next_node = last_node->next();
+        if (next_node == nullptr || length == n)
+          break;
+        if (AI_UNLIKELY(head_tag != head_tag_.load(std::memory_order_acquire)))
+        {
+          stale = true;
+          break;
+        }
+        last_node = next_node;
+        ++length;
+      }
+      if (AI_UNLIKELY(stale))
+      {
+        head_tag = head_tag_.load(std::memory_order_acquire);
+        continue;
+      }
+      PtrTag const new_head_tag(next_node, head_tag.tag() + 1);
+      if (AI_LIKELY(CAS_head_tag(head_tag, new_head_tag, std::memory_order_acquire)))
+      {
+        // The chain is now ours.
+        if (hardening::enabled && AI_UNLIKELY(PtrTag::FreeNode::is_misaligned(next_node)))
+          hardening::corruption_detected("corrupted free list pointer", last_node);
+        last_node->set_next(nullptr);
+        count = length;
+        return head_tag.ptr();
+      }
+      // head_tag_ was changed (the new value is now in `head_tag`). Try again with the new value.
+      count_cas_retry();
+    }
+    // Reached the end of the list, try to allocate more memory.
+    if (!try_allocate_more(add_new_block))
+    {
+      count = 0;
+      return nullptr;
+    }
+  }
+}
+
+template<typename AddNewBlock>
+size_t SimpleSegregatedStorage::allocate_n(void** ptrs, size_t n, AddNewBlock const& add_new_block)
+{
+  size_t total = 0;
+  while (total < n)
+  {
+    size_t count;
+    PtrTag::FreeNode* node = allocate_chain(n - total, count, add_new_block);
+    if (AI_UNLIKELY(!node))
+      break;
+    do
+    {
+      ptrs[total++] = node;
+      node = node->next();
+    }
+    while (node);
+  }
+  return total;
+}
+
 } // namespace memory
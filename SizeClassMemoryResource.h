@@ -0,0 +1,269 @@
+/**
+ * memory -- C++ Memory utilities
+ *
+ * @file
+ * @brief Declaration of class SizeClassMemoryResource.
+ *
+ * @Copyright (C) 2026  Carlo Wood.
+ *
+ * pub   dsa3072/C155A4EEE4E527A2 2018-08-16 Carlo Wood (CarloWood on Libera) <carlo@alinoe.com>
+ * fingerprint: 8020 B266 6305 EE2F D53E  6827 C155 A4EE E4E5 27A2
+ *
+ * This file is part of memory.
+ *
+ * memory is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * memory is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with memory.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "NodeMemoryResource.h"
+#include <array>
+#include <cstdint>
+#include <cstdlib>
+#include <new>
+#include "debug.h"
+
+namespace memory {
+
+// The default size classes of SizeClassMemoryResource: the jemalloc small size classes
+// from 8 up to and including 4096 bytes (four classes per doubling).
+struct JemallocSizeClasses
+{
+  static constexpr std::array<size_t, 29> sizes = {
+    8, 16, 32, 48, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320, 384, 448, 512,
+    640, 768, 896, 1024, 1280, 1536, 1792, 2048, 2560, 3072, 3584, 4096
+  };
+};
+
+// class SizeClassMemoryResource
+//
+// A general purpose memory resource for small objects, consisting of an array of
+// NodeMemoryResource's: one per size class. Requests are rounded up to the nearest
+// size class with a constexpr lookup table, and requests larger than the largest
+// size class are served by malloc (just like DequeMemoryResource does).
+//
+// The size classes are configurable with the template parameter, a type with a
+// static constexpr array `sizes`: strictly increasing multiples of `quantum`,
+// the first one at least sizeof(PtrTag::FreeNode). For example,
+//
+//   struct MySizeClasses { static constexpr std::array<size_t, 4> sizes = { 16, 32, 64, 128 }; };
+//   using MyResource = memory::SizeClassMemoryResource<MySizeClasses>;
+//
+// Since every block of a NodeMemoryResource starts at a multiple of its size
+// from the (page aligned) start of a chunk, a block of a size class that is a
+// multiple of 16 is aligned to at least 16 bytes, which is the alignment of
+// std::max_align_t. Requests with a larger alignment use the smallest size class
+// that is a multiple of that alignment (see aligned_size_to_index); if there is
+// none, they are served by the aligned global operator new.
+//
+// Like DequeMemoryResource, the user must create an Initialization object at the top of main:
+//
+//   memory::MemoryPagePool mpp(0x8000);
+//   memory::SizeClassMemoryResource<>::Initialization scmri(mpp);
+//
+// After which arbitrary types can use it for new/delete by deriving from SmallObject:
+//
+//   struct Foo : memory::SmallObject<> { ... };
+//
+template<typename SizeClasses = JemallocSizeClasses>
+class SizeClassMemoryResource
+{
+ public:
+  static constexpr auto const& sizes = SizeClasses::sizes;
+  static constexpr int number_of_size_classes = sizes.size();
+  static constexpr size_t quantum = 8;                          // All sizes must be a multiple of this.
+  static constexpr size_t upper_size = sizes.back();            // Larger sizes are allocated with malloc.
+
+ private:
+  static constexpr bool valid_sizes()
+  {
+    if (sizes[0] < sizeof(PtrTag::FreeNode))
+      return false;
+    for (int index = 0; index < number_of_size_classes; ++index)
+      if (sizes[index] % quantum != 0 || (index > 0 && sizes[index] <= sizes[index - 1]))
+        return false;
+    return true;
+  }
+  static_assert(valid_sizes(), "The size classes must be strictly increasing multiples of quantum, and at least sizeof(PtrTag::FreeNode).");
+  static_assert(number_of_size_classes <= 256, "The lookup table uses uint8_t indices.");
+
+  using lookup_table_type = std::array<uint8_t, upper_size / quantum + 1>;
+
+  // Map (size + quantum - 1) / quantum to the index of the smallest size class that is larger than or equal to size.
+  static constexpr lookup_table_type make_lookup_table()
+  {
+    lookup_table_type table{};
+    int index = 0;
+    for (size_t q = 0; q < table.size(); ++q)
+    {
+      while (sizes[index] < q * quantum)
+        ++index;
+      table[q] = index;
+    }
+    return table;
+  }
+
+  static constexpr lookup_table_type lookup_table = make_lookup_table();
+
+ public:
+  static constexpr int size_to_index(size_t size)
+  {
+    // Do not call this function for sizes larger than upper_size.
+    ASSERT(size <= upper_size);
+    return lookup_table[(size + quantum - 1) / quantum];
+  }
+
+  static constexpr size_t index_to_size(int index) { return sizes[index]; }
+
+  // Return the index of the smallest size class that is larger than or equal to size and a multiple
+  // of alignment (a power of two), or number_of_size_classes if there is no such size class.
+  static constexpr int aligned_size_to_index(size_t size, size_t alignment)
+  {
+    int index = size_to_index(size);
+    while (index < number_of_size_classes && sizes[index] % alignment != 0)
+      ++index;
+    return index;
+  }
+
+ private:
+  // Used by the constructor of s_instance.
+  SizeClassMemoryResource() = default;
+
+  // The actual initialization of node_memory_resources_ must be done after reaching main()
+  // (after initialization of a MemoryPagePool).
+  void init(MemoryPagePoolBase* mpp_ptr, unsigned int magazine_size)
+  {
+    // The largest size class must fit in a block of mpp.
+    ASSERT(upper_size <= mpp_ptr->block_size());
+    for (int index = 0; index < number_of_size_classes; ++index)
+    {
+      size_t const block_size = index_to_size(index);
+      // Size classes that are too small to be stored in a magazine are not cached.
+      node_memory_resources_[index].init(mpp_ptr, block_size, block_size >= MagazineCache::minimum_node_size ? magazine_size : 0);
+    }
+  }
+
+ public:
+  static SizeClassMemoryResource s_instance;
+
+  // SizeClassMemoryResource must be initialized after creating the (a) MemoryPagePool, and
+  // before the first allocation.
+  //
+  // For example,
+  //
+  // memory::MemoryPagePool mpp(0x8000);                                 // Allocate 32kB at a time.
+  // memory::SizeClassMemoryResource<>::Initialization scmri(mpp, 32);   // Use magazines of 32 nodes per thread.
+  //
+  struct Initialization
+  {
+    Initialization(MemoryPagePoolBase& mpp, unsigned int magazine_size = 0)
+    {
+      s_instance.init(&mpp, magazine_size);
+    }
+  };
+
+  void* allocate(size_t number_of_bytes)
+  {
+    // Make small sizes the fast path.
+    if (AI_UNLIKELY(number_of_bytes > upper_size))
+      return std::malloc(number_of_bytes);
+    int const index = size_to_index(number_of_bytes);
+    return node_memory_resources_[index].allocate(index_to_size(index));
+  }
+
+  void deallocate(void* p, size_t number_of_bytes)
+  {
+    if (AI_UNLIKELY(number_of_bytes > upper_size))
+    {
+      std::free(p);
+      return;
+    }
+    node_memory_resources_[size_to_index(number_of_bytes)].deallocate(p);
+  }
+
+  // Allocate number_of_bytes aligned to alignment, which must be a power of two.
+  void* allocate(size_t number_of_bytes, size_t alignment)
+  {
+    int const index = aligned_index(number_of_bytes, alignment);
+    if (AI_UNLIKELY(index == number_of_size_classes))
+      return ::operator new(number_of_bytes, std::align_val_t{alignment}, std::nothrow);
+    return node_memory_resources_[index].allocate(index_to_size(index));
+  }
+
+  // Deallocate p that was returned by allocate(number_of_bytes, alignment).
+  void deallocate(void* p, size_t number_of_bytes, size_t alignment)
+  {
+    int const index = aligned_index(number_of_bytes, alignment);
+    if (AI_UNLIKELY(index == number_of_size_classes))
+    {
+      ::operator delete(p, std::align_val_t{alignment});
+      return;
+    }
+    node_memory_resources_[index].deallocate(p);
+  }
+
+ private:
+  // Return the index of the size class that serves number_of_bytes with the given alignment, or number_of_size_classes
+  // if the request must be served by the global operator new. Blocks are never aligned beyond the memory page size.
+  static int aligned_index(size_t number_of_bytes, size_t alignment)
+  {
+    if (AI_UNLIKELY(number_of_bytes > upper_size || alignment > MemoryPagePoolBase::memory_page_size()))
+      return number_of_size_classes;
+    return aligned_size_to_index(number_of_bytes, alignment);
+  }
+
+  std::array<NodeMemoryResource, number_of_size_classes> node_memory_resources_ = {};
+};
+
+//static
+template<typename SizeClasses>
+SizeClassMemoryResource<SizeClasses> SizeClassMemoryResource<SizeClasses>::s_instance;
+
+// Derive from SmallObject<> to let new and delete of that type use SizeClassMemoryResource<>::s_instance.
+//
+// Note that delete passes the size of the static type, so if objects are deleted
+// through a pointer to a base class then that base class must have a virtual destructor.
+// Arrays (new[] / delete[]) still use the global operators.
+template<typename SizeClasses = JemallocSizeClasses>
+struct SmallObject
+{
+  static void* operator new(size_t size)
+  {
+    void* ptr = SizeClassMemoryResource<SizeClasses>::s_instance.allocate(size);
+    if (AI_UNLIKELY(ptr == nullptr))
+      throw std::bad_alloc();
+    return ptr;
+  }
+
+  // Used for types with an alignment larger than __STDCPP_DEFAULT_NEW_ALIGNMENT__.
+  static void* operator new(size_t size, std::align_val_t alignment)
+  {
+    void* ptr = SizeClassMemoryResource<SizeClasses>::s_instance.allocate(size, static_cast<size_t>(alignment));
+    if (AI_UNLIKELY(ptr == nullptr))
+      throw std::bad_alloc();
+    return ptr;
+  }
+
+  static void operator delete(void* ptr, size_t size)
+  {
+    SizeClassMemoryResource<SizeClasses>::s_instance.deallocate(ptr, size);
+  }
+
+  static void operator delete(void* ptr, size_t size, std::align_val_t alignment)
+  {
+    SizeClassMemoryResource<SizeClasses>::s_instance.deallocate(ptr, size, static_cast<size_t>(alignment));
+  }
+};
+
+} // namespace memory
@@ -0,0 +1,84 @@
+/**
+ * memory -- C++ Memory utilities
+ *
+ * @file
+ * @brief Definition of class ThreadIndex.
+ *
+ * @Copyright (C) 2026  Carlo Wood.
+ *
+ * pub   dsa3072/C155A4EEE4E527A2 2018-08-16 Carlo Wood (CarloWood on Libera) <carlo@alinoe.com>
+ * fingerprint: 8020 B266 6305 EE2F D53E  6827 C155 A4EE E4E5 27A2
+ *
+ * This file is part of memory.
+ *
+ * memory is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * memory is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with memory.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "sys.h"
+#include "ThreadIndex.h"
+#include <algorithm>
+#include <mutex>
+#include <vector>
+#include "debug.h"
+
+namespace memory {
+
+//static
+thread_local ThreadIndex::index_type ThreadIndex::t_index = ThreadIndex::uninitialized;
+
+namespace {
+
+std::mutex s_indices_mutex;             // Protects s_indices_in_use.
+std::vector<bool> s_indices_in_use;     // s_indices_in_use[i] is true iff index i is currently assigned to a thread.
+
+} // namespace
+
+struct ThreadIndex::Releaser
+{
+  index_type index_;
+
+  Releaser(index_type index) : index_(index) { }
+
+  ~Releaser()
+  {
+    {
+      std::scoped_lock<std::mutex> lock(s_indices_mutex);
+      s_indices_in_use[index_] = false;
+    }
+    // Other thread_local objects might still use the index while being destructed after us.
+    // From now on get() returns `none` for this thread.
+    t_index = none;
+  }
+};
+
+//static
+ThreadIndex::index_type ThreadIndex::acquire()
+{
+  index_type index;
+  {
+    std::scoped_lock<std::mutex> lock(s_indices_mutex);
+    auto iter = std::find(s_indices_in_use.begin(), s_indices_in_use.end(), false);
+    index = iter - s_indices_in_use.begin();
+    if (iter == s_indices_in_use.end())
+      s_indices_in_use.push_back(true);
+    else
+      *iter = true;
+  }
+  // Construct the releaser object the first time we get here (for this thread).
+  static thread_local Releaser releaser(index);
+  t_index = index;
+  return index;
+}
+
+} // namespace memory
@@ -0,0 +1,77 @@
+/**
+ * memory -- C++ Memory utilities
+ *
+ * @file
+ * @brief Declaration of class ThreadIndex.
+ *
+ * @Copyright (C) 2026  Carlo Wood.
+ *
+ * pub   dsa3072/C155A4EEE4E527A2 2018-08-16 Carlo Wood (CarloWood on Libera) <carlo@alinoe.com>
+ * fingerprint: 8020 B266 6305 EE2F D53E  6827 C155 A4EE E4E5 27A2
+ *
+ * This file is part of memory.
+ *
+ * memory is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * memory is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with memory.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "utils/macros.h"
+#include <limits>
+
+namespace memory {
+
+// class ThreadIndex
+//
+// Assigns a small, dense, non-negative integer to every thread that asks for one.
+// The index of a thread that exits is recycled and will be handed out to the next
+// thread that asks for an index, so that the number of distinct indices in use is
+// never larger than the maximum number of threads that were alive at the same time.
+//
+// This is used to index per-thread data that is stored in pool objects (rather than
+// in thread_local storage), so that each pool can have its own per-thread cache.
+// Note that because indices are recycled, the per-thread data must be in a valid state
+// when a thread exits: the next thread with the same index will simply continue to use it.
+//
+class ThreadIndex
+{
+ public:
+  using index_type = unsigned int;
+
+  // Returned by get() when the thread is being destructed (after its index was released).
+  // Because this value is larger than any sane array size it can be used as-is to test
+  // if the index is in range.
+  static constexpr index_type none = std::numeric_limits<index_type>::max() - 1;
+
+ private:
+  static constexpr index_type uninitialized = std::numeric_limits<index_type>::max();
+
+  static thread_local index_type t_index;       // Trivially destructible, so that it remains accessible during thread exit.
+
+  struct Releaser;                              // Releases the index of a thread when that thread exits.
+
+  static index_type acquire();
+
+ public:
+  // Return the index of the current thread.
+  [[gnu::always_inline]] static index_type get()
+  {
+    index_type index = t_index;
+    if (AI_UNLIKELY(index == uninitialized))
+      index = acquire();
+    return index;
+  }
+};
+
+} // namespace memory
@@ -0,0 +1,466 @@
+/**
+ * memory -- C++ Memory utilities
+ *
+ * @file
+ * @brief Benchmarks of the allocators of the memory submodule.
+ *
+ * @Copyright (C) 2026  Carlo Wood.
+ *
+ * pub   dsa3072/C155A4EEE4E527A2 2018-08-16 Carlo Wood (CarloWood on Libera) <carlo@alinoe.com>
+ * fingerprint: 8020 B266 6305 EE2F D53E  6827 C155 A4EE E4E5 27A2
+ *
+ * This file is part of memory.
+ *
+ * memory is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * memory is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with memory.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+// Usage: memory_benchmark [-n <operations>] [-t <max threads>] [-f <filter>]
+//
+// Runs the following benchmarks for a number of allocators of fixed size objects
+// (the system malloc, NodeMemoryPool, ShardedNodeMemoryPool, NodeMemoryResource with
+// and without MagazineCache, MappedSegregatedStorage and MemoryMappedPool, the latter
+// with page sized blocks):
+//
+//   latency       Single threaded: replace a random object of a working set (a free followed by an allocation).
+//                 Reports percentiles of the time per replacement, measured over batches of operations.
+//   threads       Every thread does the same as `latency`, on its own working set, for 1, 2, 4, ... max threads.
+//                 Reports the total throughput.
+//   cross         Producer/consumer pairs: the producer allocates, the consumer frees (cross-thread free).
+//                 Reports the total throughput.
+//
+// and a few container scenarios (std::deque with DequeAllocator, std::list and std::allocate_shared
+// with memory::Allocator<T, NodeMemoryPool>) compared with std::allocator.
+//
+// Only benchmarks whose name contains <filter> are run.
+
+#include "sys.h"
+#include "memory/DequeAllocator.h"
+#include "memory/DequeMemoryResource.h"
+#include "memory/MappedSegregatedStorage.h"
+#include "memory/MemoryMappedPool.h"
+#include "memory/MemoryPagePool.h"
+#include "memory/NodeMemoryPool.h"
+#include "memory/NodeMemoryResource.h"
+#include "memory/ShardedNodeMemoryPool.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <filesystem>
+#include <list>
+#include <memory>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+#include <sys/mman.h>
+#include <unistd.h>
+#include "debug.h"
+
+#ifndef MEMORY_BENCHMARK_SYSTEM_ALLOCATOR
+#define MEMORY_BENCHMARK_SYSTEM_ALLOCATOR "malloc"
+#endif
+
+namespace {
+
+using clock_type = std::chrono::steady_clock;
+
+constexpr size_t object_size = 64;              // The size of the fixed size allocations.
+constexpr size_t working_set_size = 1024;       // The number of live objects per thread.
+constexpr size_t batch_size = 64;               // The number of operations per latency sample.
+
+struct Object
+{
+  char data[object_size];
+};
+
+struct Options
+{
+  size_t operations = 1000000;                  // The number of operations per benchmark (per thread).
+  unsigned int max_threads = std::max(1U, std::thread::hardware_concurrency());
+  std::string filter;
+};
+
+Options options;
+
+bool selected(std::string const& name)
+{
+  return name.find(options.filter) != std::string::npos;
+}
+
+double elapsed_ns(clock_type::time_point start)
+{
+  return std::chrono::duration<double, std::nano>(clock_type::now() - start).count();
+}
+
+// Print the percentiles of samples (in nanoseconds per operation).
+void print_percentiles(char const* benchmark, char const* allocator, std::vector<double>& samples)
+{
+  std::sort(samples.begin(), samples.end());
+  auto percentile = [&](double p){ return samples[std::min(samples.size() - 1, static_cast<size_t>(p * samples.size()))]; };
+  std::printf("%-10s %-28s p50 %8.1f  p90 %8.1f  p99 %8.1f  p99.9 %8.1f  max %9.1f ns/op\n",
+      benchmark, allocator, percentile(0.5), percentile(0.9), percentile(0.99), percentile(0.999), samples.back());
+}
+
+void print_throughput(char const* benchmark, char const* allocator, unsigned int threads, size_t operations, double ns)
+{
+  std::printf("%-10s %-28s %3u threads %10.2f Mops/s\n", benchmark, allocator, threads, operations * 1e3 / ns);
+}
+
+//----------------------------------------------------------------------------
+// The allocators of fixed size objects.
+//
+// Every adaptor has a name, and a thread-safe allocate() and deallocate(void*).
+
+struct SystemMalloc
+{
+  static constexpr char const* name = MEMORY_BENCHMARK_SYSTEM_ALLOCATOR;
+  void* allocate() { return std::malloc(object_size); }
+  void deallocate(void* ptr) { std::free(ptr); }
+};
+
+struct NodeMemoryPoolAdaptor
+{
+  static constexpr char const* name = "NodeMemoryPool";
+  memory::NodeMemoryPool pool_{128, object_size};
+  void* allocate() { return pool_.malloc<Object>(); }
+  void deallocate(void* ptr) { pool_.free(ptr); }
+};
+
+struct ShardedNodeMemoryPoolAdaptor
+{
+  static constexpr char const* name = "ShardedNodeMemoryPool";
+  memory::ShardedNodeMemoryPool pool_{128, object_size};
+  void* allocate() { return pool_.malloc<Object>(); }
+  void deallocate(void* ptr) { pool_.free(ptr); }
+};
+
+template<unsigned int magazine_size>
+struct NodeMemoryResourceAdaptor
+{
+  static constexpr char const* name = magazine_size ? "NodeMemoryResource+Magazine" : "NodeMemoryResource";
+  memory::MemoryPagePool mpp_{0x8000};
+  memory::NodeMemoryResource nmr_{mpp_, object_size, magazine_size};
+  void* allocate() { return nmr_.allocate(object_size); }
+  void deallocate(void* ptr) { nmr_.deallocate(ptr); }
+};
+
+// MemoryMappedPool only supports blocks that are a multiple of the memory page size;
+// therefore these are page sized objects, of which only the first object_size bytes are used.
+struct MemoryMappedPoolAdaptor
+{
+  static constexpr char const* name = "MemoryMappedPool (page)";
+  std::filesystem::path const filename_ =
+    std::filesystem::temp_directory_path() / ("memory_benchmark." + std::to_string(::getpid()) + ".mmp");
+  memory::MemoryMappedPool pool_;
+
+  MemoryMappedPoolAdaptor() :
+    pool_(filename_, memory::MemoryPagePoolBase::memory_page_size(), 0x100000, memory::MemoryMappedPool::Mode::persistent, false, size_t{1} << 32) { }
+  ~MemoryMappedPoolAdaptor() { std::filesystem::remove(filename_); }
+
+  void* allocate() { return pool_.allocate(); }
+  void deallocate(void* ptr) { pool_.deallocate(ptr); }
+};
+
+// The free list of MemoryMappedPool, with object_size blocks, on a (lazily committed) anonymous mapping.
+struct MappedSegregatedStorageAdaptor
+{
+  static constexpr char const* name = "MappedSegregatedStorage";
+  static constexpr size_t size_ = size_t{1} << 32;
+  void* const region_ = ::mmap(nullptr, size_, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  memory::MappedSegregatedStorage mss_;
+
+  // Anonymous memory is zero filled, like a new file: the NULL next pointers mean "the next block".
+  MappedSegregatedStorageAdaptor()
+  {
+    if (region_ == MAP_FAILED)
+    {
+      std::perror("mmap");
+      std::exit(EXIT_FAILURE);
+    }
+    mss_.initialize(region_);
+  }
+  ~MappedSegregatedStorageAdaptor() { ::munmap(region_, size_); }
+
+  void* allocate() { return mss_.allocate(region_, size_, object_size); }
+  void deallocate(void* ptr) { mss_.deallocate(ptr); }
+};
+
+//----------------------------------------------------------------------------
+// Fixed size benchmarks.
+
+// Replace random objects of a working set of working_set_size objects, `operations` times.
+// If samples is non-null, the time per replacement of every batch is added to it.
+template<typename Allocator>
+void replace_objects(Allocator& allocator, size_t operations, unsigned int seed, std::vector<double>* samples)
+{
+  std::vector<void*> working_set(working_set_size);
+  for (void*& ptr : working_set)
+    ptr = allocator.allocate();
+  // Generate the random slots up front, so that the random number generator is not measured.
+  std::mt19937 generator(seed);
+  std::vector<unsigned int> slots(batch_size);
+  for (size_t done = 0; done < operations; done += batch_size)
+  {
+    for (unsigned int& slot : slots)
+      slot = generator() % working_set_size;
+    auto const start = clock_type::now();
+    for (unsigned int slot : slots)
+    {
+      allocator.deallocate(working_set[slot]);
+      working_set[slot] = allocator.allocate();
+      // Touch the memory, like a real application would.
+      static_cast<Object*>(working_set[slot])->data[0] = 1;
+    }
+    if (samples)
+      samples->push_back(elapsed_ns(start) / batch_size);
+  }
+  for (void* ptr : working_set)
+    allocator.deallocate(ptr);
+}
+
+template<typename Allocator>
+void latency()
+{
+  if (!selected(std::string("latency ") + Allocator::name))
+    return;
+  Allocator allocator;
+  std::vector<double> samples;
+  samples.reserve(options.operations / batch_size + 1);
+  replace_objects(allocator, options.operations / 10, 1, nullptr);      // Warm up.
+  replace_objects(allocator, options.operations, 2, &samples);
+  print_percentiles("latency", Allocator::name, samples);
+}
+
+template<typename Allocator>
+void threads()
+{
+  if (!selected(std::string("threads ") + Allocator::name))
+    return;
+  for (unsigned int number_of_threads = 1; number_of_threads <= options.max_threads; number_of_threads *= 2)
+  {
+    Allocator allocator;
+    std::atomic<bool> go{false};
+    std::vector<std::thread> workers;
+    for (unsigned int t = 0; t < number_of_threads; ++t)
+      workers.emplace_back([&, t](){
+        while (!go.load(std::memory_order_acquire))
+          std::this_thread::yield();
+        replace_objects(allocator, options.operations, t, nullptr);
+      });
+    auto const start = clock_type::now();
+    go.store(true, std::memory_order_release);
+    for (std::thread& worker : workers)
+      worker.join();
+    print_throughput("threads", Allocator::name, number_of_threads, number_of_threads * options.operations, elapsed_ns(start));
+  }
+}
+
+// A bounded single producer, single consumer queue.
+class SpscQueue
+{
+  static constexpr size_t capacity = 1024;      // Must be a power of two.
+  std::vector<void*> buffer_ = std::vector<void*>(capacity);
+  alignas(64) std::atomic<size_t> head_{0};     // The next element to pop.
+  alignas(64) std::atomic<size_t> tail_{0};     // The next element to push.
+
+ public:
+  void push(void* ptr)
+  {
+    size_t const tail = tail_.load(std::memory_order_relaxed);
+    while (tail - head_.load(std::memory_order_acquire) == capacity)
+      std::this_thread::yield();
+    buffer_[tail & (capacity - 1)] = ptr;
+    tail_.store(tail + 1, std::memory_order_release);
+  }
+
+  void* pop()
+  {
+    size_t const head = head_.load(std::memory_order_relaxed);
+    while (tail_.load(std::memory_order_acquire) == head)
+      std::this_thread::yield();
+    void* ptr = buffer_[head & (capacity - 1)];
+    head_.store(head + 1, std::memory_order_release);
+    return ptr;
+  }
+};
+
+template<typename Allocator>
+void cross()
+{
+  if (!selected(std::string("cross ") + Allocator::name))
+    return;
+  for (unsigned int number_of_pairs = 1; 2 * number_of_pairs <= options.max_threads; number_of_pairs *= 2)
+  {
+    Allocator allocator;
+    std::atomic<bool> go{false};
+    std::vector<std::unique_ptr<SpscQueue>> queues;
+    std::vector<std::thread> workers;
+    for (unsigned int p = 0; p < number_of_pairs; ++p)
+    {
+      SpscQueue* queue = queues.emplace_back(new SpscQueue).get();
+      workers.emplace_back([&, queue](){
+        while (!go.load(std::memory_order_acquire))
+          std::this_thread::yield();
+        for (size_t i = 0; i < options.operations; ++i)
+        {
+          void* ptr = allocator.allocate();
+          static_cast<Object*>(ptr)->data[0] = 1;
+          queue->push(ptr);
+        }
+      });
+      workers.emplace_back([&, queue](){
+        for (size_t i = 0; i < options.operations; ++i)
+          allocator.deallocate(queue->pop());
+      });
+    }
+    auto const start = clock_type::now();
+    go.store(true, std::memory_order_release);
+    for (std::thread& worker : workers)
+      worker.join();
+    print_throughput("cross", Allocator::name, 2 * number_of_pairs, number_of_pairs * options.operations, elapsed_ns(start));
+  }
+}
+
+template<typename Allocator>
+void fixed_size_benchmarks()
+{
+  latency<Allocator>();
+  threads<Allocator>();
+  cross<Allocator>();
+}
+
+//----------------------------------------------------------------------------
+// Container benchmarks.
+
+// Call `operation` options.operations times and print the percentiles of the time per call.
+template<typename Operation>
+void container_benchmark(char const* benchmark, char const* allocator, Operation operation)
+{
+  if (!selected(std::string(benchmark) + " " + allocator))
+    return;
+  std::vector<double> samples;
+  samples.reserve(options.operations / batch_size + 1);
+  for (size_t done = 0; done < options.operations; done += batch_size)
+  {
+    auto const start = clock_type::now();
+    for (size_t i = 0; i < batch_size; ++i)
+      operation(done + i);
+    samples.push_back(elapsed_ns(start) / batch_size);
+  }
+  print_percentiles(benchmark, allocator, samples);
+}
+
+// Use a deque as a FIFO of at most 4096 elements, which continuously allocates and frees blocks.
+template<typename Deque>
+void deque_benchmark(char const* allocator, Deque deque)
+{
+  container_benchmark("deque", allocator, [&](size_t i){
+    deque.push_back(i);
+    if (deque.size() > 4096)
+      deque.pop_front();
+  });
+}
+
+// Use a list as a FIFO of at most working_set_size elements.
+template<typename List>
+void list_benchmark(char const* allocator, List list)
+{
+  container_benchmark("list", allocator, [&](size_t i){
+    list.push_back(i);
+    if (list.size() > working_set_size)
+      list.pop_front();
+  });
+}
+
+// Replace random shared objects of a working set.
+template<typename MakeShared>
+void shared_benchmark(char const* allocator, MakeShared make_shared)
+{
+  std::vector<std::shared_ptr<Object>> working_set(working_set_size);
+  for (auto& object : working_set)
+    object = make_shared();
+  std::mt19937 generator(3);
+  container_benchmark("shared", allocator, [&](size_t){
+    working_set[generator() % working_set_size] = make_shared();
+  });
+}
+
+void container_benchmarks(memory::MemoryPagePool& mpp)
+{
+  deque_benchmark("std::allocator", std::deque<size_t>{});
+  {
+    memory::NodeMemoryResource nmr(mpp);
+    memory::DequeAllocator<size_t> allocator(nmr);
+    deque_benchmark("DequeAllocator", std::deque<size_t, decltype(allocator)>(allocator));
+  }
+
+  list_benchmark("std::allocator", std::list<size_t>{});
+  {
+    memory::NodeMemoryPool pool(128);
+    memory::Allocator<size_t, memory::NodeMemoryPool> allocator(pool);
+    list_benchmark("NodeMemoryPool", std::list<size_t, decltype(allocator)>(allocator));
+  }
+
+  shared_benchmark("std::make_shared", [](){ return std::make_shared<Object>(); });
+  {
+    memory::NodeMemoryPool pool(128);
+    memory::Allocator<Object, memory::NodeMemoryPool> allocator(pool);
+    shared_benchmark("NodeMemoryPool", [&](){ return std::allocate_shared<Object>(allocator); });
+  }
+}
+
+void usage(char const* program)
+{
+  std::fprintf(stderr, "Usage: %s [-n <operations>] [-t <max threads>] [-f <filter>]\n", program);
+  std::exit(EXIT_FAILURE);
+}
+
+} // namespace
+
+int main(int argc, char* argv[])
+{
+  Debug(NAMESPACE_DEBUG::init());
+
+  for (int i = 1; i < argc; ++i)
+  {
+    if (i + 1 == argc)
+      usage(argv[0]);
+    if (std::strcmp(argv[i], "-n") == 0)
+      options.operations = std::max(std::strtoul(argv[++i], nullptr, 10), static_cast<unsigned long>(batch_size));
+    else if (std::strcmp(argv[i], "-t") == 0)
+      options.max_threads = std::max(std::strtoul(argv[++i], nullptr, 10), 1UL);
+    else if (std::strcmp(argv[i], "-f") == 0)
+      options.filter = argv[++i];
+    else
+      usage(argv[0]);
+  }
+
+  // Used by DequeAllocator.
+  memory::MemoryPagePool mpp(0x8000);
+  memory::DequeMemoryResource::Initialization dmri(mpp);
+
+  fixed_size_benchmarks<SystemMalloc>();
+  fixed_size_benchmarks<NodeMemoryPoolAdaptor>();
+  fixed_size_benchmarks<ShardedNodeMemoryPoolAdaptor>();
+  fixed_size_benchmarks<NodeMemoryResourceAdaptor<0>>();
+  fixed_size_benchmarks<NodeMemoryResourceAdaptor<32>>();
+  fixed_size_benchmarks<MappedSegregatedStorageAdaptor>();
+  fixed_size_benchmarks<MemoryMappedPoolAdaptor>();
+  container_benchmarks(mpp);
+}
@@ -0,0 +1,504 @@
+/**
+ * memory -- C++ Memory utilities
+ *
+ * @file
+ * @brief Concurrency stress test of the lock-free free lists of the memory submodule.
+ *
+ * @Copyright (C) 2026  Carlo Wood.
+ *
+ * pub   dsa3072/C155A4EEE4E527A2 2018-08-16 Carlo Wood (CarloWood on Libera) <carlo@alinoe.com>
+ * fingerprint: 8020 B266 6305 EE2F D53E  6827 C155 A4EE E4E5 27A2
+ *
+ * This file is part of memory.
+ *
+ * memory is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * memory is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with memory.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+
+// Usage: memory_stress [-n <operations>] [-t <threads>] [-a <alloc %>] [-b <batch %>] [-k <max held>] [-p <preempt per mille>] [-s <seed>] [-f <filter>]
+//
+// Hammers the lock-free free lists of SimpleSegregatedStorage, MappedSegregatedStorage and
+// NodeMemoryResource (with and without MagazineCache) from <threads> threads, each doing
+// <operations> random allocations and deallocations:
+//
+//   -a  The percentage of operations that allocate (as long as a thread holds less than <max held> blocks).
+//   -b  The percentage of operations that use allocate_n/deallocate_n (of 2 to max_batch blocks) instead of allocate/deallocate.
+//   -k  The maximum number of blocks that a thread holds at any time.
+//   -p  The probability (per mille) that a thread yields at a preemption point. The library must be configured with
+//       -DMEMORY_PREEMPTION_POINTS=ON to have preemption points inside the lock-free algorithms (see PreemptionPoint.h);
+//       otherwise it only yields between operations.
+//
+// Every pool has a fixed amount of memory, so that blocks are reused (and the ABA problem is provoked) as
+// often as possible. The following invariants are checked:
+//
+//   - A block is never handed out to more than one thread at a time (every block has an owner word).
+//   - The contents of an allocated block are not changed by anyone but its owner.
+//   - At the end, every block is free again: draining the pool returns every block exactly once
+//     (except for the nodes that were left behind in the magazines of the exited threads).
+//
+// For each pool the throughput (in Mops/s) and the number of failed compare-and-exchanges are printed.
+// The exit code is non-zero if any invariant was violated.
+//
+// To check for data races too, configure with -DCMAKE_CXX_FLAGS=-fsanitize=thread. The free lists
+// intentionally read the next pointer of a node that may just have been allocated by another thread
+// (the result is discarded by the failing CAS), but those accesses are atomic; no suppressions are needed:
+//
+//   ./memory_stress -t 8 -p 50
+
+#include "sys.h"
+#include "memory/MappedSegregatedStorage.h"
+#include "memory/MemoryPagePool.h"
+#include "memory/NodeMemoryResource.h"
+#include "memory/PreemptionPoint.h"
+#include "memory/SimpleSegregatedStorage.h"
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+#include <sys/mman.h>
+#include "debug.h"
+
+namespace {
+
+using clock_type = std::chrono::steady_clock;
+
+constexpr size_t node_size = 64;                // The size of the blocks of all pools.
+constexpr size_t max_batch = 16;                // The maximum number of blocks per allocate_n/deallocate_n.
+constexpr unsigned int magazine_size = 16;      // The magazine size of NodeMemoryResource+Magazine.
+
+struct Options
+{
+  size_t operations = 1000000;                  // The number of operations per thread.
+  unsigned int threads = std::max(2U, std::thread::hardware_concurrency());
+  unsigned int alloc_percentage = 50;
+  unsigned int batch_percentage = 10;
+  size_t max_held = 256;
+  unsigned int preempt_per_mille = 10;
+  unsigned int seed = 1;
+  std::string filter;
+};
+
+Options options;
+
+bool selected(std::string const& name)
+{
+  return name.find(options.filter) != std::string::npos;
+}
+
+std::atomic<size_t> errors{0};
+
+// Report a violated invariant (only the first few are printed).
+void error(char const* what, void const* ptr)
+{
+  if (errors.fetch_add(1, std::memory_order_relaxed) < 10)
+    std::fprintf(stderr, "ERROR: %s (%p)\n", what, ptr);
+}
+
+// Randomly yield, with a probability of options.preempt_per_mille / 1000.
+void maybe_yield()
+{
+  static thread_local std::minstd_rand engine(std::hash<std::thread::id>{}(std::this_thread::get_id()));
+  if (engine() % 1000 < options.preempt_per_mille)
+    std::this_thread::yield();
+}
+
+// The owner of every block of a region of memory.
+class Tracker
+{
+ private:
+  char* begin_;
+  size_t number_of_blocks_;
+  std::unique_ptr<std::atomic<uint32_t>[]> owners_;     // Zero if the block is free, otherwise the owner.
+
+  std::atomic<uint32_t>* owner_of(void* ptr)
+  {
+    size_t const offset = static_cast<char*>(ptr) - begin_;
+    if (AI_UNLIKELY(static_cast<char*>(ptr) < begin_ || offset / node_size >= number_of_blocks_))
+    {
+      error("pointer outside of the pool", ptr);
+      return nullptr;
+    }
+    // Blocks do not overlap, so offset / node_size is unique even if the blocks are not node_size aligned.
+    return &owners_[offset / node_size];
+  }
+
+ public:
+  Tracker(void* begin, size_t size) :
+    begin_(static_cast<char*>(begin)), number_of_blocks_(size / node_size),
+    owners_(std::make_unique<std::atomic<uint32_t>[]>(number_of_blocks_)) { }
+
+  // Called after ptr was allocated by owner. Returns false if ptr was already allocated.
+  // Relaxed atomics are used on purpose: the tracker must not add synchronization that would hide races from ThreadSanitizer.
+  bool acquire(void* ptr, uint32_t owner)
+  {
+    std::atomic<uint32_t>* owner_ptr = owner_of(ptr);
+    uint32_t expected = 0;
+    if (owner_ptr && AI_UNLIKELY(!owner_ptr->compare_exchange_strong(expected, owner, std::memory_order_relaxed)))
+    {
+      error("block handed out twice", ptr);
+      return false;
+    }
+    // Stamp the last word of the block.
+    uint64_t const stamp = (uint64_t{owner} << 32) | (reinterpret_cast<uintptr_t>(ptr) & 0xffffffff);
+    std::memcpy(static_cast<char*>(ptr) + node_size - sizeof(stamp), &stamp, sizeof(stamp));
+    return owner_ptr != nullptr;
+  }
+
+  // Called before ptr is deallocated by owner.
+  void release(void* ptr, uint32_t owner)
+  {
+    uint64_t stamp;
+    std::memcpy(&stamp, static_cast<char*>(ptr) + node_size - sizeof(stamp), sizeof(stamp));
+    if (AI_UNLIKELY(stamp != ((uint64_t{owner} << 32) | (reinterpret_cast<uintptr_t>(ptr) & 0xffffffff))))
+      error("allocated block was overwritten", ptr);
+    std::atomic<uint32_t>* owner_ptr = owner_of(ptr);
+    uint32_t expected = owner;
+    if (owner_ptr && AI_UNLIKELY(!owner_ptr->compare_exchange_strong(expected, 0, std::memory_order_relaxed)))
+      error("block released by a thread that does not own it", ptr);
+  }
+
+  size_t number_of_blocks() const { return number_of_blocks_; }
+};
+
+//----------------------------------------------------------------------------
+// The tested pools.
+//
+// Every target has a name, a fixed region of memory, thread-safe allocate/deallocate/allocate_n/deallocate_n
+// (allocate returns nullptr when the region is exhausted), stats() and stuck_blocks(): the maximum number of
+// free blocks that can not be drained from the main thread at the end.
+
+// The number of blocks of every pool: enough to never run out, but not more, to maximize reuse.
+size_t capacity()
+{
+  return options.threads * (options.max_held + 2 * magazine_size + max_batch) + 1024;
+}
+
+class SimpleSegregatedStorageTarget
+{
+ private:
+  size_t const size_;
+  void* region_;
+  memory::PoolStats stats_;
+  memory::SimpleSegregatedStorage sss_;
+
+  static bool no_more() { return false; }
+
+ public:
+  static constexpr char const* name = "SimpleSegregatedStorage";
+
+  SimpleSegregatedStorageTarget() : size_(capacity() * node_size), region_(std::aligned_alloc(0x1000, (size_ + 0xfff) & ~size_t{0xfff}))
+  {
+    sss_.set_stats(&stats_);
+    // Do not poison the nodes (the other targets unpoison allocated blocks, this one doesn't).
+    sss_.add_block(region_, size_, node_size, node_size);
+  }
+  ~SimpleSegregatedStorageTarget() { std::free(region_); }
+
+  void* begin() const { return region_; }
+  size_t size() const { return size_; }
+  memory::PoolStats const& stats() const { return stats_; }
+  size_t stuck_blocks() const { return 0; }
+
+  void* allocate() { return sss_.allocate(no_more); }
+  void deallocate(void* ptr) { sss_.deallocate(ptr); }
+  size_t allocate_n(void** ptrs, size_t n) { return sss_.allocate_n(ptrs, n, no_more); }
+  void deallocate_n(void* const* ptrs, size_t n) { sss_.deallocate_n(ptrs, n); }
+};
+
+class MappedSegregatedStorageTarget
+{
+ private:
+  size_t const size_;
+  void* region_;
+  memory::PoolStats stats_;
+  memory::MappedSegregatedStorage mss_;
+
+ public:
+  static constexpr char const* name = "MappedSegregatedStorage";
+
+  // Anonymous memory is zero filled, like a new file: the NULL next pointers mean "the next block".
+  MappedSegregatedStorageTarget() : size_(capacity() * node_size),
+    region_(::mmap(nullptr, size_, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0))
+  {
+    if (region_ == MAP_FAILED)
+    {
+      std::perror("mmap");
+      std::exit(EXIT_FAILURE);
+    }
+    mss_.set_stats(&stats_);
+    mss_.initialize(region_);
+  }
+  ~MappedSegregatedStorageTarget() { ::munmap(region_, size_); }
+
+  void* begin() const { return region_; }
+  size_t size() const { return size_; }
+  memory::PoolStats const& stats() const { return stats_; }
+  size_t stuck_blocks() const { return 0; }
+
+  void* allocate() { return mss_.allocate(region_, size_, node_size); }
+  void deallocate(void* ptr) { mss_.deallocate(ptr); }
+  size_t allocate_n(void** ptrs, size_t n) { return mss_.allocate_n(region_, size_, node_size, ptrs, n); }
+  void deallocate_n(void* const* ptrs, size_t n) { mss_.deallocate_n(ptrs, n); }
+};
+
+// A MemoryPagePoolBase with a fixed number of pages in a single region, as upstream of NodeMemoryResource.
+class FixedRegionPool : public memory::MemoryPagePoolBase
+{
+ private:
+  static constexpr size_t page_size = 0x1000;
+  size_t const size_;
+  void* region_;
+  memory::SimpleSegregatedStorage sss_;
+
+  static bool no_more() { return false; }
+
+ public:
+  FixedRegionPool(size_t size) : MemoryPagePoolBase(page_size), size_((size + page_size - 1) & ~(page_size - 1)),
+    region_(std::aligned_alloc(page_size, size_))
+  {
+    sss_.add_block(region_, size_, page_size, page_size);
+    pool_blocks_ = size_ / page_size;
+  }
+  ~FixedRegionPool() override { std::free(region_); }
+
+  void* allocate() override { return sss_.allocate(no_more); }
+  void deallocate(void* ptr) override { sss_.deallocate(ptr); }
+  std::vector<Region> regions() override { return {{region_, size_}}; }
+
+  void* begin() const { return region_; }
+  size_t size() const { return size_; }
+};
+
+template<unsigned int MagazineSize>
+class NodeMemoryResourceTarget
+{
+ private:
+  // The slack is for the partial last node of every page and the slab colouring.
+  FixedRegionPool mpp_{capacity() * node_size * 9 / 8};
+  memory::NodeMemoryResource nmr_{mpp_, node_size, MagazineSize};
+
+ public:
+  static constexpr char const* name = MagazineSize ? "NodeMemoryResource+Magazine" : "NodeMemoryResource";
+
+  void* begin() const { return mpp_.begin(); }
+  size_t size() const { return mpp_.size(); }
+  memory::PoolStats const& stats() const { return nmr_.stats(); }
+  size_t stuck_blocks() const { return MagazineSize ? options.threads * 2 * MagazineSize : 0; }
+
+  void* allocate() { return nmr_.allocate(node_size); }
+  void deallocate(void* ptr) { nmr_.deallocate(ptr); }
+  size_t allocate_n(void** ptrs, size_t n) { return nmr_.allocate_n(node_size, ptrs, n); }
+  void deallocate_n(void* const* ptrs, size_t n) { nmr_.deallocate_n(ptrs, n); }
+};
+
+//----------------------------------------------------------------------------
+// The stress test.
+
+// Allocate all blocks of target (from the calling thread) and return them in `blocks`.
+// The tracker is used to detect a block that is returned twice (for example, because of a cycle in a free list).
+template<typename Target>
+void drain(Target& target, Tracker& tracker, std::vector<void*>& blocks)
+{
+  blocks.clear();
+  while (blocks.size() <= tracker.number_of_blocks())
+  {
+    void* ptr = target.allocate();
+    if (!ptr)
+      break;
+    if (!tracker.acquire(ptr, 1))
+      break;
+    blocks.push_back(ptr);
+  }
+}
+
+template<typename Target>
+void undrain(Target& target, Tracker& tracker, std::vector<void*> const& blocks)
+{
+  for (void* ptr : blocks)
+  {
+    tracker.release(ptr, 1);
+    target.deallocate(ptr);
+  }
+}
+
+template<typename Target>
+void worker(Target& target, Tracker& tracker, uint32_t owner)
+{
+  std::mt19937 generator(options.seed * 1000003 + owner);
+  std::vector<void*> held;
+  held.reserve(options.max_held);
+  std::array<void*, max_batch> batch;
+  for (size_t done = 0; done < options.operations;)
+  {
+    size_t n = generator() % 100 < options.batch_percentage ? 2 + generator() % (max_batch - 1) : 1;
+    bool const allocate = held.empty() || (held.size() < options.max_held && generator() % 100 < options.alloc_percentage);
+    if (allocate)
+    {
+      n = std::min(n, options.max_held - held.size());
+      size_t count;
+      if (n == 1)
+        count = (batch[0] = target.allocate()) ? 1 : 0;
+      else
+        count = target.allocate_n(batch.data(), n);
+      if (AI_UNLIKELY(count < n))
+        error("pool ran out of blocks", nullptr);
+      for (size_t i = 0; i < count; ++i)
+        if (tracker.acquire(batch[i], owner))
+          held.push_back(batch[i]);
+    }
+    else
+    {
+      n = std::min(n, held.size());
+      for (size_t i = 0; i < n; ++i)
+      {
+        size_t const j = generator() % held.size();
+        batch[i] = held[j];
+        held[j] = held.back();
+        held.pop_back();
+        // Release the block before it is deallocated, after which it can be allocated by another thread.
+        tracker.release(batch[i], owner);
+      }
+      if (n == 1)
+        target.deallocate(batch[0]);
+      else
+        target.deallocate_n(batch.data(), n);
+    }
+    done += n;
+    maybe_yield();
+  }
+  for (void* ptr : held)
+  {
+    tracker.release(ptr, owner);
+    target.deallocate(ptr);
+  }
+}
+
+template<typename Target>
+void stress()
+{
+  if (!selected(Target::name))
+    return;
+  size_t const errors_before = errors.load();
+  Target target;
+  Tracker tracker(target.begin(), target.size());
+
+  // Put all blocks on the free list (this also threads the lazily partitioned memory, if any)
+  // and count them.
+  std::vector<void*> blocks;
+  drain(target, tracker, blocks);
+  size_t const number_of_blocks = blocks.size();
+  undrain(target, tracker, blocks);
+
+  std::atomic<bool> go{false};
+  std::vector<std::thread> workers;
+  for (unsigned int t = 0; t < options.threads; ++t)
+    workers.emplace_back([&, t](){
+      while (!go.load(std::memory_order_acquire))
+        std::this_thread::yield();
+      // Owner 1 is used by the main thread.
+      worker(target, tracker, t + 2);
+    });
+  auto const start = clock_type::now();
+  go.store(true, std::memory_order_release);
+  for (std::thread& worker : workers)
+    worker.join();
+  double const ns = std::chrono::duration<double, std::nano>(clock_type::now() - start).count();
+
+  // Every block must be free again.
+  drain(target, tracker, blocks);
+  if (blocks.size() > number_of_blocks || blocks.size() + target.stuck_blocks() < number_of_blocks)
+  {
+    std::fprintf(stderr, "ERROR: %s: drained %zu blocks, expected %zu", Target::name, blocks.size(), number_of_blocks);
+    if (target.stuck_blocks())
+      std::fprintf(stderr, " (minus at most %zu in magazines)", target.stuck_blocks());
+    std::fprintf(stderr, ".\n");
+    errors.fetch_add(1, std::memory_order_relaxed);
+  }
+  undrain(target, tracker, blocks);
+
+  memory::PoolStats::Snapshot const snapshot = target.stats().snapshot();
+  std::printf("%-28s %3u threads %10.2f Mops/s %12lu CAS retries  %s\n", Target::name, options.threads,
+      options.threads * options.operations * 1e3 / ns, static_cast<unsigned long>(snapshot.counters[memory::PoolStats::cas_retries]),
+      errors.load() == errors_before ? "OK" : "FAILED");
+}
+
+void usage(char const* program)
+{
+  std::fprintf(stderr, "Usage: %s [-n <operations>] [-t <threads>] [-a <alloc %%>] [-b <batch %%>] [-k <max held>] "
+      "[-p <preempt per mille>] [-s <seed>] [-f <filter>]\n", program);
+  std::exit(EXIT_FAILURE);
+}
+
+} // namespace
+
+int main(int argc, char* argv[])
+{
+  Debug(NAMESPACE_DEBUG::init());
+
+  for (int i = 1; i < argc; ++i)
+  {
+    if (i + 1 == argc || argv[i][0] != '-' || std::strlen(argv[i]) != 2)
+      usage(argv[0]);
+    char const* value = argv[++i];
+    switch (argv[i - 1][1])
+    {
+      case 'n':
+        options.operations = std::strtoul(value, nullptr, 10);
+        break;
+      case 't':
+        options.threads = std::max(std::strtoul(value, nullptr, 10), 1UL);
+        break;
+      case 'a':
+        options.alloc_percentage = std::min(std::strtoul(value, nullptr, 10), 100UL);
+        break;
+      case 'b':
+        options.batch_percentage = std::min(std::strtoul(value, nullptr, 10), 100UL);
+        break;
+      case 'k':
+        options.max_held = std::max(std::strtoul(value, nullptr, 10), 1UL);
+        break;
+      case 'p':
+        options.preempt_per_mille = std::min(std::strtoul(value, nullptr, 10), 1000UL);
+        break;
+      case 's':
+        options.seed = std::strtoul(value, nullptr, 10);
+        break;
+      case 'f':
+        options.filter = value;
+        break;
+      default:
+        usage(argv[0]);
+    }
+  }
+
+#ifdef MEMORY_PREEMPTION_POINTS
+  memory::preemption_point_hook = &maybe_yield;
+#endif
+
+  stress<SimpleSegregatedStorageTarget>();
+  stress<MappedSegregatedStorageTarget>();
+  stress<NodeMemoryResourceTarget<0>>();
+  stress<NodeMemoryResourceTarget<magazine_size>>();
+
+  return errors.load() == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
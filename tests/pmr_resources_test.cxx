@@ -0,0 +1,177 @@
+/**
+ * memory -- C++ Memory utilities
+ *
+ * @file
+ * @brief Tests of the std::pmr::memory_resource adaptors of the memory submodule.
+ *
+ * @Copyright (C) 2026  Carlo Wood.
+ *
+ * pub   dsa3072/C155A4EEE4E527A2 2018-08-16 Carlo Wood (CarloWood on Libera) <carlo@alinoe.com>
+ * fingerprint: 8020 B266 6305 EE2F D53E  6827 C155 A4EE E4E5 27A2
+ *
+ * This file is part of memory.
+ *
+ * memory is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * memory is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with memory.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+// Allocates blocks of every size from 1 byte up to a bit beyond the size that each adaptor
+// serves from its pool, so that most sizes are not a multiple of the size of a pointer.
+// Every block is filled completely with a pattern that is checked before the blocks are
+// returned; a block that is smaller than requested overlaps with its neighbour and breaks
+// the pattern (or asserts, in debug mode).
+
+#include "sys.h"
+#include "memory/MemoryPagePool.h"
+#include "memory/PmrResources.h"
+#include "memory/SizeClassMemoryResource.h"
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+#include "debug.h"
+
+namespace {
+
+int failures = 0;
+
+// Allocate `count` blocks of `bytes` bytes with the given alignment from resource, fill and check them and deallocate them again.
+void check_size(std::pmr::memory_resource& resource, char const* name, size_t bytes, size_t alignment, int count = 3)
+{
+  std::vector<unsigned char*> blocks;
+  for (int i = 0; i < count; ++i)
+  {
+    unsigned char* block = static_cast<unsigned char*>(resource.allocate(bytes, alignment));
+    if (reinterpret_cast<uintptr_t>(block) % alignment != 0)
+    {
+      std::fprintf(stderr, "%s: allocate(%zu, %zu) returned a misaligned pointer %p.\n", name, bytes, alignment, block);
+      ++failures;
+    }
+    std::memset(block, static_cast<unsigned char>(bytes + i), bytes);
+    blocks.push_back(block);
+  }
+  for (int i = 0; i < count; ++i)
+  {
+    unsigned char const expected = static_cast<unsigned char>(bytes + i);
+    for (size_t j = 0; j < bytes; ++j)
+      if (blocks[i][j] != expected)
+      {
+        std::fprintf(stderr, "%s: the block returned by allocate(%zu, %zu) overlaps with another block.\n", name, bytes, alignment);
+        ++failures;
+        break;
+      }
+    resource.deallocate(blocks[i], bytes, alignment);
+  }
+}
+
+// Check all sizes up to 2048 bytes, and a selection of the larger sizes up to max_bytes.
+void check_sizes(std::pmr::memory_resource& resource, char const* name, size_t max_bytes, size_t max_alignment)
+{
+  for (size_t alignment = 1; alignment <= max_alignment; alignment *= 2)
+    for (size_t bytes = 1; bytes <= max_bytes; bytes += bytes < 2048 ? 1 : 61)
+      check_size(resource, name, bytes, alignment);
+}
+
+struct SmallFoo : memory::SmallObject<>
+{
+  char data[24];
+};
+
+struct alignas(128) AlignedFoo : memory::SmallObject<>
+{
+  char data[200];
+};
+
+// Aligned beyond the memory page size: served by the global aligned operator new.
+struct alignas(8192) OverAlignedFoo : memory::SmallObject<>
+{
+  char data[100];
+};
+
+} // namespace
+
+int main()
+{
+  Debug(NAMESPACE_DEBUG::init());
+
+  memory::MemoryPagePool mpp(0x8000);
+
+  // PmrDequeResource: every size up till a bit beyond upper_size() (the rest goes upstream).
+  {
+    memory::DequeMemoryResource dmr(mpp);
+    memory::PmrDequeResource resource(std::pmr::get_default_resource(), dmr);
+    check_sizes(resource, "PmrDequeResource", dmr.upper_size() + 2 * sizeof(void*) + 1, alignof(void*));
+  }
+
+  // PmrSizeClassResource: every size and alignment up till a bit beyond the largest size class.
+  {
+    memory::PmrSizeClassResource resource(mpp);
+    check_sizes(resource, "PmrSizeClassResource", mpp.block_size() / memory::PmrSizeClassResource::minimum_blocks_per_chunk + 1, 64);
+
+    // And the same through a container.
+    std::pmr::vector<std::pmr::string> strings(&resource);
+    for (size_t length = 0; length < 1000; length += 7)
+      strings.emplace_back(length, static_cast<char>('a' + length % 26));
+    for (size_t i = 0; i < strings.size(); ++i)
+      if (strings[i].size() != 7 * i || strings[i].find_first_not_of(static_cast<char>('a' + 7 * i % 26)) != std::pmr::string::npos)
+      {
+        std::fprintf(stderr, "PmrSizeClassResource: std::pmr::string %zu was corrupted.\n", i);
+        ++failures;
+      }
+  }
+
+  // PmrNodeResource: every size up till one byte more than the block size.
+  {
+    memory::NodeMemoryResource nmr(mpp, 104);
+    memory::PmrNodeResource resource(nmr);
+    check_sizes(resource, "PmrNodeResource", 105, alignof(void*));
+  }
+
+  // SmallObject: new and delete use SizeClassMemoryResource<>::s_instance, also for over-aligned types.
+  {
+    memory::SizeClassMemoryResource<>::Initialization scmri(mpp);
+    std::vector<SmallFoo*> small;
+    std::vector<AlignedFoo*> aligned;
+    for (int i = 0; i < 100; ++i)
+    {
+      small.push_back(new SmallFoo);
+      aligned.push_back(new AlignedFoo);
+      if (reinterpret_cast<uintptr_t>(small.back()) % alignof(SmallFoo) != 0 ||
+          reinterpret_cast<uintptr_t>(aligned.back()) % alignof(AlignedFoo) != 0)
+      {
+        std::fprintf(stderr, "SmallObject: new returned a misaligned pointer.\n");
+        ++failures;
+      }
+    }
+    OverAlignedFoo* over_aligned = new OverAlignedFoo;
+    if (reinterpret_cast<uintptr_t>(over_aligned) % alignof(OverAlignedFoo) != 0)
+    {
+      std::fprintf(stderr, "SmallObject: new returned a misaligned pointer.\n");
+      ++failures;
+    }
+    delete over_aligned;
+    for (int i = 0; i < 100; ++i)
+    {
+      delete small[i];
+      delete aligned[i];
+    }
+  }
+
+  if (failures > 0)
+  {
+    std::fprintf(stderr, "%d failures.\n", failures);
+    return 1;
+  }
+  std::printf("All tests passed.\n");
+}